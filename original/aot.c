@@ -0,0 +1,41 @@
+#include "common.h"
+
+#if AOT
+
+#include "aot.h"
+#include "compiler.h"
+
+// Hands out the generated functions in the same order cloxc wrote them. A
+// function left without any is interpreted.
+static void attach(ObjFunction *function, AotFn *functions, int count, int *index)
+{
+    if (*index < count) function->aot = functions[*index];
+    (*index)++;
+
+    ValueArray *constants = &function->chunk.constants;
+    for (int i = 0; i < constants->count; i++) {
+        if (IS_FUNCTION(constants->values[i])) {
+            attach(AS_FUNCTION(constants->values[i]), functions, count, index);
+        }
+    }
+}
+
+VMResult aot_interpret(const char *source, AotFn *functions, int count)
+{
+    // The text is a static array in the generated program, so literals can
+    // borrow it for good.
+    ObjFunction *function = compile(source, false);
+    if (function == NULL) return VM_COMPILE_ERROR;
+
+    int index = 0;
+    attach(function, functions, count, &index);
+
+    push(OBJ_VAL(function));
+    ObjClosure *closure = new_closure(function);
+    pop();
+    push(OBJ_VAL(closure));
+
+    return aot_run();
+}
+
+#endif // AOT
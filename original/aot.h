@@ -0,0 +1,48 @@
+#ifndef CLOX_AOT_H
+#define CLOX_AOT_H
+
+#include "common.h"
+
+#if AOT
+
+#include "jit.h"
+#include "object.h"
+#include "vm.h"
+
+/*
+ * The C that cloxc generates for one function. It runs its frame from the
+ * start until the function returns, and reports false if a runtime error was
+ * raised on the way.
+ *
+ * The generated code keeps the stack in frame->slots, and only writes back
+ * vm.stack_top before it calls into the runtime. frame->ip is kept for error
+ * reporting and for stack traces. The bytecode itself is never run.
+*/
+typedef bool (*AotFn)(CallFrame *frame);
+
+/*
+ * Compiles `source` and runs it with the generated code in `functions`. The
+ * script's function comes first, followed by every function nested in it,
+ * depth first, in the order they appear in the constant tables.
+*/
+VMResult aot_interpret(const char *source, AotFn *functions, int count);
+
+// Helpers for calls and returns made from generated code, implemented in
+// vm.c. aot_run() calls the script's closure on top of the stack.
+VMResult aot_run();
+bool aot_call(int arg_count);
+bool aot_tail_call(CallFrame *frame, int arg_count);
+bool aot_invoke(ObjString *name, int arg_count, InlineCache *cache);
+bool aot_super_invoke(ObjString *name, int arg_count, InlineCache *cache);
+void aot_return(CallFrame *frame);
+bool aot_inherit();
+void aot_method(ObjString *name);
+
+static inline bool aot_is_falsey(Value value)
+{
+    return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
+}
+
+#endif // AOT
+
+#endif // CLOX_AOT_H
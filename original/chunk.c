@@ -9,6 +9,12 @@ void init_chunk(Chunk *chunk)
     chunk->code = NULL;
     chunk->lines = NULL;
     init_value_array(&chunk->constants);
+    chunk->cache_capacity = 0;
+    chunk->cache_count = 0;
+    chunk->caches = NULL;
+    chunk->loop_capacity = 0;
+    chunk->loop_count = 0;
+    chunk->loops = NULL;
 }
 
 void free_chunk(Chunk *chunk)
@@ -16,6 +22,8 @@ void free_chunk(Chunk *chunk)
     FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
     FREE_ARRAY(int, chunk->lines, chunk->capacity);
     free_value_array(&chunk->constants);
+    FREE_ARRAY(InlineCache, chunk->caches, chunk->cache_capacity);
+    FREE_ARRAY(LoopSite, chunk->loops, chunk->loop_capacity);
     init_chunk(chunk);
 }
 
@@ -42,3 +50,130 @@ int add_constant(Chunk *chunk, Value value)
     pop();
     return chunk->constants.count - 1;
 }
+
+int add_cache(Chunk *chunk)
+{
+    if (chunk->cache_capacity < chunk->cache_count + 1) {
+        int old = chunk->cache_capacity;
+        chunk->cache_capacity = GROW_CAPACITY(old);
+        chunk->caches = GROW_ARRAY(InlineCache, chunk->caches, old, chunk->cache_capacity);
+    }
+
+    InlineCache *cache = &chunk->caches[chunk->cache_count];
+    cache->shape = NULL;
+    cache->transition = NULL;
+    cache->slot = -1;
+    cache->count = 0;
+    cache->selector = -1;
+    return chunk->cache_count++;
+}
+
+int add_loop(Chunk *chunk)
+{
+    if (chunk->loop_capacity < chunk->loop_count + 1) {
+        int old = chunk->loop_capacity;
+        chunk->loop_capacity = GROW_CAPACITY(old);
+        chunk->loops = GROW_ARRAY(LoopSite, chunk->loops, old, chunk->loop_capacity);
+    }
+
+    LoopSite *loop = &chunk->loops[chunk->loop_count];
+    loop->hotness = 0;
+    loop->aborts = 0;
+    loop->trace = NULL;
+    loop->retired = NULL;
+    return chunk->loop_count++;
+}
+
+// The size in bytes of the instruction at offset, operands included.
+int instruction_length(Chunk *chunk, int offset)
+{
+    switch (chunk->code[offset]) {
+        case OP_INHERIT:
+        case OP_CLOSE_UPVALUE:
+        case OP_POP:
+        case OP_PRINT:
+        case OP_RETURN:
+        case OP_NIL:
+        case OP_TRUE:
+        case OP_FALSE:
+        case OP_NOT:
+        case OP_EQUAL:
+        case OP_GREATER:
+        case OP_LESS:
+        case OP_GREATER_EQUAL:
+        case OP_LESS_EQUAL:
+        case OP_NEGATE:
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+        case OP_GREATER_NUM:
+        case OP_LESS_NUM:
+        case OP_GREATER_EQUAL_NUM:
+        case OP_LESS_EQUAL_NUM:
+        case OP_ADD_NUM:
+        case OP_ADD_STR:
+        case OP_SUBTRACT_NUM:
+        case OP_MULTIPLY_NUM:
+        case OP_DIVIDE_NUM:
+        case OP_LESS_JUMP:
+        case OP_EQUAL_JUMP:
+            return 1;
+        case OP_CLASS:
+        case OP_CONSTANT:
+        case OP_METHOD:
+        case OP_GET_UPVALUE:
+        case OP_SET_UPVALUE:
+        case OP_GET_LOCAL:
+        case OP_SET_LOCAL:
+        case OP_CALL:
+        case OP_TAIL_CALL:
+        case OP_GET_LOCAL_PROPERTY:
+            return 2;
+        case OP_DEFINE_GLOBAL:
+        case OP_GET_GLOBAL:
+        case OP_SET_GLOBAL:
+        case OP_JUMP_IF_FALSE:
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE_POP:
+            return 3;
+        case OP_GET_SUPER:
+        case OP_GET_PROPERTY:
+        case OP_SET_PROPERTY:
+            return 4;
+        case OP_LOOP:
+        case OP_INVOKE:
+        case OP_SUPER_INVOKE:
+            return 5;
+        case OP_CLOSURE: {
+            ObjFunction *function = AS_FUNCTION(chunk->constants.values[chunk->code[offset + 1]]);
+            return 2 + function->upvalue_count * 2;
+        }
+    }
+
+    return 1; // Unreachable
+}
+
+// The instruction a quickened one was rewritten from, the first instruction
+// of a superinstruction's sequence, or the CALL a tail call replaced, for
+// code that reads the bytecode one plain instruction at a time.
+OpCode generic_opcode(OpCode op)
+{
+    switch (op) {
+        case OP_GREATER_NUM:            return OP_GREATER;
+        case OP_LESS_NUM:               return OP_LESS;
+        case OP_GREATER_EQUAL_NUM:      return OP_GREATER_EQUAL;
+        case OP_LESS_EQUAL_NUM:         return OP_LESS_EQUAL;
+        case OP_ADD_NUM:
+        case OP_ADD_STR:                return OP_ADD;
+        case OP_SUBTRACT_NUM:           return OP_SUBTRACT;
+        case OP_MULTIPLY_NUM:           return OP_MULTIPLY;
+        case OP_DIVIDE_NUM:             return OP_DIVIDE;
+        case OP_GET_LOCAL_PROPERTY:     return OP_GET_LOCAL;
+        case OP_LESS_JUMP:              return OP_LESS;
+        case OP_EQUAL_JUMP:             return OP_EQUAL;
+        case OP_JUMP_IF_FALSE_POP:      return OP_JUMP_IF_FALSE;
+        case OP_TAIL_CALL:              return OP_CALL;
+        default:                        return op;
+    }
+}
@@ -37,24 +37,119 @@ typedef enum {
     OP_EQUAL,
     OP_GREATER,
     OP_LESS,
+    OP_GREATER_EQUAL,
+    OP_LESS_EQUAL,
     OP_NEGATE,
     OP_ADD,
     OP_SUBTRACT,
     OP_MULTIPLY,
     OP_DIVIDE,
+
+    // Quickened forms of the arithmetic and comparison instructions. The
+    // interpreter rewrites a generic instruction into one of these once it
+    // has seen the operand types, and rewrites it back if they change. The
+    // compiler never emits them.
+    OP_GREATER_NUM,
+    OP_LESS_NUM,
+    OP_GREATER_EQUAL_NUM,
+    OP_LESS_EQUAL_NUM,
+    OP_ADD_NUM,
+    OP_ADD_STR,
+    OP_SUBTRACT_NUM,
+    OP_MULTIPLY_NUM,
+    OP_DIVIDE_NUM,
+
+    // Superinstructions, picked from the opcode sequences that run most often
+    // in test/benchmark (see OPCODE_PROFILE). The compiler replaces only the
+    // first opcode of a sequence with one of these and leaves the rest of the
+    // sequence in place, so jumps into the middle of it still land on the
+    // original instructions. Each one runs the whole sequence at once.
+    OP_GET_LOCAL_PROPERTY,  // GET_LOCAL, GET_PROPERTY
+    OP_LESS_JUMP,           // LESS, JUMP_IF_FALSE, POP
+    OP_EQUAL_JUMP,          // EQUAL, JUMP_IF_FALSE, POP
+    OP_JUMP_IF_FALSE_POP,   // JUMP_IF_FALSE, POP
+
+    // A CALL whose result the RETURN after it returns, as in `return f(x);`.
+    // The compiler emits it in place of the CALL, and the interpreter runs
+    // the callee in the caller's CallFrame. The RETURN stays behind it for
+    // callees that can't reuse the frame.
+    OP_TAIL_CALL,
 } OpCode;
 
+#define OPCODE_COUNT (OP_TAIL_CALL + 1)
+
+// The number of receiver classes an inline cache remembers before the site is
+// treated as megamorphic and falls back to hashing into the method table.
+#define INLINE_CACHE_SIZE 4
+
+/*
+ * A cached method lookup. The key is the receiver's shape, which also pins
+ * down its class, or the class itself for super calls and for instances in
+ * dictionary mode.
+ *
+ * When the method is an accessor (see AccessorKind) and the key is a shape
+ * that has the field it uses, `inlined` is set and `slot` is where that field
+ * lives, so the invoke site can run the method without calling it.
+*/
+typedef struct {
+    Obj *key;
+    Value method;
+    bool inlined;
+    int slot;
+} CacheEntry;
+
+/*
+ * An inline cache for one property access or invoke site.
+ *
+ * For fields it remembers the shape the field was last found in and the slot
+ * it lives at. A set that added the field also remembers the shape the
+ * instance moved to. For methods, up to INLINE_CACHE_SIZE receivers are
+ * remembered along with the method each one resolved to.
+*/
+typedef struct {
+    ObjShape *shape;
+    ObjShape *transition;
+    int slot;
+    int count;
+    CacheEntry entries[INLINE_CACHE_SIZE];
+    int selector;   // The selector for the site's name, or -1 until it has one
+} InlineCache;
+
+typedef struct Trace Trace;
+
+/*
+ * The state of one loop's back edge, for the trace JIT: how many times it has
+ * jumped back, how many recordings of it have been given up on, and the trace
+ * compiled for it once there is one.
+*/
+typedef struct {
+    int hotness;
+    int aborts;
+    Trace *trace;
+    Trace *retired;
+} LoopSite;
+
 typedef struct {
     int capacity;
     int count;
     uint8_t *code;
     int *lines;
     ValueArray constants;
+    int cache_capacity;
+    int cache_count;
+    InlineCache *caches;
+    int loop_capacity;
+    int loop_count;
+    LoopSite *loops;
 } Chunk;
 
 void init_chunk(Chunk *chunk);
 void free_chunk(Chunk *chunk);
 void write_chunk(Chunk *chunk, uint8_t byte, int line);
 int add_constant(Chunk *chunk, Value value);
+int add_cache(Chunk *chunk);
+int add_loop(Chunk *chunk);
+int instruction_length(Chunk *chunk, int offset);
+OpCode generic_opcode(OpCode op);
 
 #endif // CLOX_CHUNK_H
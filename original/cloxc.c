@@ -0,0 +1,517 @@
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "aot.h"
+#include "compiler.h"
+#include "memory.h"
+#include "vm.h"
+
+/*
+ * An ahead-of-time compiler from Lox to C.
+ *
+ * The script goes through the usual front end, and every function in the
+ * resulting bytecode is translated into a C function that does what the
+ * interpreter would do with it. The stack height at every instruction is
+ * known up front, so stack slots become plain array accesses off
+ * frame->slots. Locals, constants, globals, upvalues, jumps, arithmetic on
+ * numbers and the cached case of field accesses are done inline. Everything
+ * else calls the same runtime helpers the JIT uses.
+ *
+ * The generated program carries the script's source and compiles it again
+ * when it starts. That gives it the same constants, inline caches and line
+ * tables the bytecode had, and the generated code is then attached to each
+ * function in the same order it was written out in.
+ *
+ * The C is compiled with the headers in this directory and linked against
+ * the `clox_runtime` library.
+*/
+
+typedef struct {
+    FILE *out;
+    ObjFunction *function;
+    int *heights;       // The stack height before each instruction, or -1
+    bool *targets;      // Whether a jump lands on each instruction
+} Generator;
+
+static void emit(Generator *gen, const char *fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    fputs("    ", gen->out);
+    vfprintf(gen->out, fmt, args);
+    fputs("\n", gen->out);
+    va_end(args);
+}
+
+static uint8_t byte_at(Generator *gen, int offset)
+{
+    return gen->function->chunk.code[offset];
+}
+
+// The plain instruction at `offset`. Superinstructions are translated one
+// instruction at a time, like the rest of the bytecode.
+static OpCode opcode_at(Generator *gen, int offset)
+{
+    return generic_opcode(byte_at(gen, offset));
+}
+
+static uint16_t short_at(Generator *gen, int offset)
+{
+    return (uint16_t)((byte_at(gen, offset) << 8) | byte_at(gen, offset + 1));
+}
+
+// Where a jump or loop at `offset` lands.
+static int jump_target(Generator *gen, int offset)
+{
+    if (opcode_at(gen, offset) == OP_LOOP) {
+        return offset + 5 - short_at(gen, offset + 1);
+    }
+
+    return offset + 3 + short_at(gen, offset + 1);
+}
+
+// How far the instruction at `offset` moves the stack top.
+static int stack_effect(Generator *gen, int offset)
+{
+    switch (opcode_at(gen, offset)) {
+        case OP_CLASS:
+        case OP_CONSTANT:
+        case OP_CLOSURE:
+        case OP_GET_GLOBAL:
+        case OP_GET_UPVALUE:
+        case OP_GET_LOCAL:
+        case OP_NIL:
+        case OP_TRUE:
+        case OP_FALSE:
+            return 1;
+        case OP_INHERIT:
+        case OP_GET_SUPER:
+        case OP_SET_PROPERTY:
+        case OP_METHOD:
+        case OP_DEFINE_GLOBAL:
+        case OP_CLOSE_UPVALUE:
+        case OP_POP:
+        case OP_PRINT:
+        case OP_EQUAL:
+        case OP_GREATER:
+        case OP_LESS:
+        case OP_GREATER_EQUAL:
+        case OP_LESS_EQUAL:
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+            return -1;
+        case OP_CALL:
+            return -byte_at(gen, offset + 1);
+        case OP_INVOKE:
+            return -byte_at(gen, offset + 2);
+        case OP_SUPER_INVOKE:
+            return -byte_at(gen, offset + 2) - 1;
+        default:
+            return 0;
+    }
+}
+
+static bool reach(Generator *gen, int offset, int height, int *work, int *work_count)
+{
+    if (gen->heights[offset] == -1) {
+        gen->heights[offset] = height;
+        work[(*work_count)++] = offset;
+        return true;
+    }
+
+    return gen->heights[offset] == height;
+}
+
+/*
+ * Works out the stack height before every reachable instruction. The
+ * compiler only ever emits code where each instruction has one height
+ * whichever way it is reached, so a mismatch means the bytecode is broken.
+*/
+static bool analyze(Generator *gen)
+{
+    Chunk *chunk = &gen->function->chunk;
+    int *work = malloc(sizeof(int) * (chunk->count + 1));
+    int work_count = 0;
+    bool ok = reach(gen, 0, gen->function->arity + 1, work, &work_count);
+
+    while (ok && work_count > 0) {
+        int offset = work[--work_count];
+        int height = gen->heights[offset] + stack_effect(gen, offset);
+        int next = offset + instruction_length(chunk, offset);
+
+        switch (opcode_at(gen, offset)) {
+            case OP_JUMP_IF_FALSE:
+                ok = reach(gen, next, height, work, &work_count);
+                // Fallthrough
+            case OP_JUMP:
+            case OP_LOOP: {
+                int target = jump_target(gen, offset);
+                gen->targets[target] = true;
+                ok = ok && reach(gen, target, height, work, &work_count);
+            } break;
+            case OP_RETURN:
+                break;
+            default:
+                ok = reach(gen, next, height, work, &work_count);
+                break;
+        }
+    }
+
+    free(work);
+    return ok;
+}
+
+// Writes back the stack top and ip before a call into the runtime.
+static void sync(Generator *gen, int height, int next)
+{
+    emit(gen, "vm.stack_top = slots + %d;", height);
+    emit(gen, "frame->ip = code + %d;", next);
+}
+
+static void binary_op(Generator *gen, const char *op_name, const char *op, bool comparison, int height, int next)
+{
+    int a = height - 2;
+    int b = height - 1;
+
+    emit(gen, "if (IS_NUMBER(slots[%d]) && IS_NUMBER(slots[%d])) {", a, b);
+    emit(gen, "    slots[%d] = %s(AS_NUMBER(slots[%d]) %s AS_NUMBER(slots[%d]));",
+        a, comparison ? "BOOL_VAL" : "NUMBER_VAL", a, op, b);
+    emit(gen, "} else {");
+    emit(gen, "    vm.stack_top = slots + %d;", height);
+    emit(gen, "    frame->ip = code + %d;", next);
+    emit(gen, "    if (jit_operator(%s) == JIT_ERROR) return false;", op_name);
+    emit(gen, "}");
+}
+
+static void generate_instruction(Generator *gen, int offset, int height)
+{
+    Chunk *chunk = &gen->function->chunk;
+    int next = offset + instruction_length(chunk, offset);
+    int top = height - 1;
+
+    switch (opcode_at(gen, offset)) {
+        case OP_CLASS:
+            sync(gen, height, next);
+            emit(gen, "slots[%d] = OBJ_VAL(new_class(AS_STRING(constants[%d])));", height, byte_at(gen, offset + 1));
+            break;
+        case OP_INHERIT:
+            sync(gen, height, next);
+            emit(gen, "if (!aot_inherit()) return false;");
+            break;
+        case OP_GET_SUPER:
+            sync(gen, height, next);
+            emit(gen, "if (jit_get_super(AS_STRING(constants[%d]), &caches[%d]) == JIT_ERROR) return false;",
+                byte_at(gen, offset + 1), short_at(gen, offset + 2));
+            break;
+        case OP_CONSTANT:
+            emit(gen, "slots[%d] = constants[%d];", height, byte_at(gen, offset + 1));
+            break;
+        case OP_GET_PROPERTY: {
+            int cache = short_at(gen, offset + 2);
+            emit(gen, "if (IS_INSTANCE(slots[%d]) && caches[%d].shape != NULL &&", top, cache);
+            emit(gen, "    caches[%d].shape == AS_INSTANCE(slots[%d])->shape) {", cache, top);
+            emit(gen, "    STAT_INC(property_hits);");
+            emit(gen, "    slots[%d] = AS_INSTANCE(slots[%d])->slots[caches[%d].slot];", top, top, cache);
+            emit(gen, "} else {");
+            emit(gen, "    vm.stack_top = slots + %d;", height);
+            emit(gen, "    frame->ip = code + %d;", next);
+            emit(gen, "    if (jit_get_property(AS_STRING(constants[%d]), &caches[%d]) == JIT_ERROR) return false;",
+                byte_at(gen, offset + 1), cache);
+            emit(gen, "}");
+        } break;
+        case OP_SET_PROPERTY: {
+            int cache = short_at(gen, offset + 2);
+            emit(gen, "if (IS_INSTANCE(slots[%d]) && caches[%d].shape != NULL &&", top - 1, cache);
+            emit(gen, "    caches[%d].shape == AS_INSTANCE(slots[%d])->shape && caches[%d].transition == NULL) {",
+                cache, top - 1, cache);
+            emit(gen, "    STAT_INC(property_hits);");
+            emit(gen, "    AS_INSTANCE(slots[%d])->slots[caches[%d].slot] = slots[%d];", top - 1, cache, top);
+            emit(gen, "    slots[%d] = slots[%d];", top - 1, top);
+            emit(gen, "} else {");
+            emit(gen, "    vm.stack_top = slots + %d;", height);
+            emit(gen, "    frame->ip = code + %d;", next);
+            emit(gen, "    if (jit_set_property(AS_STRING(constants[%d]), &caches[%d]) == JIT_ERROR) return false;",
+                byte_at(gen, offset + 1), cache);
+            emit(gen, "}");
+        } break;
+        case OP_METHOD:
+            sync(gen, height, next);
+            emit(gen, "aot_method(AS_STRING(constants[%d]));", byte_at(gen, offset + 1));
+            break;
+        case OP_CLOSURE:
+            sync(gen, height, next);
+            emit(gen, "jit_closure(frame, AS_FUNCTION(constants[%d]), code + %d);", byte_at(gen, offset + 1), offset + 2);
+            break;
+        case OP_DEFINE_GLOBAL:
+            emit(gen, "vm.globals.values[%d] = slots[%d];", short_at(gen, offset + 1), top);
+            break;
+        case OP_GET_GLOBAL: {
+            int slot = short_at(gen, offset + 1);
+            emit(gen, "slots[%d] = vm.globals.values[%d];", height, slot);
+            emit(gen, "if (IS_UNDEFINED(slots[%d])) {", height);
+            emit(gen, "    vm.stack_top = slots + %d;", height);
+            emit(gen, "    frame->ip = code + %d;", next);
+            emit(gen, "    jit_get_global(%d);", slot);
+            emit(gen, "    return false;");
+            emit(gen, "}");
+        } break;
+        case OP_SET_GLOBAL: {
+            int slot = short_at(gen, offset + 1);
+            emit(gen, "if (IS_UNDEFINED(vm.globals.values[%d])) {", slot);
+            emit(gen, "    vm.stack_top = slots + %d;", height);
+            emit(gen, "    frame->ip = code + %d;", next);
+            emit(gen, "    jit_set_global(%d);", slot);
+            emit(gen, "    return false;");
+            emit(gen, "}");
+            emit(gen, "vm.globals.values[%d] = slots[%d];", slot, top);
+        } break;
+        case OP_GET_UPVALUE:
+            emit(gen, "slots[%d] = *upvalues[%d]->location;", height, byte_at(gen, offset + 1));
+            break;
+        case OP_SET_UPVALUE:
+            emit(gen, "*upvalues[%d]->location = slots[%d];", byte_at(gen, offset + 1), top);
+            break;
+        case OP_CLOSE_UPVALUE:
+            sync(gen, height, next);
+            emit(gen, "jit_close_upvalue();");
+            break;
+        case OP_GET_LOCAL:
+            emit(gen, "slots[%d] = slots[%d];", height, byte_at(gen, offset + 1));
+            break;
+        case OP_SET_LOCAL:
+            emit(gen, "slots[%d] = slots[%d];", byte_at(gen, offset + 1), top);
+            break;
+        case OP_JUMP_IF_FALSE:
+            emit(gen, "if (aot_is_falsey(slots[%d])) goto L%d;", top, jump_target(gen, offset));
+            break;
+        case OP_JUMP:
+        case OP_LOOP:
+            emit(gen, "goto L%d;", jump_target(gen, offset));
+            break;
+        case OP_CALL:
+            sync(gen, height, next);
+            // A callee that took over the frame is run by whoever called this
+            // function.
+            if (byte_at(gen, offset) == OP_TAIL_CALL) {
+                emit(gen, "if (aot_tail_call(frame, %d)) return true;", byte_at(gen, offset + 1));
+            }
+            emit(gen, "if (!aot_call(%d)) return false;", byte_at(gen, offset + 1));
+            break;
+        case OP_INVOKE:
+            sync(gen, height, next);
+            emit(gen, "if (!aot_invoke(AS_STRING(constants[%d]), %d, &caches[%d])) return false;",
+                byte_at(gen, offset + 1), byte_at(gen, offset + 2), short_at(gen, offset + 3));
+            break;
+        case OP_SUPER_INVOKE:
+            sync(gen, height, next);
+            emit(gen, "if (!aot_super_invoke(AS_STRING(constants[%d]), %d, &caches[%d])) return false;",
+                byte_at(gen, offset + 1), byte_at(gen, offset + 2), short_at(gen, offset + 3));
+            break;
+        case OP_POP:
+            break;
+        case OP_PRINT:
+            sync(gen, height, next);
+            emit(gen, "jit_print();");
+            break;
+        case OP_RETURN:
+            sync(gen, height, next);
+            emit(gen, "aot_return(frame);");
+            emit(gen, "return true;");
+            break;
+        case OP_NIL:
+            emit(gen, "slots[%d] = NIL_VAL;", height);
+            break;
+        case OP_TRUE:
+            emit(gen, "slots[%d] = BOOL_VAL(true);", height);
+            break;
+        case OP_FALSE:
+            emit(gen, "slots[%d] = BOOL_VAL(false);", height);
+            break;
+        case OP_NOT:
+            emit(gen, "slots[%d] = BOOL_VAL(aot_is_falsey(slots[%d]));", top, top);
+            break;
+        case OP_EQUAL:
+            // Comparing two ropes flattens them, which allocates.
+            sync(gen, height, next);
+            emit(gen, "slots[%d] = BOOL_VAL(values_equal(slots[%d], slots[%d]));", top - 1, top - 1, top);
+            break;
+        case OP_GREATER:    binary_op(gen, "OP_GREATER", ">", true, height, next); break;
+        case OP_LESS:       binary_op(gen, "OP_LESS", "<", true, height, next); break;
+        case OP_GREATER_EQUAL: binary_op(gen, "OP_GREATER_EQUAL", ">=", true, height, next); break;
+        case OP_LESS_EQUAL: binary_op(gen, "OP_LESS_EQUAL", "<=", true, height, next); break;
+        case OP_ADD:        binary_op(gen, "OP_ADD", "+", false, height, next); break;
+        case OP_SUBTRACT:   binary_op(gen, "OP_SUBTRACT", "-", false, height, next); break;
+        case OP_MULTIPLY:   binary_op(gen, "OP_MULTIPLY", "*", false, height, next); break;
+        case OP_DIVIDE:     binary_op(gen, "OP_DIVIDE", "/", false, height, next); break;
+        case OP_NEGATE:
+            emit(gen, "if (IS_NUMBER(slots[%d])) {", top);
+            emit(gen, "    slots[%d] = NUMBER_VAL(-AS_NUMBER(slots[%d]));", top, top);
+            emit(gen, "} else {");
+            emit(gen, "    vm.stack_top = slots + %d;", height);
+            emit(gen, "    frame->ip = code + %d;", next);
+            emit(gen, "    jit_operator(OP_NEGATE);");
+            emit(gen, "    return false;");
+            emit(gen, "}");
+            break;
+        default:
+            break; // Quickened and fused opcodes never come out of opcode_at()
+    }
+}
+
+// Writes out `function` and then every function nested in it, in the order
+// aot_interpret() hands the generated code back out.
+static void generate_function(FILE *out, ObjFunction *function, int *index)
+{
+    Chunk *chunk = &function->chunk;
+    Generator gen;
+    gen.out = out;
+    gen.function = function;
+    gen.heights = malloc(sizeof(int) * (chunk->count + 1));
+    gen.targets = calloc(chunk->count + 1, sizeof(bool));
+    for (int i = 0; i <= chunk->count; i++) gen.heights[i] = -1;
+
+    if (!analyze(&gen)) {
+        fprintf(stderr, "Inconsistent stack heights in %s\n",
+            function->name != NULL ? function->name->chars : "script");
+        exit(70);
+    }
+
+    fprintf(out, "// %s\n", function->name != NULL ? function->name->chars : "script");
+    fprintf(out, "static bool function_%d(CallFrame *frame)\n{\n", (*index)++);
+    emit(&gen, "Value *slots = frame->slots;");
+    emit(&gen, "uint8_t *code = frame->closure->function->chunk.code;");
+    emit(&gen, "Value *constants = frame->closure->function->chunk.constants.values;");
+    emit(&gen, "InlineCache *caches = frame->closure->function->chunk.caches;");
+    emit(&gen, "ObjUpvalue **upvalues = frame->closure->upvalues;");
+    emit(&gen, "(void)code; (void)constants; (void)caches; (void)upvalues;");
+
+    for (int offset = 0; offset < chunk->count; offset += instruction_length(chunk, offset)) {
+        if (gen.heights[offset] == -1) continue;
+
+        if (gen.targets[offset]) fprintf(out, "L%d: ;\n", offset);
+        generate_instruction(&gen, offset, gen.heights[offset]);
+    }
+
+    fprintf(out, "}\n\n");
+    free(gen.heights);
+    free(gen.targets);
+
+    ValueArray *constants = &chunk->constants;
+    for (int i = 0; i < constants->count; i++) {
+        if (IS_FUNCTION(constants->values[i])) {
+            generate_function(out, AS_FUNCTION(constants->values[i]), index);
+        }
+    }
+}
+
+static void generate_source(FILE *out, const char *source)
+{
+    fprintf(out, "static const char source[] =\n    \"");
+    for (const char *c = source; *c != '\0'; c++) {
+        switch (*c) {
+            case '\n':  fprintf(out, "\\n\"\n    \""); break;
+            case '\r':  fprintf(out, "\\r"); break;
+            case '\t':  fprintf(out, "\\t"); break;
+            case '"':   fprintf(out, "\\\""); break;
+            case '\\':  fprintf(out, "\\\\"); break;
+            case '?':   fprintf(out, "\\?"); break; // No trigraphs
+            default:
+                if ((unsigned char)*c < ' ') {
+                    fprintf(out, "\\%03o", (unsigned char)*c);
+                } else {
+                    fputc(*c, out);
+                }
+                break;
+        }
+    }
+    fprintf(out, "\";\n\n");
+}
+
+static void generate(FILE *out, const char *path, const char *source, ObjFunction *script)
+{
+    fprintf(out, "// Generated by cloxc from %s. Do not edit.\n\n", path);
+    fprintf(out, "#define AOT 1\n");
+    fprintf(out, "#define NAN_TAGGING %d\n", NAN_TAGGING);
+    fprintf(out, "#define VM_STATS %d\n\n", VM_STATS);
+    fprintf(out, "#include <stdlib.h>\n");
+    fprintf(out, "#include \"aot.h\"\n\n");
+    generate_source(out, source);
+
+    int count = 0;
+    generate_function(out, script, &count);
+
+    fprintf(out, "static AotFn functions[] = {\n");
+    for (int i = 0; i < count; i++) {
+        fprintf(out, "    function_%d,\n", i);
+    }
+    fprintf(out, "};\n\n");
+
+    fprintf(out, "int main()\n{\n");
+    fprintf(out, "    init_vm();\n");
+    fprintf(out, "    VMResult result = aot_interpret(source, functions, %d);\n", count);
+    fprintf(out, "    if (result == VM_COMPILE_ERROR) exit(65);\n");
+    fprintf(out, "    if (result == VM_RUNTIME_ERROR) exit(70);\n\n");
+    fprintf(out, "    free_vm();\n");
+    fprintf(out, "    return 0;\n");
+    fprintf(out, "}\n");
+}
+
+static char *read_file(const char *path)
+{
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) {
+        fprintf(stderr, "Could not open file '%s'. Did you spell it right?\n", path);
+        exit(74);
+    }
+
+    fseek(file, 0L, SEEK_END);
+    size_t file_size = ftell(file);
+    rewind(file);
+
+    char *buffer = (char *)malloc(file_size + 1);
+    if (buffer == NULL) {
+        fprintf(stderr, "Not enough memory to read '%s'\n", path);
+        exit(74);
+    }
+
+    size_t bytes_read = fread(buffer, sizeof(char), file_size, file);
+    if (bytes_read < file_size) {
+        fprintf(stderr, "Could not read file '%s'", path);
+        exit(74);
+    }
+
+    buffer[bytes_read] = '\0';
+    fclose(file);
+    return buffer;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc != 2 && argc != 3) {
+        fprintf(stderr, "Usage: cloxc script.lox [output.c]");
+        exit(64);
+    }
+
+    init_vm();
+
+    char *source = read_file(argv[1]);
+    // The text is only freed when cloxc exits, so literals can borrow it.
+    ObjFunction *script = compile(source, false);
+    if (script == NULL) exit(65);
+
+    FILE *out = argc == 3 ? fopen(argv[2], "w") : stdout;
+    if (out == NULL) {
+        fprintf(stderr, "Could not open file '%s' for writing.\n", argv[2]);
+        exit(74);
+    }
+
+    generate(out, argv[1], source, script);
+    if (out != stdout) fclose(out);
+
+    free(source);
+    free_vm();
+    return 0;
+}
@@ -10,7 +10,104 @@
 // #define DEBUG_STRESS_GC
 // #define DEBUG_LOG_GC
 
-#define NAN_BOXING
 #define UINT8_COUNT (UINT8_MAX + 1)
 
+// Used to clearly mark a flexible array member in a struct.
+#define FLEXIBLE
+
+// Stores a Value as a NaN-boxed double instead of a tagged union. This is the
+// same NAN_TAGGING switch the rewrite in `src` uses. CMake passes this in.
+#ifndef NAN_TAGGING
+    #define NAN_TAGGING 1
+#endif // NAN_TAGGING
+
+#if NAN_TAGGING
+    #define NAN_BOXING
+#endif
+
+// Threaded dispatch relies on the GNU labels-as-values extension, so it is only
+// on by default for compilers known to support it. CMake passes this in.
+#ifndef COMPUTED_GOTO
+    #if defined(__GNUC__) || defined(__clang__)
+        #define COMPUTED_GOTO 1
+    #else
+        #define COMPUTED_GOTO 0
+    #endif
+#endif // COMPUTED_GOTO
+
+// Counts runtime events such as inline cache hits and misses and prints them
+// to stderr when the VM is freed. CMake passes this in.
+#ifndef VM_STATS
+    #define VM_STATS 0
+#endif // VM_STATS
+
+// Compiles hot functions to x86-64 machine code. The code generator only
+// targets x86-64 Linux, so the option is ignored anywhere else. CMake passes
+// this in.
+#ifndef JIT
+    #define JIT 0
+#endif // JIT
+
+#if JIT && !(defined(__x86_64__) && defined(__linux__))
+    #undef JIT
+    #define JIT 0
+#endif
+
+// How many calls and loop iterations a function takes before it is compiled.
+// Zero compiles every function on its first call. CMake passes this in.
+#ifndef JIT_THRESHOLD
+    #define JIT_THRESHOLD 100
+#endif // JIT_THRESHOLD
+
+// Records the path taken through hot loops and compiles it to x86-64 machine
+// code. The trace compiler relies on NaN boxing to guard types cheaply, so
+// like the JIT it is ignored anywhere but x86-64 Linux, and also without NaN
+// boxing. CMake passes this in.
+#ifndef TRACE_JIT
+    #define TRACE_JIT 0
+#endif // TRACE_JIT
+
+#if TRACE_JIT && !(defined(__x86_64__) && defined(__linux__) && defined(NAN_BOXING))
+    #undef TRACE_JIT
+    #define TRACE_JIT 0
+#endif
+
+// How many times a loop jumps back before its next iteration is recorded as
+// a trace. CMake passes this in.
+#ifndef TRACE_THRESHOLD
+    #define TRACE_THRESHOLD 50
+#endif // TRACE_THRESHOLD
+
+// Counts how often each opcode, and each pair and triple of opcodes, runs,
+// and prints the counts to stderr when the VM is freed. Superinstructions are
+// left out so the counts show which sequences are worth fusing. CMake passes
+// this in.
+#ifndef OPCODE_PROFILE
+    #define OPCODE_PROFILE 0
+#endif // OPCODE_PROFILE
+
+// Runs every function as three-address code over the registers of its frame,
+// translated from its stack bytecode, instead of running the bytecode. The
+// JITs and the opcode profile only understand the stack bytecode, so they are
+// turned off. CMake passes this in.
+#ifndef REGISTER_VM
+    #define REGISTER_VM 0
+#endif // REGISTER_VM
+
+#if REGISTER_VM
+    #undef JIT
+    #define JIT 0
+    #undef TRACE_JIT
+    #define TRACE_JIT 0
+    #undef OPCODE_PROFILE
+    #define OPCODE_PROFILE 0
+#endif // REGISTER_VM
+
+// Builds the runtime that programs compiled ahead of time by `cloxc` link
+// against. CMake sets this for the runtime library and `cloxc` only, and
+// `cloxc` writes it into the C it generates.
+#ifndef AOT
+    #define AOT 0
+#endif // AOT
+
 #endif // CLOX_COMMON_H
@@ -7,10 +7,14 @@
 #include "compiler.h"
 #include "object.h"
 #include "memory.h"
+#include "optimizer.h"
+#include "peephole.h"
+#include "registers.h"
 #include "scanner.h"
+#include "vm.h"
 
 #ifdef DEBUG_PRINT_CODE
-#include "include/debug.h"
+#include "debug.h"
 #endif // DEBUG_PRINT_CODE
 
 typedef struct {
@@ -18,6 +22,7 @@ typedef struct {
     Token previous;
     bool had_error;
     bool panic_mode;
+    ObjString *source;      // The text being compiled, which literals point into
 } Parser;
 
 typedef enum {
@@ -69,6 +74,8 @@ typedef struct Compiler {
     int local_count;
     Upvalue upvalues[UINT8_COUNT];
     int scope_depth;
+    int last_call;  // The offset just past the latest OP_CALL
+    int last_get;   // The offset of the latest OP_GET_PROPERTY or OP_GET_SUPER
 } Compiler;
 
 typedef struct ClassCompiler {
@@ -76,9 +83,21 @@ typedef struct ClassCompiler {
     bool has_superclass;
 } ClassCompiler;
 
+/*
+ * Where the operand of the infix rule being parsed starts in the chunk, and
+ * how many constants the chunk had at that point. Constant folding uses it to
+ * tell whether the left operand is a single constant.
+*/
+typedef struct {
+    int start;
+    int constant_count;
+} Operand;
+
 Parser parser;
 Compiler *current = NULL;
 ClassCompiler *current_class = NULL;
+Operand left_operand;
+int optimization_level = 1;
 
 Chunk *current_chunk()
 {
@@ -163,11 +182,17 @@ static void emit_loop(int loop_start)
 {
     emit_byte(OP_LOOP);
 
-    int offset = current_chunk()->count - loop_start + 2;
+    int offset = current_chunk()->count - loop_start + 4;
     if (offset > UINT16_MAX) error("Loop body is too large");
 
     emit_byte((offset >> 8) & 0xff);
     emit_byte(offset & 0xff);
+
+    int loop = add_loop(current_chunk());
+    if (loop > UINT16_MAX) error("Too many loops in one chunk");
+
+    emit_byte((loop >> 8) & 0xff);
+    emit_byte(loop & 0xff);
 }
 
 static int emit_jump(uint8_t instruction)
@@ -206,6 +231,18 @@ static void emit_constant(Value value)
     emit_bytes(OP_CONSTANT, make_constant(value));
 }
 
+// Emits the index of a new inline cache for a property, invoke or super site.
+static void emit_cache()
+{
+    int cache = add_cache(current_chunk());
+    if (cache > UINT16_MAX) {
+        error("Too many property accesses in one chunk");
+    }
+
+    emit_byte((cache >> 8) & 0xff);
+    emit_byte(cache & 0xff);
+}
+
 static void patch_jump(int offset)
 {
     // -2 adjusts for the jump's bytecode offset
@@ -217,6 +254,9 @@ static void patch_jump(int offset)
 
     current_chunk()->code[offset] = (jump >> 8) & 0xff;
     current_chunk()->code[offset + 1] = jump & 0xff;
+
+    // Whatever was read last is no longer the only way to get here.
+    current->last_get = -1;
 }
 
 static void init_compiler(Compiler *compiler, FunctionType type)
@@ -226,7 +266,10 @@ static void init_compiler(Compiler *compiler, FunctionType type)
     compiler->type = type;
     compiler->local_count = 0;
     compiler->scope_depth = 0;
+    compiler->last_call = -1;
+    compiler->last_get = -1;
     compiler->function = new_function();
+    compiler->function->source = parser.source;
     current = compiler;
 
     if (type != TYPE_SCRIPT) {
@@ -247,15 +290,127 @@ static void init_compiler(Compiler *compiler, FunctionType type)
     }
 }
 
+static bool code_at(Chunk *chunk, int offset, OpCode op)
+{
+    return offset < chunk->count && chunk->code[offset] == op;
+}
+
+/*
+ * Notes down whether a method's body is simple enough for invoke sites to run
+ * inline, as one of the forms in AccessorKind. Nothing before the first
+ * return can jump past it, so whatever comes after that is never looked at.
+*/
+static void find_accessor(ObjFunction *function)
+{
+    Chunk *chunk = &function->chunk;
+
+    if (code_at(chunk, 0, OP_GET_LOCAL) && chunk->code[1] == 0) {
+        if (function->arity == 0 && code_at(chunk, 2, OP_GET_PROPERTY) &&
+                code_at(chunk, 6, OP_RETURN)) {
+            function->accessor = ACCESSOR_GETTER;
+            function->field = AS_STRING(chunk->constants.values[chunk->code[3]]);
+        } else if (function->arity == 1 && code_at(chunk, 2, OP_GET_LOCAL) &&
+                chunk->code[3] == 1 && code_at(chunk, 4, OP_SET_PROPERTY)) {
+            if (code_at(chunk, 8, OP_RETURN)) {
+                function->accessor = ACCESSOR_SETTER_RESULT;
+            } else if (code_at(chunk, 8, OP_POP) && code_at(chunk, 9, OP_NIL) &&
+                    code_at(chunk, 10, OP_RETURN)) {
+                function->accessor = ACCESSOR_SETTER;
+            } else {
+                return;
+            }
+            function->field = AS_STRING(chunk->constants.values[chunk->code[5]]);
+        }
+        return;
+    }
+
+    if (code_at(chunk, 0, OP_CONSTANT) && code_at(chunk, 2, OP_RETURN)) {
+        function->constant = chunk->constants.values[chunk->code[1]];
+    } else if (code_at(chunk, 1, OP_RETURN)) {
+        switch (chunk->code[0]) {
+            case OP_NIL:
+                function->constant = NIL_VAL;
+                break;
+            case OP_TRUE:
+                function->constant = BOOL_VAL(true);
+                break;
+            case OP_FALSE:
+                function->constant = BOOL_VAL(false);
+                break;
+            default:
+                return;
+        }
+    } else {
+        return;
+    }
+    function->accessor = ACCESSOR_CONSTANT;
+}
+
+#if !REGISTER_VM
+/*
+ * Replaces the first opcode of every sequence that has a superinstruction.
+ * The rest of the sequence is left alone, so the chunk still reads as plain
+ * instructions to anything that steps through it with instruction_length().
+*/
+static void fuse_superinstructions(Chunk *chunk)
+{
+#if OPCODE_PROFILE
+    // The profile is for finding new sequences worth fusing, so it counts
+    // the plain instructions.
+    return;
+#endif // OPCODE_PROFILE
+
+    for (int offset = 0; offset < chunk->count; offset += instruction_length(chunk, offset)) {
+        int next = offset + instruction_length(chunk, offset);
+        uint8_t *code = chunk->code;
+        if (next >= chunk->count) break;
+
+        switch (code[offset]) {
+            case OP_GET_LOCAL:
+                if (code[next] == OP_GET_PROPERTY) code[offset] = OP_GET_LOCAL_PROPERTY;
+                break;
+            case OP_LESS:
+            case OP_EQUAL:
+                // The POP comes after the jump's two byte offset.
+                if (code[next] == OP_JUMP_IF_FALSE && next + 3 < chunk->count &&
+                        code[next + 3] == OP_POP) {
+                    code[offset] = code[offset] == OP_LESS ? OP_LESS_JUMP : OP_EQUAL_JUMP;
+                }
+                break;
+            case OP_JUMP_IF_FALSE:
+                if (code[next] == OP_POP) code[offset] = OP_JUMP_IF_FALSE_POP;
+                break;
+        }
+    }
+}
+#endif // !REGISTER_VM
+
 static ObjFunction *end_compiler()
 {
     emit_return();
     ObjFunction *function = current->function;
+    if (!parser.had_error && optimization_level >= 1) optimize_chunk(current_chunk());
+    if (!parser.had_error && optimization_level >= 2) optimize_function(function);
+    if (!parser.had_error && optimization_level >= 1 && current->type == TYPE_METHOD) {
+        find_accessor(function);
+    }
+
+#if REGISTER_VM
+    // The register code is what runs, so there is nothing to fuse.
+    if (!parser.had_error && !compile_registers(function)) {
+        error("Function is too large for the register VM");
+    }
+#else
+    fuse_superinstructions(current_chunk());
+#endif // REGISTER_VM
 
 #ifdef DEBUG_PRINT_CODE
     if (!parser.had_error) {
         disassemble_chunk(current_chunk(), function->name != NULL
             ? function->name->chars : "<script>");
+#if REGISTER_VM
+        disassemble_registers(function);
+#endif // REGISTER_VM
     }
 #endif // DEBUG_PRINT_CODE
 
@@ -298,6 +453,21 @@ static uint8_t ident_constant(Token *name)
     return make_constant(OBJ_VAL(copy_string(name->start, name->len)));
 }
 
+static uint16_t global_constant(Token *name)
+{
+    ObjString *string = copy_string(name->start, name->len);
+    push(OBJ_VAL(string));
+    int slot = global_slot(string);
+    pop();
+
+    if (slot > UINT16_MAX) {
+        error("Too many global variables");
+        return 0;
+    }
+
+    return (uint16_t)slot;
+}
+
 static bool identifiers_equal(Token *a, Token *b) {
     if (a->len != b->len) return false;
     return memcmp(a->start, b->start, a->len) == 0;
@@ -390,14 +560,14 @@ static void declare_variable()
     add_local(*name);
 }
 
-static uint8_t parse_variable(const char *message)
+static uint16_t parse_variable(const char *message)
 {
     consume(TK_IDENTIFIER, message);
 
     declare_variable();
     if (current->scope_depth > 0) return 0;
 
-    return ident_constant(&parser.previous);
+    return global_constant(&parser.previous);
 }
 
 static void mark_initialized()
@@ -406,14 +576,15 @@ static void mark_initialized()
     current->locals[current->local_count - 1].depth = current->scope_depth;
 }
 
-static void define_variable(uint8_t global)
+static void define_variable(uint16_t global)
 {
     if (current->scope_depth > 0) {
         mark_initialized();
         return;
     }
 
-    emit_bytes(OP_DEFINE_GLOBAL, global);
+    emit_byte(OP_DEFINE_GLOBAL);
+    emit_bytes((global >> 8) & 0xff, global & 0xff);
 }
 
 static uint8_t argument_list()
@@ -455,19 +626,163 @@ static void or_(bool can_assign)
     patch_jump(end_jump);
 }
 
+/*
+ * Reads the value of the code from start to end if it is nothing but a single
+ * literal, which is what a constant operand compiles to.
+*/
+static bool constant_operand(int start, int end, Value *value)
+{
+    Chunk *chunk = current_chunk();
+
+    if (end - start == 1) {
+        switch (chunk->code[start]) {
+            case OP_NIL:    *value = NIL_VAL; return true;
+            case OP_TRUE:   *value = BOOL_VAL(true); return true;
+            case OP_FALSE:  *value = BOOL_VAL(false); return true;
+            default:        return false;
+        }
+    }
+
+    if (end - start == 2 && chunk->code[start] == OP_CONSTANT) {
+        *value = chunk->constants.values[chunk->code[start + 1]];
+        return true;
+    }
+
+    return false;
+}
+
+// Whether two constants can share a constant table entry. 0 and -0 are equal
+// numbers, but not the same constant.
+static bool same_constant(Value a, Value b)
+{
+    if (IS_NUMBER(a) && IS_NUMBER(b)) {
+        double x = AS_NUMBER(a);
+        double y = AS_NUMBER(b);
+        return memcmp(&x, &y, sizeof(double)) == 0;
+    }
+
+    return values_equal(a, b);
+}
+
+/*
+ * Replaces the operands that were folded, from `operand` on, with the code
+ * for `value`. The constants they added are dropped, and a constant that is
+ * already in the table is reused rather than added again.
+*/
+static void emit_folded(Operand operand, Value value)
+{
+    Chunk *chunk = current_chunk();
+    int line = chunk->lines[operand.start];
+    chunk->count = operand.start;
+
+    if (IS_NIL(value)) {
+        write_chunk(chunk, OP_NIL, line);
+        return;
+    }
+
+    if (IS_BOOL(value)) {
+        write_chunk(chunk, AS_BOOL(value) ? OP_TRUE : OP_FALSE, line);
+        return;
+    }
+
+    // The folded value is still unreachable, so it is kept on the stack
+    // until it is in the table.
+    push(value);
+    chunk->constants.count = operand.constant_count;
+
+    int constant = 0;
+    while (constant < chunk->constants.count &&
+            !same_constant(chunk->constants.values[constant], value)) {
+        constant++;
+    }
+
+    if (constant == chunk->constants.count) constant = make_constant(value);
+    pop();
+
+    write_chunk(chunk, OP_CONSTANT, line);
+    write_chunk(chunk, (uint8_t)constant, line);
+}
+
+static bool fold_unary(TokenType op_type, Value a, Value *result)
+{
+    switch (op_type) {
+        case TK_NOT:
+            *result = BOOL_VAL(IS_NIL(a) || (IS_BOOL(a) && !AS_BOOL(a)));
+            return true;
+        case TK_MINUS:
+            // Negating anything else is left for the runtime error.
+            if (!IS_NUMBER(a)) return false;
+
+            *result = NUMBER_VAL(-AS_NUMBER(a));
+            return true;
+        default:
+            return false;
+    }
+}
+
+static bool fold_binary(TokenType op_type, Value a, Value b, Value *result)
+{
+    switch (op_type) {
+        case TK_CMPEQ:  *result = BOOL_VAL(values_equal(a, b)); return true;
+        case TK_NOTEQ:  *result = BOOL_VAL(!values_equal(a, b)); return true;
+        default: break;
+    }
+
+    if (op_type == TK_PLUS && IS_STRING(a) && IS_STRING(b)) {
+        ObjString *left = AS_STRING(a);
+        ObjString *right = AS_STRING(b);
+
+        ObjString *string = allocate_string(left->len + right->len);
+        memcpy(string->chars, left->chars, left->len);
+        memcpy(string->chars + left->len, right->chars, right->len);
+
+        *result = OBJ_VAL(take_string(string));
+        return true;
+    }
+
+    // Anything else on operands that aren't numbers is a runtime error.
+    if (!IS_NUMBER(a) || !IS_NUMBER(b)) return false;
+
+    double x = AS_NUMBER(a);
+    double y = AS_NUMBER(b);
+
+    switch (op_type) {
+        case TK_GT:     *result = BOOL_VAL(x > y); return true;
+        case TK_GTEQ:   *result = BOOL_VAL(x >= y); return true;
+        case TK_LT:     *result = BOOL_VAL(x < y); return true;
+        case TK_LTEQ:   *result = BOOL_VAL(x <= y); return true;
+        case TK_MINUS:  *result = NUMBER_VAL(x - y); return true;
+        case TK_PLUS:   *result = NUMBER_VAL(x + y); return true;
+        case TK_SLASH:  *result = NUMBER_VAL(x / y); return true;
+        case TK_STAR:   *result = NUMBER_VAL(x * y); return true;
+        default:        return false;
+    }
+}
+
 static void binary(bool can_assign)
 {
+    Operand left = left_operand;
     TokenType op_type = parser.previous.type;
     ParseRule *rule = get_rule(op_type);
+    int right = current_chunk()->count;
     parse_precedence((Precedence)(rule->precedence + 1));
 
+    // Both operands are literals, so the result is known now.
+    Value a, b, result;
+    if (optimization_level >= 1 && constant_operand(left.start, right, &a) &&
+            constant_operand(right, current_chunk()->count, &b) &&
+            fold_binary(op_type, a, b, &result)) {
+        emit_folded(left, result);
+        return;
+    }
+
     switch (op_type) {
         case TK_NOTEQ:      emit_bytes(OP_EQUAL, OP_NOT); break;
         case TK_CMPEQ:      emit_byte(OP_EQUAL); break;
         case TK_GT:         emit_byte(OP_GREATER); break;
-        case TK_GTEQ:       emit_bytes(OP_LESS, OP_NOT); break;
+        case TK_GTEQ:       emit_byte(OP_GREATER_EQUAL); break;
         case TK_LT:         emit_byte(OP_LESS); break;
-        case TK_LTEQ:       emit_bytes(OP_GREATER, OP_NOT); break;
+        case TK_LTEQ:       emit_byte(OP_LESS_EQUAL); break;
         case TK_MINUS:      emit_byte(OP_SUBTRACT); break;
         case TK_PLUS:       emit_byte(OP_ADD); break;
         case TK_SLASH:      emit_byte(OP_DIVIDE); break;
@@ -476,10 +791,86 @@ static void binary(bool can_assign)
     }
 }
 
+// Whether the code from `start` to the end of the chunk only pushes literals
+// and variables, none of which can fail or change anything.
+static bool pure_code(int start)
+{
+    Chunk *chunk = current_chunk();
+    int offset = start;
+
+    while (offset < chunk->count) {
+        switch (chunk->code[offset]) {
+            case OP_NIL:
+            case OP_TRUE:
+            case OP_FALSE:
+                offset += 1;
+                break;
+            case OP_CONSTANT:
+            case OP_GET_LOCAL:
+            case OP_GET_UPVALUE:
+                offset += 2;
+                break;
+            default:
+                return false;
+        }
+    }
+
+    return true;
+}
+
+/*
+ * Turns a method read that is called straight away, as in `(obj.method)(x)`,
+ * into an invoke, so that no bound method is made for it. `get` is where the
+ * OP_GET_PROPERTY or OP_GET_SUPER starts, and `args` where the arguments do.
+ * The arguments are moved back over the read, which is only done when they
+ * are pure, so the lookup still fails before anything else could happen.
+*/
+static void emit_invoke(int get, int args, uint8_t arg_count)
+{
+    Chunk *chunk = current_chunk();
+    bool super = chunk->code[get] == OP_GET_SUPER;
+
+    // A super read loads the superclass just before it, and a super invoke
+    // loads it after the arguments instead.
+    int start = super ? get - 2 : get;
+    int length = args - start;
+    uint8_t read[6];
+    int lines[6];
+    memcpy(read, &chunk->code[start], length);
+    memcpy(lines, &chunk->lines[start], sizeof(int) * length);
+
+    memmove(&chunk->code[start], &chunk->code[args], chunk->count - args);
+    memmove(&chunk->lines[start], &chunk->lines[args], sizeof(int) * (chunk->count - args));
+    chunk->count -= length;
+
+    int op = super ? 2 : 0;
+    if (super) {
+        write_chunk(chunk, read[0], lines[0]);
+        write_chunk(chunk, read[1], lines[1]);
+    }
+
+    write_chunk(chunk, super ? OP_SUPER_INVOKE : OP_INVOKE, lines[op]);
+    write_chunk(chunk, read[op + 1], lines[op]);
+    write_chunk(chunk, arg_count, lines[op]);
+    write_chunk(chunk, read[op + 2], lines[op]);
+    write_chunk(chunk, read[op + 3], lines[op]);
+}
+
 static void call(bool can_assign)
 {
+    int get = current->last_get;
+    int args = current_chunk()->count;
     uint8_t arg_count = argument_list();
+
+    // The callee is a parenthesised property read, and nothing can see the
+    // bound method it would make.
+    if (get >= 0 && get + 4 == args && pure_code(args)) {
+        emit_invoke(get, args, arg_count);
+        return;
+    }
+
     emit_bytes(OP_CALL, arg_count);
+    current->last_call = current_chunk()->count;
 }
 
 static void dot(bool can_assign)
@@ -490,12 +881,16 @@ static void dot(bool can_assign)
     if (can_assign && match(TK_EQUAL)) {
         expression();
         emit_bytes(OP_SET_PROPERTY, name);
+        emit_cache();
     } else if (match(TK_LPAREN)) {
         uint8_t arg_count = argument_list();
         emit_bytes(OP_INVOKE, name);
         emit_byte(arg_count);
+        emit_cache();
     } else {
+        current->last_get = current_chunk()->count;
         emit_bytes(OP_GET_PROPERTY, name);
+        emit_cache();
     }
 }
 
@@ -524,8 +919,9 @@ static void number(bool can_assign)
 static void string(bool can_assign)
 {
     emit_constant(
-        OBJ_VAL(copy_string(
-            parser.previous.start + 1,
+        OBJ_VAL(new_view(
+            parser.source,
+            (int)(parser.previous.start + 1 - parser.source->chars),
             parser.previous.len - 2
         ))
     );
@@ -543,17 +939,24 @@ static void named_variable(Token name, bool can_assign)
         get_op = OP_GET_UPVALUE;
         set_op = OP_SET_UPVALUE;
     } else {
-        arg = ident_constant(&name);
+        arg = global_constant(&name);
         get_op = OP_GET_GLOBAL;
         set_op = OP_SET_GLOBAL;
     }
 
     if (match(TK_EQUAL) && can_assign) {
         expression();
-        emit_bytes(set_op, (uint8_t)arg);
+        emit_byte(set_op);
     } else {
-        emit_bytes(get_op, (uint8_t)arg);
+        emit_byte(get_op);
     }
+
+    // Globals take a 16-bit slot, locals and upvalues a single byte.
+    if (get_op == OP_GET_GLOBAL) {
+        emit_byte((arg >> 8) & 0xff);
+    }
+
+    emit_byte(arg & 0xff);
 }
 
 static void variable(bool can_assign)
@@ -588,9 +991,12 @@ static void super_(bool can_assign)
         named_variable(synthetic_token("super"), false);
         emit_bytes(OP_SUPER_INVOKE, name);
         emit_byte(arg_count);
+        emit_cache();
     } else {
         named_variable(synthetic_token("super"), false);
+        current->last_get = current_chunk()->count;
         emit_bytes(OP_GET_SUPER, name);
+        emit_cache();
     }
 }
 
@@ -607,9 +1013,17 @@ static void this_(bool can_assign)
 static void unary(bool can_assign)
 {
     TokenType op_type = parser.previous.type;
+    Operand operand = { current_chunk()->count, current_chunk()->constants.count };
 
     parse_precedence(PR_UNARY);
 
+    Value a, result;
+    if (optimization_level >= 1 && constant_operand(operand.start, current_chunk()->count, &a) &&
+            fold_unary(op_type, a, &result)) {
+        emit_folded(operand, result);
+        return;
+    }
+
     switch (op_type) {
         case TK_NOT:    emit_byte(OP_NOT); break;
         case TK_MINUS:  emit_byte(OP_NEGATE); break;
@@ -675,11 +1089,13 @@ static void parse_precedence(Precedence precedence)
     }
 
     bool can_assign = precedence <= PR_ASSIGNMENT;
+    Operand operand = { current_chunk()->count, current_chunk()->constants.count };
     prefix_rule(can_assign);
 
     while (precedence <= get_rule(parser.current.type)->precedence) {
         advance();
         ParseFn infix_rule = get_rule(parser.previous.type)->infix;
+        left_operand = operand;
         infix_rule(can_assign);
     }
 
@@ -716,7 +1132,7 @@ static void function(FunctionType type)
                 error_at_current("Cannot have more than 255 parameters");
             }
 
-            uint8_t constant = parse_variable("Expected parameter name");
+            uint16_t constant = parse_variable("Expected parameter name");
             define_variable(constant);
         } while(match(TK_COMMA));
     }
@@ -757,8 +1173,13 @@ static void class_declaration()
     uint8_t name_constant = ident_constant(&parser.previous);
     declare_variable();
 
+    uint16_t global = 0;
+    if (current->scope_depth == 0) {
+        global = global_constant(&class_name);
+    }
+
     emit_bytes(OP_CLASS, name_constant);
-    define_variable(name_constant);
+    define_variable(global);
 
     ClassCompiler class_compiler;
     class_compiler.has_superclass = false;
@@ -800,7 +1221,7 @@ static void class_declaration()
 
 static void fun_declaration()
 {
-    uint8_t global = parse_variable("Expected function name");
+    uint16_t global = parse_variable("Expected function name");
     mark_initialized();
     function(TYPE_FUNCTION);
     define_variable(global);
@@ -808,7 +1229,7 @@ static void fun_declaration()
 
 static void var_declaration()
 {
-    uint8_t global = parse_variable("Expected variable name");
+    uint16_t global = parse_variable("Expected variable name");
 
     if (match(TK_EQUAL)) {
         expression();
@@ -915,6 +1336,13 @@ static void return_statement()
 
         expression();
         consume(TK_SEMICOLON, "Expected ';' after 'return' value");
+
+        // Nothing runs between the call and the return, so the callee can
+        // take over this function's frame.
+        if (current->last_call == current_chunk()->count) {
+            current_chunk()->code[current->last_call - 2] = OP_TAIL_CALL;
+        }
+
         emit_byte(OP_RETURN);
     }
 }
@@ -995,9 +1423,18 @@ static void statement()
     }
 }
 
-ObjFunction *compile(const char *source)
+ObjFunction *compile(const char *source, bool copy_source)
 {
-    init_scanner(source);
+    int len = (int)strlen(source);
+    ObjString *text;
+    if (copy_source) {
+        text = allocate_string(len);
+        memcpy(text->chars, source, len);
+    } else {
+        text = borrow_string(source, len);
+    }
+    parser.source = text;
+    init_scanner(text->chars);
 
     Compiler compiler;
     init_compiler(&compiler, TYPE_SCRIPT);
@@ -1011,11 +1448,14 @@ ObjFunction *compile(const char *source)
     }
 
     ObjFunction *function = end_compiler();
+    parser.source = NULL;
     return parser.had_error ? NULL : function;
 }
 
 void mark_compiler_roots()
 {
+    mark_object((Obj *)parser.source);
+
     Compiler *compiler = current;
     while (compiler != NULL) {
         mark_object((Obj *)compiler->function);
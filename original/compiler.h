@@ -4,7 +4,15 @@
 #include "chunk.h"
 #include "object.h"
 
-ObjFunction *compile(const char *source);
+// How much work the compiler puts into the code it emits. 0 leaves it as it
+// is written, 1 folds constants and runs the peephole pass, and 2 also runs
+// each function through the optimiser's IR. `main.c` sets it from `-O`.
+extern int optimization_level;
+
+// String literals point into the text of the script rather than being
+// copied out of it. With `copy_source` false they borrow `source` itself,
+// which then has to outlive the VM. Otherwise the compiler copies it first.
+ObjFunction *compile(const char *source, bool copy_source);
 void mark_compiler_roots();
 
 #endif // CLOX_COMPILER_H
\ No newline at end of file
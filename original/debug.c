@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include "debug.h"
 #include "object.h"
+#include "vm.h"
 
 static int byte_instruction(const char *name, Chunk *chunk, int offset)
 {
@@ -20,16 +21,75 @@ static int constant_instruction(const char *name, Chunk *chunk, int offset)
     return offset + 2;
 }
 
+static int property_instruction(const char *name, Chunk *chunk, int offset)
+{
+    uint8_t constant = chunk->code[offset + 1];
+    uint16_t cache = (uint16_t)(chunk->code[offset + 2] << 8);
+    cache |= chunk->code[offset + 3];
+
+    printf("%-16s %4d '", name, constant);
+    print_value(chunk->constants.values[constant]);
+    printf("' (cache %d)\n", cache);
+
+    return offset + 4;
+}
+
+static int global_instruction(const char *name, Chunk *chunk, int offset)
+{
+    uint16_t slot = (uint16_t)(chunk->code[offset + 1] << 8);
+    slot |= chunk->code[offset + 2];
+
+    ObjString *global = global_name(slot);
+    printf("%-16s %4d '%s'\n", name, slot, global != NULL ? global->chars : "?");
+    return offset + 3;
+}
+
+// Describes what an accessor method does, as found by the compiler.
+static void print_accessor(ObjFunction *function)
+{
+    switch (function->accessor) {
+        case ACCESSOR_NONE:
+            break;
+        case ACCESSOR_GETTER:
+            printf(" getter '%s'", function->field->chars);
+            break;
+        case ACCESSOR_SETTER:
+        case ACCESSOR_SETTER_RESULT:
+            printf(" setter '%s'", function->field->chars);
+            break;
+        case ACCESSOR_CONSTANT:
+            printf(" constant '");
+            print_value(function->constant);
+            printf("'");
+            break;
+    }
+}
+
 static int invoke_instruction(const char *name, Chunk *chunk, int offset)
 {
     uint8_t constant = chunk->code[offset + 1];
     uint8_t arg_count = chunk->code[offset + 2];
+    uint16_t cache = (uint16_t)(chunk->code[offset + 3] << 8);
+    cache |= chunk->code[offset + 4];
 
     printf("%-16s (%d args) %4d '", name, arg_count, constant);
     print_value(chunk->constants.values[constant]);
-    printf("'\n");
+    printf("' (cache %d)", cache);
 
-    return offset + 3;
+    // Receivers the site runs the method inline for, once it has seen some.
+    InlineCache *site = &chunk->caches[cache];
+    for (int i = 0; i < site->count; i++) {
+        CacheEntry *entry = &site->entries[i];
+        if (!entry->inlined) continue;
+
+        printf(" [inline");
+        print_accessor(AS_CLOSURE(entry->method)->function);
+        if (entry->slot >= 0) printf(" @ %d", entry->slot);
+        printf("]");
+    }
+    printf("\n");
+
+    return offset + 5;
 }
 
 static int jump_instruction(const char *name, int sign, Chunk *chunk, int offset)
@@ -40,6 +100,16 @@ static int jump_instruction(const char *name, int sign, Chunk *chunk, int offset
     return offset + 3;
 }
 
+static int loop_instruction(const char *name, Chunk *chunk, int offset)
+{
+    uint16_t jump = (uint16_t)(chunk->code[offset + 1] << 8);
+    jump |= chunk->code[offset + 2];
+    uint16_t loop = (uint16_t)(chunk->code[offset + 3] << 8);
+    loop |= chunk->code[offset + 4];
+    printf("%-16s %4d -> %d (loop %d)\n", name, offset, offset + 5 - jump, loop);
+    return offset + 5;
+}
+
 static int simple_instruction(const char *name, int offset)
 {
     printf("%s\n", name);
@@ -73,13 +143,13 @@ int disassemble_instruction(Chunk *chunk, int offset)
         case OP_INHERIT:
             return simple_instruction("INHERIT", offset);
         case OP_GET_SUPER:
-            return constant_instruction("GET SUPER", chunk, offset);
+            return property_instruction("GET SUPER", chunk, offset);
         case OP_CONSTANT:
             return constant_instruction("CONSTANT", chunk, offset);
         case OP_GET_PROPERTY:
-            return constant_instruction("GET PROPERTY", chunk, offset);
+            return property_instruction("GET PROPERTY", chunk, offset);
         case OP_SET_PROPERTY:
-            return constant_instruction("SET PROPERTY", chunk, offset);
+            return property_instruction("SET PROPERTY", chunk, offset);
         case OP_METHOD:
             return constant_instruction("METHOD", chunk, offset);
         case OP_CLOSURE: {
@@ -88,9 +158,11 @@ int disassemble_instruction(Chunk *chunk, int offset)
             uint8_t constant = chunk->code[offset++];
             printf("%-16s %4d ", "CLOSURE", constant);
             print_value(chunk->constants.values[constant]);
-            printf("\n");
 
             ObjFunction *function = AS_FUNCTION(chunk->constants.values[constant]);
+            print_accessor(function);
+            printf("\n");
+
             for (int j = 0; j < function->upvalue_count; j++) {
                 int is_local = chunk->code[offset++];
                 int index = chunk->code[offset++];
@@ -101,11 +173,11 @@ int disassemble_instruction(Chunk *chunk, int offset)
             return offset;
         } break;
         case OP_DEFINE_GLOBAL:
-            return constant_instruction("DEFINE GLOBAL", chunk, offset);
+            return global_instruction("DEFINE GLOBAL", chunk, offset);
         case OP_GET_GLOBAL:
-            return constant_instruction("GET GLOBAL", chunk, offset);
+            return global_instruction("GET GLOBAL", chunk, offset);
         case OP_SET_GLOBAL:
-            return constant_instruction("SET GLOBAL", chunk, offset);
+            return global_instruction("SET GLOBAL", chunk, offset);
         case OP_GET_UPVALUE:
             return byte_instruction("GET UPVALUE", chunk, offset);
         case OP_SET_UPVALUE:
@@ -121,7 +193,7 @@ int disassemble_instruction(Chunk *chunk, int offset)
         case OP_JUMP:
             return jump_instruction("JUMP", 1, chunk, offset);
         case OP_LOOP:
-            return jump_instruction("LOOP", -1, chunk, offset);
+            return loop_instruction("LOOP", chunk, offset);
         case OP_CALL:
             return byte_instruction("CALL", chunk, offset);
         case OP_INVOKE:
@@ -146,6 +218,10 @@ int disassemble_instruction(Chunk *chunk, int offset)
             return simple_instruction("GREATER", offset);
         case OP_LESS:
             return simple_instruction("LESS", offset);
+        case OP_GREATER_EQUAL:
+            return simple_instruction("GREATER EQUAL", offset);
+        case OP_LESS_EQUAL:
+            return simple_instruction("LESS EQUAL", offset);
         case OP_FALSE:
             return simple_instruction("FALSE", offset);
         case OP_NEGATE:
@@ -158,8 +234,359 @@ int disassemble_instruction(Chunk *chunk, int offset)
             return simple_instruction("MULTIPLY", offset);
         case OP_DIVIDE:
             return simple_instruction("DIVIDE", offset);
+        case OP_GREATER_NUM:
+            return simple_instruction("GREATER NUM", offset);
+        case OP_LESS_NUM:
+            return simple_instruction("LESS NUM", offset);
+        case OP_GREATER_EQUAL_NUM:
+            return simple_instruction("GREATER EQUAL NUM", offset);
+        case OP_LESS_EQUAL_NUM:
+            return simple_instruction("LESS EQUAL NUM", offset);
+        case OP_ADD_NUM:
+            return simple_instruction("ADD NUM", offset);
+        case OP_ADD_STR:
+            return simple_instruction("ADD STR", offset);
+        case OP_SUBTRACT_NUM:
+            return simple_instruction("SUBTRACT NUM", offset);
+        case OP_MULTIPLY_NUM:
+            return simple_instruction("MULTIPLY NUM", offset);
+        case OP_DIVIDE_NUM:
+            return simple_instruction("DIVIDE NUM", offset);
+        case OP_GET_LOCAL_PROPERTY:
+            return byte_instruction("LOCAL PROPERTY", chunk, offset);
+        case OP_LESS_JUMP:
+            return simple_instruction("LESS JUMP", offset);
+        case OP_EQUAL_JUMP:
+            return simple_instruction("EQUAL JUMP", offset);
+        case OP_JUMP_IF_FALSE_POP:
+            return jump_instruction("JUMP IF FALSE POP", 1, chunk, offset);
+        case OP_TAIL_CALL:
+            return byte_instruction("TAIL CALL", chunk, offset);
         default:
             printf("Unknown OpCode: %d\n", instruction);
             return offset + 1;
     }
 }
+
+// The opcode's name as a single word, for output that gets fed to other tools.
+const char *opcode_name(OpCode op)
+{
+    static const char *names[OPCODE_COUNT] = {
+        [OP_CLASS]          = "CLASS",
+        [OP_INHERIT]        = "INHERIT",
+        [OP_GET_SUPER]      = "GET_SUPER",
+        [OP_CONSTANT]       = "CONSTANT",
+        [OP_GET_PROPERTY]   = "GET_PROPERTY",
+        [OP_SET_PROPERTY]   = "SET_PROPERTY",
+        [OP_METHOD]         = "METHOD",
+        [OP_CLOSURE]        = "CLOSURE",
+        [OP_DEFINE_GLOBAL]  = "DEFINE_GLOBAL",
+        [OP_GET_GLOBAL]     = "GET_GLOBAL",
+        [OP_SET_GLOBAL]     = "SET_GLOBAL",
+        [OP_GET_UPVALUE]    = "GET_UPVALUE",
+        [OP_SET_UPVALUE]    = "SET_UPVALUE",
+        [OP_CLOSE_UPVALUE]  = "CLOSE_UPVALUE",
+        [OP_GET_LOCAL]      = "GET_LOCAL",
+        [OP_SET_LOCAL]      = "SET_LOCAL",
+        [OP_JUMP_IF_FALSE]  = "JUMP_IF_FALSE",
+        [OP_JUMP]           = "JUMP",
+        [OP_LOOP]           = "LOOP",
+        [OP_CALL]           = "CALL",
+        [OP_INVOKE]         = "INVOKE",
+        [OP_SUPER_INVOKE]   = "SUPER_INVOKE",
+        [OP_POP]            = "POP",
+        [OP_PRINT]          = "PRINT",
+        [OP_RETURN]         = "RETURN",
+        [OP_NIL]            = "NIL",
+        [OP_TRUE]           = "TRUE",
+        [OP_FALSE]          = "FALSE",
+        [OP_NOT]            = "NOT",
+        [OP_EQUAL]          = "EQUAL",
+        [OP_GREATER]        = "GREATER",
+        [OP_LESS]           = "LESS",
+        [OP_GREATER_EQUAL]  = "GREATER_EQUAL",
+        [OP_LESS_EQUAL]     = "LESS_EQUAL",
+        [OP_NEGATE]         = "NEGATE",
+        [OP_ADD]            = "ADD",
+        [OP_SUBTRACT]       = "SUBTRACT",
+        [OP_MULTIPLY]       = "MULTIPLY",
+        [OP_DIVIDE]         = "DIVIDE",
+        [OP_GREATER_NUM]    = "GREATER_NUM",
+        [OP_LESS_NUM]       = "LESS_NUM",
+        [OP_GREATER_EQUAL_NUM] = "GREATER_EQUAL_NUM",
+        [OP_LESS_EQUAL_NUM] = "LESS_EQUAL_NUM",
+        [OP_ADD_NUM]        = "ADD_NUM",
+        [OP_ADD_STR]        = "ADD_STR",
+        [OP_SUBTRACT_NUM]   = "SUBTRACT_NUM",
+        [OP_MULTIPLY_NUM]   = "MULTIPLY_NUM",
+        [OP_DIVIDE_NUM]     = "DIVIDE_NUM",
+        [OP_GET_LOCAL_PROPERTY] = "GET_LOCAL_PROPERTY",
+        [OP_LESS_JUMP]      = "LESS_JUMP",
+        [OP_EQUAL_JUMP]     = "EQUAL_JUMP",
+        [OP_JUMP_IF_FALSE_POP] = "JUMP_IF_FALSE_POP",
+        [OP_TAIL_CALL]      = "TAIL_CALL",
+    };
+
+    return op < OPCODE_COUNT && names[op] != NULL ? names[op] : "UNKNOWN";
+}
+
+#if REGISTER_VM
+/*
+ * Register instructions print their registers as rN, followed by whatever
+ * else they carry. The register code has its own offsets, which jumps are
+ * shown in.
+*/
+static void print_constant(ObjFunction *function, int constant)
+{
+    printf(" '");
+    print_value(function->chunk.constants.values[constant]);
+    printf("'");
+}
+
+static int registers_instruction(const char *name, uint8_t *code, int count, int offset)
+{
+    printf("%-16s", name);
+    for (int i = 1; i <= count; i++) {
+        printf(" r%d", code[offset + i]);
+    }
+
+    printf("\n");
+    return offset + 1 + count;
+}
+
+static int register_constant_instruction(const char *name, ObjFunction *function,
+    int registers, int offset)
+{
+    uint8_t *code = function->registers->code;
+
+    printf("%-16s", name);
+    for (int i = 1; i <= registers; i++) {
+        printf(" r%d", code[offset + i]);
+    }
+
+    print_constant(function, code[offset + registers + 1]);
+    printf("\n");
+    return offset + registers + 2;
+}
+
+static int register_global_instruction(const char *name, uint8_t *code, int offset, bool dest)
+{
+    int reg = code[offset + (dest ? 1 : 3)];
+    int slot = (code[offset + (dest ? 2 : 1)] << 8) | code[offset + (dest ? 3 : 2)];
+    ObjString *global = global_name(slot);
+
+    printf("%-16s r%d %d '%s'\n", name, reg, slot, global != NULL ? global->chars : "?");
+    return offset + 4;
+}
+
+static int register_property_instruction(const char *name, ObjFunction *function,
+    int registers, int offset)
+{
+    uint8_t *code = function->registers->code;
+    int cache = (code[offset + registers + 2] << 8) | code[offset + registers + 3];
+
+    printf("%-16s", name);
+    for (int i = 1; i <= registers; i++) {
+        printf(" r%d", code[offset + i]);
+    }
+
+    print_constant(function, code[offset + registers + 1]);
+    printf(" (cache %d)\n", cache);
+    return offset + registers + 4;
+}
+
+static int register_invoke_instruction(const char *name, ObjFunction *function, int offset)
+{
+    uint8_t *code = function->registers->code;
+    int cache = (code[offset + 4] << 8) | code[offset + 5];
+
+    printf("%-16s r%d (%d args)", name, code[offset + 1], code[offset + 2]);
+    print_constant(function, code[offset + 3]);
+    printf(" (cache %d)\n", cache);
+    return offset + 6;
+}
+
+static int register_jump_instruction(const char *name, uint8_t *code, int registers,
+    int sign, int offset)
+{
+    int end = offset + registers + 3;
+    int jump = (code[end - 2] << 8) | code[end - 1];
+
+    printf("%-16s", name);
+    for (int i = 1; i <= registers; i++) {
+        printf(" r%d", code[offset + i]);
+    }
+
+    printf(" -> %d\n", end + sign * jump);
+    return end;
+}
+
+static int register_compare_jump(const char *name, ObjFunction *function, int offset)
+{
+    uint8_t *code = function->registers->code;
+    int jump = (code[offset + 3] << 8) | code[offset + 4];
+
+    printf("%-16s r%d", name, code[offset + 1]);
+    print_constant(function, code[offset + 2]);
+    printf(" -> %d\n", offset + 5 + jump);
+    return offset + 5;
+}
+
+void disassemble_registers(ObjFunction *function)
+{
+    printf("=== %s (%d registers) ===\n", function->name != NULL
+        ? function->name->chars : "<script>", function->registers->register_count);
+
+    for (int offset = 0; offset < function->registers->count;) {
+        offset = disassemble_register_instruction(function, offset);
+    }
+}
+
+int disassemble_register_instruction(ObjFunction *function, int offset)
+{
+    RegisterCode *registers = function->registers;
+    uint8_t *code = registers->code;
+    printf("%04d ", offset);
+
+    int line = registers->lines[offset];
+    if (offset > 0 && line == registers->lines[offset - 1]) {
+        printf("   | ");
+    } else {
+        printf("%4d ", line);
+    }
+
+    switch (code[offset]) {
+        case REG_MOVE:
+            return registers_instruction("MOVE", code, 2, offset);
+        case REG_CONSTANT:
+            return register_constant_instruction("CONSTANT", function, 1, offset);
+        case REG_NIL:
+            return registers_instruction("NIL", code, 1, offset);
+        case REG_TRUE:
+            return registers_instruction("TRUE", code, 1, offset);
+        case REG_FALSE:
+            return registers_instruction("FALSE", code, 1, offset);
+        case REG_GET_GLOBAL:
+            return register_global_instruction("GET GLOBAL", code, offset, true);
+        case REG_SET_GLOBAL:
+            return register_global_instruction("SET GLOBAL", code, offset, false);
+        case REG_DEFINE_GLOBAL:
+            return register_global_instruction("DEFINE GLOBAL", code, offset, false);
+        case REG_GET_UPVALUE:
+            printf("%-16s r%d %d\n", "GET UPVALUE", code[offset + 1], code[offset + 2]);
+            return offset + 3;
+        case REG_SET_UPVALUE:
+            printf("%-16s %d r%d\n", "SET UPVALUE", code[offset + 1], code[offset + 2]);
+            return offset + 3;
+        case REG_CLOSE_UPVALUE:
+            return registers_instruction("CLOSE UPVALUE", code, 1, offset);
+        case REG_GET_PROPERTY:
+            return register_property_instruction("GET PROPERTY", function, 2, offset);
+        case REG_SET_PROPERTY:
+            return register_property_instruction("SET PROPERTY", function, 2, offset);
+        case REG_GET_SUPER:
+            return register_property_instruction("GET SUPER", function, 3, offset);
+        case REG_CLASS:
+            return register_constant_instruction("CLASS", function, 1, offset);
+        case REG_INHERIT:
+            return registers_instruction("INHERIT", code, 2, offset);
+        case REG_METHOD:
+            return register_constant_instruction("METHOD", function, 2, offset);
+        case REG_CLOSURE: {
+            ObjFunction *closure = AS_FUNCTION(function->chunk.constants.values[code[offset + 2]]);
+            register_constant_instruction("CLOSURE", function, 1, offset);
+            offset += 3;
+
+            for (int j = 0; j < closure->upvalue_count; j++) {
+                printf("%04d    |                    %s %d\n",
+                    offset, code[offset] ? "local" : "upvalue", code[offset + 1]);
+                offset += 2;
+            }
+
+            return offset;
+        }
+        case REG_JUMP:
+            return register_jump_instruction("JUMP", code, 0, 1, offset);
+        case REG_JUMP_IF_FALSE:
+            return register_jump_instruction("JUMP IF FALSE", code, 1, 1, offset);
+        case REG_LOOP:
+            return register_jump_instruction("LOOP", code, 0, -1, offset);
+        case REG_CALL:
+        case REG_TAIL_CALL:
+            printf("%-16s r%d (%d args)\n", code[offset] == REG_CALL ? "CALL" : "TAIL CALL",
+                code[offset + 1], code[offset + 2]);
+            return offset + 3;
+        case REG_INVOKE:
+            return register_invoke_instruction("INVOKE", function, offset);
+        case REG_SUPER_INVOKE:
+            return register_invoke_instruction("SUPER INVOKE", function, offset);
+        case REG_PRINT:
+            return registers_instruction("PRINT", code, 1, offset);
+        case REG_RETURN:
+            return registers_instruction("RETURN", code, 1, offset);
+        case REG_NOT:
+            return registers_instruction("NOT", code, 2, offset);
+        case REG_NEGATE:
+            return registers_instruction("NEGATE", code, 2, offset);
+        case REG_EQUAL:
+            return registers_instruction("EQUAL", code, 3, offset);
+        case REG_GREATER:
+            return registers_instruction("GREATER", code, 3, offset);
+        case REG_LESS:
+            return registers_instruction("LESS", code, 3, offset);
+        case REG_GREATER_EQUAL:
+            return registers_instruction("GREATER EQUAL", code, 3, offset);
+        case REG_LESS_EQUAL:
+            return registers_instruction("LESS EQUAL", code, 3, offset);
+        case REG_ADD:
+            return registers_instruction("ADD", code, 3, offset);
+        case REG_SUBTRACT:
+            return registers_instruction("SUBTRACT", code, 3, offset);
+        case REG_MULTIPLY:
+            return registers_instruction("MULTIPLY", code, 3, offset);
+        case REG_DIVIDE:
+            return registers_instruction("DIVIDE", code, 3, offset);
+        case REG_EQUAL_K:
+            return register_constant_instruction("EQUAL K", function, 2, offset);
+        case REG_GREATER_K:
+            return register_constant_instruction("GREATER K", function, 2, offset);
+        case REG_LESS_K:
+            return register_constant_instruction("LESS K", function, 2, offset);
+        case REG_GREATER_EQUAL_K:
+            return register_constant_instruction("GREATER EQUAL K", function, 2, offset);
+        case REG_LESS_EQUAL_K:
+            return register_constant_instruction("LESS EQUAL K", function, 2, offset);
+        case REG_ADD_K:
+            return register_constant_instruction("ADD K", function, 2, offset);
+        case REG_SUBTRACT_K:
+            return register_constant_instruction("SUBTRACT K", function, 2, offset);
+        case REG_MULTIPLY_K:
+            return register_constant_instruction("MULTIPLY K", function, 2, offset);
+        case REG_DIVIDE_K:
+            return register_constant_instruction("DIVIDE K", function, 2, offset);
+        case REG_EQUAL_JUMP:
+            return register_jump_instruction("EQUAL JUMP", code, 2, 1, offset);
+        case REG_GREATER_JUMP:
+            return register_jump_instruction("GREATER JUMP", code, 2, 1, offset);
+        case REG_LESS_JUMP:
+            return register_jump_instruction("LESS JUMP", code, 2, 1, offset);
+        case REG_GREATER_EQUAL_JUMP:
+            return register_jump_instruction("GREATER EQUAL JUMP", code, 2, 1, offset);
+        case REG_LESS_EQUAL_JUMP:
+            return register_jump_instruction("LESS EQUAL JUMP", code, 2, 1, offset);
+        case REG_EQUAL_K_JUMP:
+            return register_compare_jump("EQUAL K JUMP", function, offset);
+        case REG_GREATER_K_JUMP:
+            return register_compare_jump("GREATER K JUMP", function, offset);
+        case REG_LESS_K_JUMP:
+            return register_compare_jump("LESS K JUMP", function, offset);
+        case REG_GREATER_EQUAL_K_JUMP:
+            return register_compare_jump("GREATER EQUAL K JUMP", function, offset);
+        case REG_LESS_EQUAL_K_JUMP:
+            return register_compare_jump("LESS EQUAL K JUMP", function, offset);
+        default:
+            printf("Unknown OpCode: %d\n", code[offset]);
+            return offset + 1;
+    }
+}
+#endif // REGISTER_VM
@@ -2,8 +2,15 @@
 #define CLOX_DEBUG_H
 
 #include "chunk.h"
+#include "registers.h"
 
 void disassemble_chunk(Chunk *chunk, const char *name);
 int disassemble_instruction(Chunk *chunk, int offset);
+const char *opcode_name(OpCode op);
+
+#if REGISTER_VM
+void disassemble_registers(ObjFunction *function);
+int disassemble_register_instruction(ObjFunction *function, int offset);
+#endif // REGISTER_VM
 
 #endif // CLOX_DEBUG_H
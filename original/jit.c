@@ -0,0 +1,474 @@
+#include "common.h"
+
+#if JIT
+
+#include "jit.h"
+#include "memory.h"
+#include "vm.h"
+#include "x64.h"
+
+/*
+ * A baseline compiler from bytecode to x86-64.
+ *
+ * Every instruction is translated on its own, in order, so the machine code
+ * mirrors the bytecode one to one. Stack traffic, locals, constants, jumps
+ * and (with NaN boxing) arithmetic and comparisons on numbers are done
+ * inline. Everything that allocates, can fail, or changes the frame stack
+ * calls back into the runtime helpers in vm.c, which share their code with
+ * the interpreter. Instructions that only show up while classes are being
+ * declared aren't compiled at all and hand control back to the interpreter.
+*/
+
+// Hands the instruction at ip back to the interpreter.
+static void fallback(Emitter *e, uint8_t *ip)
+{
+    sync_ip(e, ip);
+    mov_eax_imm(e, JIT_FALLBACK);
+    jump_to(e, jump(e), e->epilogue);
+}
+
+/*
+ * Returns to the caller inline when there are no upvalues to close and the
+ * caller isn't the end of the script. That leaves nothing for the helper to
+ * do but pop the frame and move the result.
+*/
+static void return_op(Emitter *e)
+{
+    mov_imm(e, RAX, (uint64_t)(uintptr_t)&vm.open_upvalues);
+    load(e, RAX, RAX, 0);
+    alu_reg(e, TEST_RR, RAX, RAX);
+    int no_upvalues = jump_if(e, CC_E);
+    load(e, RAX, RAX, offsetof(ObjUpvalue, location));
+    alu_reg(e, CMP_RR, RAX, SLOTS);
+    int has_upvalues = jump_if(e, CC_AE);
+
+    patch_here(e, no_upvalues);
+    mov_imm(e, RAX, (uint64_t)(uintptr_t)&vm.frame_count);
+    cmp_int_imm(e, RAX, 0, 1);
+    int last_frame = jump_if(e, CC_E);
+    sub_int_imm(e, RAX, 0, 1);
+
+    copy_value(e, SLOTS, 0, TOP, -VALUE_SIZE);
+    mov_reg(e, TOP, SLOTS);
+    add_imm(e, TOP, VALUE_SIZE);
+    mov_eax_imm(e, JIT_EXIT);
+    jump_to(e, jump(e), e->epilogue);
+
+    patch_here(e, has_upvalues);
+    patch_here(e, last_frame);
+    mov_reg(e, RDI, FRAME);
+    call_helper(e, HELPER(jit_return));
+    jump_to(e, jump(e), e->epilogue);
+}
+
+#ifdef NAN_BOXING
+/*
+ * Binary operators on two numbers run inline on SSE2. Anything else, such as
+ * string concatenation or a type error, goes through jit_operator().
+*/
+static void binary_op(Emitter *e, OpCode op, uint8_t *next)
+{
+    load(e, RAX, TOP, -2 * VALUE_SIZE);
+    load(e, RCX, TOP, -VALUE_SIZE);
+    int not_a = jump_if_not_number(e, RAX);
+    int not_b = jump_if_not_number(e, RCX);
+
+    number_op(e, op);
+    store(e, TOP, -2 * VALUE_SIZE, RAX);
+    sub_imm(e, TOP, VALUE_SIZE);
+    int done = jump(e);
+
+    patch_here(e, not_a);
+    patch_here(e, not_b);
+    sync_ip(e, next);
+    operator_helper(e, op);
+    patch_here(e, done);
+}
+
+/*
+ * The monomorphic fast path of OP_GET_PROPERTY: the receiver is an instance
+ * whose shape matches the one in the cache, so the field is read straight
+ * out of its slot. Anything else goes through jit_get_property().
+*/
+static void get_property(Emitter *e, ObjString *name, InlineCache *cache, uint8_t *next)
+{
+    load(e, RAX, TOP, -VALUE_SIZE);
+    mov_imm(e, RCX, SIGN_BIT | QNAN);
+    mov_reg(e, RDX, RAX);
+    alu_reg(e, AND_RR, RDX, RCX);
+    alu_reg(e, CMP_RR, RDX, RCX);
+    int not_object = jump_if(e, CC_NE);
+
+    mov_imm(e, RCX, ~(SIGN_BIT | QNAN));
+    alu_reg(e, AND_RR, RAX, RCX);
+    cmp_int_imm(e, RAX, offsetof(Obj, type), OBJ_INSTANCE);
+    int not_instance = jump_if(e, CC_NE);
+
+    mov_imm(e, RCX, (uint64_t)(uintptr_t)cache);
+    load(e, RDX, RCX, offsetof(InlineCache, shape));
+    alu_reg(e, TEST_RR, RDX, RDX);
+    int empty = jump_if(e, CC_E);
+    load(e, RSI, RAX, offsetof(ObjInstance, shape));
+    alu_reg(e, CMP_RR, RDX, RSI);
+    int miss = jump_if(e, CC_NE);
+
+#if VM_STATS
+    mov_imm(e, RDX, (uint64_t)(uintptr_t)&vm.stats.property_hits);
+    emit_rex(e, true, 0, RDX);
+    emit_byte(e, 0xff);
+    emit_modrm_mem(e, 0, RDX, 0); // inc qword [rdx]
+#endif // VM_STATS
+
+    load_int(e, RDX, RCX, offsetof(InlineCache, slot));
+    shl_imm(e, RDX, 3);
+    load(e, RAX, RAX, offsetof(ObjInstance, slots));
+    alu_reg(e, ADD_RR, RAX, RDX);
+    load(e, RAX, RAX, 0);
+    store(e, TOP, -VALUE_SIZE, RAX);
+    int done = jump(e);
+
+    patch_here(e, not_object);
+    patch_here(e, not_instance);
+    patch_here(e, empty);
+    patch_here(e, miss);
+    sync_ip(e, next);
+    mov_imm(e, RDI, (uint64_t)(uintptr_t)name);
+    mov_imm(e, RSI, (uint64_t)(uintptr_t)cache);
+    call_helper(e, HELPER(jit_get_property));
+    check_status(e);
+    patch_here(e, done);
+}
+#endif // NAN_BOXING
+
+static void compile_instruction(Emitter *e, ObjFunction *function, int offset)
+{
+    Chunk *chunk = &function->chunk;
+    uint8_t *ip = chunk->code + offset;
+    uint8_t *next = ip + instruction_length(chunk, offset);
+    OpCode op = generic_opcode(*ip);
+
+#define BYTE(n)         (ip[n])
+#define SHORT(n)        ((uint16_t)((ip[n] << 8) | ip[(n) + 1]))
+#define CONSTANT(n)     (chunk->constants.values[ip[n]])
+#define CACHE(n)        (&chunk->caches[SHORT(n)])
+#define POINTER(p)      ((uint64_t)(uintptr_t)(p))
+
+    switch (op) {
+        case OP_CONSTANT:
+            push_constant(e, CONSTANT(1));
+            break;
+        case OP_NIL:
+            push_constant(e, NIL_VAL);
+            break;
+        case OP_TRUE:
+            push_constant(e, BOOL_VAL(true));
+            break;
+        case OP_FALSE:
+            push_constant(e, BOOL_VAL(false));
+            break;
+        case OP_POP:
+            sub_imm(e, TOP, VALUE_SIZE);
+            break;
+        case OP_GET_LOCAL:
+            copy_value(e, TOP, 0, SLOTS, BYTE(1) * VALUE_SIZE);
+            add_imm(e, TOP, VALUE_SIZE);
+            break;
+        case OP_SET_LOCAL:
+            copy_value(e, SLOTS, BYTE(1) * VALUE_SIZE, TOP, -VALUE_SIZE);
+            break;
+        case OP_GET_UPVALUE:
+        case OP_SET_UPVALUE:
+            load(e, RAX, FRAME, offsetof(CallFrame, closure));
+            load(e, RAX, RAX, offsetof(ObjClosure, upvalues));
+            load(e, RAX, RAX, BYTE(1) * (int)sizeof(ObjUpvalue *));
+            load(e, RAX, RAX, offsetof(ObjUpvalue, location));
+
+            if (*ip == OP_GET_UPVALUE) {
+                copy_value(e, TOP, 0, RAX, 0);
+                add_imm(e, TOP, VALUE_SIZE);
+            } else {
+                copy_value(e, RAX, 0, TOP, -VALUE_SIZE);
+            }
+            break;
+        case OP_DEFINE_GLOBAL:
+            mov_imm(e, RAX, POINTER(&vm.globals.values));
+            load(e, RAX, RAX, 0);
+            copy_value(e, RAX, SHORT(1) * VALUE_SIZE, TOP, -VALUE_SIZE);
+            sub_imm(e, TOP, VALUE_SIZE);
+            break;
+#ifdef NAN_BOXING
+        case OP_GET_GLOBAL:
+        case OP_SET_GLOBAL: {
+            global_address(e, SHORT(1));
+            load(e, RCX, RAX, 0);
+            mov_imm(e, RDX, UNDEFINED_VAL);
+            alu_reg(e, CMP_RR, RCX, RDX);
+            int undefined = jump_if(e, CC_E);
+
+            if (*ip == OP_GET_GLOBAL) {
+                store(e, TOP, 0, RCX);
+                add_imm(e, TOP, VALUE_SIZE);
+            } else {
+                load(e, RCX, TOP, -VALUE_SIZE);
+                store(e, RAX, 0, RCX);
+            }
+            int done = jump(e);
+
+            // The helper reports the error.
+            patch_here(e, undefined);
+            sync_ip(e, next);
+            mov_imm(e, RDI, SHORT(1));
+            call_helper(e, *ip == OP_GET_GLOBAL ? HELPER(jit_get_global) : HELPER(jit_set_global));
+            check_status(e);
+            patch_here(e, done);
+        } break;
+        case OP_JUMP_IF_FALSE: {
+            int if_nil, if_false;
+            load(e, RAX, TOP, -VALUE_SIZE);
+            jump_if_falsey(e, &if_nil, &if_false);
+            add_fixup(e, if_nil, (int)(next - chunk->code) + SHORT(1));
+            add_fixup(e, if_false, (int)(next - chunk->code) + SHORT(1));
+        } break;
+        case OP_NOT: {
+            int if_nil, if_false;
+            load(e, RAX, TOP, -VALUE_SIZE);
+            jump_if_falsey(e, &if_nil, &if_false);
+            mov_imm(e, RAX, FALSE_VAL);
+            int done = jump(e);
+            patch_here(e, if_nil);
+            patch_here(e, if_false);
+            mov_imm(e, RAX, TRUE_VAL);
+            patch_here(e, done);
+            store(e, TOP, -VALUE_SIZE, RAX);
+        } break;
+        case OP_EQUAL: {
+            // Matches values_equal(). A number is compared as a double, which
+            // anything else never equals. Otherwise equal bits are equal
+            // values, and only two strings can be equal without them, if one
+            // of them is a rope.
+            load(e, RAX, TOP, -2 * VALUE_SIZE);
+            load(e, RCX, TOP, -VALUE_SIZE);
+            int not_number = jump_if_not_number(e, RAX);
+            number_op(e, OP_EQUAL);
+            int number = jump(e);
+
+            patch_here(e, not_number);
+            alu_reg(e, CMP_RR, RAX, RCX);
+            int same = jump_if(e, CC_E);
+            int not_objects = jump_unless_objects(e, RAX, RCX);
+            sync_ip(e, next);
+            operator_helper(e, OP_EQUAL);
+            int done = jump(e);
+
+            patch_here(e, not_objects);
+            mov_imm(e, RAX, FALSE_VAL);
+            int result = jump(e);
+            patch_here(e, same);
+            mov_imm(e, RAX, TRUE_VAL);
+            patch_here(e, result);
+            patch_here(e, number);
+            store(e, TOP, -2 * VALUE_SIZE, RAX);
+            sub_imm(e, TOP, VALUE_SIZE);
+            patch_here(e, done);
+        } break;
+        case OP_NEGATE: {
+            load(e, RAX, TOP, -VALUE_SIZE);
+            int not_number = jump_if_not_number(e, RAX);
+            mov_imm(e, RCX, SIGN_BIT);
+            alu_reg(e, XOR_RR, RAX, RCX);
+            store(e, TOP, -VALUE_SIZE, RAX);
+            int done = jump(e);
+            patch_here(e, not_number);
+            sync_ip(e, next);
+            operator_helper(e, OP_NEGATE);
+            patch_here(e, done);
+        } break;
+        case OP_GREATER:
+        case OP_LESS:
+        case OP_GREATER_EQUAL:
+        case OP_LESS_EQUAL:
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+            binary_op(e, op, next);
+            break;
+        case OP_GET_PROPERTY:
+            get_property(e, AS_STRING(CONSTANT(1)), CACHE(2), next);
+            break;
+#else
+        case OP_GET_GLOBAL:
+        case OP_SET_GLOBAL:
+            sync_ip(e, next);
+            mov_imm(e, RDI, SHORT(1));
+            call_helper(e, *ip == OP_GET_GLOBAL ? HELPER(jit_get_global) : HELPER(jit_set_global));
+            check_status(e);
+            break;
+        case OP_JUMP_IF_FALSE:
+            mov_reg(e, RDI, TOP);
+            sub_imm(e, RDI, VALUE_SIZE);
+            call_helper(e, HELPER(jit_is_falsey));
+            emit_byte(e, 0x84);
+            emit_byte(e, 0xc0); // test al, al
+            add_fixup(e, jump_if(e, CC_NE), (int)(next - chunk->code) + SHORT(1));
+            break;
+        case OP_NOT:
+        case OP_EQUAL:
+        case OP_NEGATE:
+        case OP_GREATER:
+        case OP_LESS:
+        case OP_GREATER_EQUAL:
+        case OP_LESS_EQUAL:
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+            sync_ip(e, next);
+            operator_helper(e, op);
+            break;
+        case OP_GET_PROPERTY:
+            sync_ip(e, next);
+            mov_imm(e, RDI, POINTER(AS_STRING(CONSTANT(1))));
+            mov_imm(e, RSI, POINTER(CACHE(2)));
+            call_helper(e, HELPER(jit_get_property));
+            check_status(e);
+            break;
+#endif // NAN_BOXING
+        case OP_JUMP:
+            add_fixup(e, jump(e), (int)(next - chunk->code) + SHORT(1));
+            break;
+        case OP_LOOP:
+#if TRACE_JIT
+            // A loop that has a trace goes back to the interpreter, which
+            // runs the trace from the back edge.
+            mov_imm(e, RAX, POINTER(&chunk->loops[SHORT(3)].trace));
+            load(e, RAX, RAX, 0);
+            alu_reg(e, TEST_RR, RAX, RAX);
+            int no_trace = jump_if(e, CC_E);
+            fallback(e, ip);
+            patch_here(e, no_trace);
+#endif // TRACE_JIT
+            add_fixup(e, jump(e), (int)(next - chunk->code) - SHORT(1));
+            break;
+        case OP_SET_PROPERTY:
+            sync_ip(e, next);
+            mov_imm(e, RDI, POINTER(AS_STRING(CONSTANT(1))));
+            mov_imm(e, RSI, POINTER(CACHE(2)));
+            call_helper(e, HELPER(jit_set_property));
+            check_status(e);
+            break;
+        case OP_GET_SUPER:
+            sync_ip(e, next);
+            mov_imm(e, RDI, POINTER(AS_STRING(CONSTANT(1))));
+            mov_imm(e, RSI, POINTER(CACHE(2)));
+            call_helper(e, HELPER(jit_get_super));
+            check_status(e);
+            break;
+        case OP_CALL:
+            sync_ip(e, next);
+            mov_imm(e, RDI, BYTE(1));
+            call_helper(e, *ip == OP_TAIL_CALL ? HELPER(jit_tail_call) : HELPER(jit_call));
+            check_status(e);
+            break;
+        case OP_INVOKE:
+        case OP_SUPER_INVOKE:
+            sync_ip(e, next);
+            mov_imm(e, RDI, POINTER(AS_STRING(CONSTANT(1))));
+            mov_imm(e, RSI, BYTE(2));
+            mov_imm(e, RDX, POINTER(CACHE(3)));
+            call_helper(e, *ip == OP_INVOKE ? HELPER(jit_invoke) : HELPER(jit_super_invoke));
+            check_status(e);
+            break;
+        case OP_CLOSURE:
+            sync_ip(e, next);
+            mov_reg(e, RDI, FRAME);
+            mov_imm(e, RSI, POINTER(AS_FUNCTION(CONSTANT(1))));
+            mov_imm(e, RDX, POINTER(ip + 2));
+            call_helper(e, HELPER(jit_closure));
+            break;
+        case OP_CLOSE_UPVALUE:
+            call_helper(e, HELPER(jit_close_upvalue));
+            break;
+        case OP_PRINT:
+            call_helper(e, HELPER(jit_print));
+            break;
+        case OP_RETURN:
+            return_op(e);
+            break;
+        case OP_CLASS:
+        case OP_INHERIT:
+        case OP_METHOD:
+        default:
+            fallback(e, ip);
+            break;
+    }
+
+#undef BYTE
+#undef SHORT
+#undef CONSTANT
+#undef CACHE
+#undef POINTER
+}
+
+/*
+ * Compiles a function to machine code. On failure the function just stays
+ * interpreted.
+*/
+bool jit_compile(ObjFunction *function)
+{
+    Chunk *chunk = &function->chunk;
+    Emitter e;
+
+    init_emitter(&e);
+    e.entries = ALLOCATE(uint32_t, chunk->count);
+    epilogue(&e);
+
+    for (int offset = 0; offset < chunk->count; offset += instruction_length(chunk, offset)) {
+        e.entries[offset] = (uint32_t)e.count;
+        compile_instruction(&e, function, offset);
+    }
+
+    for (int i = 0; i < e.fixup_count; i++) {
+        jump_to(&e, e.fixups[i].at, (int)e.entries[e.fixups[i].target]);
+    }
+
+    FREE_ARRAY(Fixup, e.fixups, e.fixup_capacity);
+
+    size_t size = (size_t)e.count;
+    uint8_t *code = install_code(&e);
+    if (code == NULL) {
+        FREE_ARRAY(uint32_t, e.entries, chunk->count);
+        return false;
+    }
+
+    JitCode *jit = ALLOCATE(JitCode, 1);
+    jit->code = code;
+    jit->size = size;
+    jit->entries = e.entries;
+    jit->entry_count = chunk->count;
+    function->jit = jit;
+    return true;
+}
+
+// Runs the frame's native code from the instruction at frame->ip.
+JitStatus jit_enter(CallFrame *frame)
+{
+    ObjFunction *function = frame->closure->function;
+    JitCode *jit = function->jit;
+    uint32_t resume = jit->entries[frame->ip - function->chunk.code];
+
+    return enter_code(frame, jit->code + resume);
+}
+
+void jit_free(ObjFunction *function)
+{
+    JitCode *jit = function->jit;
+    if (jit == NULL) return;
+
+    free_code(jit->code, jit->size);
+    FREE_ARRAY(uint32_t, jit->entries, jit->entry_count);
+    FREE(JitCode, jit);
+    function->jit = NULL;
+}
+
+#endif // JIT
\ No newline at end of file
@@ -0,0 +1,73 @@
+#ifndef CLOX_JIT_H
+#define CLOX_JIT_H
+
+#include "common.h"
+
+#if JIT || TRACE_JIT || AOT
+
+#include "chunk.h"
+#include "object.h"
+#include "vm.h"
+
+/*
+ * What native code, from either the baseline JIT or a trace, tells run()
+ * when it hands control back. Code compiled ahead of time by cloxc uses the
+ * shared runtime helpers below, which only ever return JIT_NEXT or JIT_ERROR.
+ *
+ * JIT_NEXT is only ever returned by the runtime helpers below, to let the
+ * native code carry on with the next instruction. JIT_EXIT means the frame
+ * stack changed, so run() picks up whatever frame is now on top.
+ * JIT_FALLBACK means the native code reached an instruction it doesn't
+ * handle, and the interpreter should run it instead.
+*/
+typedef enum {
+    JIT_ERROR,
+    JIT_NEXT,
+    JIT_EXIT,
+    JIT_FALLBACK,
+    JIT_DONE
+} JitStatus;
+
+#if JIT
+/*
+ * The machine code for one function.
+ *
+ * Native code can be entered at any instruction boundary, which is how a
+ * frame resumes after a call returns. `entries` maps each bytecode offset
+ * that starts an instruction to the offset of its machine code.
+*/
+struct JitCode {
+    uint8_t *code;
+    size_t size;
+    uint32_t *entries;
+    int entry_count;
+};
+
+bool jit_compile(ObjFunction *function);
+JitStatus jit_enter(CallFrame *frame);
+void jit_free(ObjFunction *function);
+
+// Helpers for calls and returns made from a compiled function, implemented
+// in vm.c.
+JitStatus jit_call(int arg_count);
+JitStatus jit_tail_call(int arg_count);
+JitStatus jit_invoke(ObjString *name, int arg_count, InlineCache *cache);
+JitStatus jit_super_invoke(ObjString *name, int arg_count, InlineCache *cache);
+JitStatus jit_return(CallFrame *frame);
+#endif // JIT
+
+// Runtime helpers for all native code, implemented in vm.c.
+JitStatus jit_operator(OpCode op);
+JitStatus jit_get_global(int slot);
+JitStatus jit_set_global(int slot);
+JitStatus jit_get_property(ObjString *name, InlineCache *cache);
+JitStatus jit_set_property(ObjString *name, InlineCache *cache);
+JitStatus jit_get_super(ObjString *name, InlineCache *cache);
+void jit_closure(CallFrame *frame, ObjFunction *function, uint8_t *upvalues);
+void jit_close_upvalue();
+void jit_print();
+bool jit_is_falsey(Value *value);
+
+#endif // JIT || TRACE_JIT || AOT
+
+#endif // CLOX_JIT_H
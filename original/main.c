@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include "compiler.h"
 #include "vm.h"
 
 #ifndef _WIN32
@@ -27,7 +28,9 @@ static void repl() {
             break;
         }
 
-        interpret(line);
+        // The line is reused for the next one, so its literals can't point
+        // into it.
+        interpret(line, true);
     }
 #else
     for (;;) {
@@ -39,7 +42,9 @@ static void repl() {
         }
 
         add_history(line);
-        interpret(line);
+        // The line is freed before the next one, so its literals can't point
+        // into it.
+        interpret(line, true);
         free(line);
     }
 #endif // _WIN32
@@ -76,27 +81,44 @@ static char *read_file(const char *path)
 
 static void run_file(const char *path)
 {
+    // Literals point straight into the text rather than into a copy of it,
+    // so it's kept until the VM is gone.
     char *source = read_file(path);
-    VMResult result = interpret(source);
+    VMResult result = interpret(source, false);
+    free_vm();
     free(source);
 
     if (result == VM_COMPILE_ERROR) exit(65);
     if (result == VM_RUNTIME_ERROR) exit(70);
 }
 
+static void usage()
+{
+    fprintf(stderr, "Usage: clox [-O0|-O1|-O2] [script.lox]");
+    exit(64);
+}
+
 int main(int argc, char **argv)
 {
+    int arg = 1;
+    if (arg < argc && strncmp(argv[arg], "-O", 2) == 0) {
+        const char *level = argv[arg] + 2;
+        if (level[0] < '0' || level[0] > '2' || level[1] != '\0') usage();
+
+        optimization_level = level[0] - '0';
+        arg++;
+    }
+
     init_vm();
 
-    if (argc == 1) {
+    if (arg == argc) {
         repl();
-    } else if (argc == 2) {
-        run_file(argv[1]);
+        free_vm();
+    } else if (arg == argc - 1) {
+        run_file(argv[arg]);
     } else {
-        fprintf(stderr, "Usage: clox [script.lox]");
-        exit(64);
+        usage();
     }
 
-    free_vm();
     return 0;
 }
@@ -1,6 +1,9 @@
 #include <stdlib.h>
 #include "compiler.h"
+#include "jit.h"
 #include "memory.h"
+#include "registers.h"
+#include "trace.h"
 #include "vm.h"
 
 #ifdef DEBUG_LOG_GC
@@ -46,7 +49,7 @@ static void free_object(Obj *object)
         } break;
         case OBJ_CLASS: {
             ObjClass *klass = (ObjClass *)object;
-            free_table(&klass->methods);
+            FREE_ARRAY(Value, klass->vtable, klass->vtable_count);
             FREE(ObjClass, object);
         } break;
         case OBJ_CLOSURE: {
@@ -56,21 +59,52 @@ static void free_object(Obj *object)
         } break;
         case OBJ_FUNCTION: {
             ObjFunction *function = (ObjFunction *)object;
+#if JIT
+            jit_free(function);
+#endif // JIT
+#if TRACE_JIT
+            trace_free(&function->chunk);
+#endif // TRACE_JIT
+#if REGISTER_VM
+            free_registers(function);
+#endif // REGISTER_VM
             free_chunk(&function->chunk);
             FREE(ObjFunction, object);
         } break;
         case OBJ_INSTANCE: {
             ObjInstance *instance = (ObjInstance *)object;
-            free_table(&instance->fields);
-            FREE(ObjInstance, object);
+            if (instance->dictionary != NULL) {
+                free_table(instance->dictionary);
+                FREE(Table, instance->dictionary);
+            }
+
+            if (instance->slots != instance->inline_slots) {
+                FREE_ARRAY(Value, instance->slots, instance->slot_capacity);
+            }
+
+            FREE_FLEX(ObjInstance, Value, object, instance->inline_capacity);
         } break;
         case OBJ_NATIVE: {
             FREE(ObjNative, object);
         } break;
+        case OBJ_SHAPE: {
+            ObjShape *shape = (ObjShape *)object;
+            free_table(&shape->transitions);
+            FREE(ObjShape, object);
+        } break;
         case OBJ_STRING: {
             ObjString *string = (ObjString *)object;
-            FREE_ARRAY(char, string->chars, string->len + 1);
-            FREE(ObjString, object);
+            if (string->chars == string->storage) {
+                FREE_FLEX(ObjString, char, object, string->len + 1);
+            } else {
+                if (string_owns_chars(string)) FREE_ARRAY(char, string->chars, string->len + 1);
+                FREE(ObjString, object);
+            }
+        } break;
+        case OBJ_STRING_BUILDER: {
+            ObjStringBuilder *builder = (ObjStringBuilder *)object;
+            FREE_ARRAY(char, builder->chars, builder->capacity);
+            FREE(ObjStringBuilder, object);
         } break;
         case OBJ_UPVALUE: {
             FREE(ObjUpvalue, object);
@@ -129,7 +163,10 @@ static void blacken_object(Obj *object)
         case OBJ_CLASS: {
             ObjClass *klass = (ObjClass *)object;
             mark_object((Obj *)klass->name);
-            mark_table(&klass->methods);
+            for (int i = 0; i < klass->vtable_count; i++) {
+                mark_value(klass->vtable[i]);
+            }
+            mark_object((Obj *)klass->root_shape);
         } break;
         case OBJ_CLOSURE: {
             ObjClosure *closure = (ObjClosure *)object;
@@ -142,24 +179,75 @@ static void blacken_object(Obj *object)
         case OBJ_FUNCTION: {
             ObjFunction *function = (ObjFunction *)object;
             mark_object((Obj *)function->name);
+            mark_object((Obj *)function->source);
             mark_array(&function->chunk.constants);
+
+            for (int i = 0; i < function->chunk.cache_count; i++) {
+                InlineCache *cache = &function->chunk.caches[i];
+                mark_object((Obj *)cache->shape);
+                mark_object((Obj *)cache->transition);
+
+                for (int j = 0; j < cache->count; j++) {
+                    mark_object(cache->entries[j].key);
+                    mark_value(cache->entries[j].method);
+                }
+            }
+
+#if TRACE_JIT
+            trace_mark(&function->chunk);
+#endif // TRACE_JIT
         } break;
         case OBJ_INSTANCE: {
             ObjInstance *instance = (ObjInstance *)object;
             mark_object((Obj *)instance->klass);
-            mark_table(&instance->fields);
+
+            if (instance->shape != NULL) {
+                mark_object((Obj *)instance->shape);
+                for (int i = 0; i < instance->shape->field_count; i++) {
+                    mark_value(instance->slots[i]);
+                }
+            } else {
+                mark_table(instance->dictionary);
+            }
+        } break;
+        case OBJ_SHAPE: {
+            ObjShape *shape = (ObjShape *)object;
+            mark_object((Obj *)shape->parent);
+            mark_object((Obj *)shape->name);
+            mark_table(&shape->transitions);
         } break;
         case OBJ_UPVALUE:
             mark_value(((ObjUpvalue *)object)->closed);
+            break;
+        case OBJ_STRING: {
+            ObjString *string = (ObjString *)object;
+            mark_object((Obj *)string->left);
+            mark_object((Obj *)string->right);
+            mark_object((Obj *)string->interned);
+            // Not `source`, which release_views() sees to instead.
+        } break;
+        case OBJ_STRING_BUILDER:
+            mark_object((Obj *)((ObjStringBuilder *)object)->built);
+            break;
         case OBJ_NATIVE:
-        case OBJ_STRING:
             break;
     }
 }
 
 static void mark_roots()
 {
-    for (Value *slot = vm.stack; slot < vm.stack_top; slot++) {
+    Value *top = vm.stack_top;
+
+#if REGISTER_VM
+    // A frame's registers past the stack top are dead, but one the GC skipped
+    // could be left pointing at a freed object when the stack top moves back
+    // over it. Marking every register of every frame keeps them all valid.
+    for (int i = 0; i < vm.frame_count; i++) {
+        if (vm.frames[i].top > top) top = vm.frames[i].top;
+    }
+#endif // REGISTER_VM
+
+    for (Value *slot = vm.stack; slot < top; slot++) {
         mark_value(*slot);
     }
 
@@ -171,8 +259,11 @@ static void mark_roots()
         mark_object((Obj *)upvalue);
     }
 
-    mark_table(&vm.globals);
+    mark_table(&vm.global_slots);
+    mark_table(&vm.selectors);
+    mark_array(&vm.globals);
     mark_compiler_roots();
+    mark_object((Obj *)vm.init_string);
 }
 
 static void trace_references()
@@ -183,6 +274,20 @@ static void trace_references()
     }
 }
 
+// Every view is interned, so the live ones whose source is about to go can
+// all be found in vm.strings.
+static void release_views()
+{
+    for (int i = 0; i < vm.strings.capacity; i++) {
+        ObjString *string = vm.strings.entries[i].key;
+        if (string == NULL || !string->obj.is_marked) continue;
+
+        if (string->source != NULL && !string->source->obj.is_marked) {
+            materialize_string(string);
+        }
+    }
+}
+
 static void sweep()
 {
     Obj *previous = NULL;
@@ -217,6 +322,7 @@ void collect_garbage()
 
     mark_roots();
     trace_references();
+    release_views();
     table_remove_white(&vm.strings);
     sweep();
     vm.next_GC = vm.bytes_allocated * GC_HEAP_GROW_FACTOR;
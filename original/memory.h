@@ -12,6 +12,9 @@
 #define FREE_ARRAY(type, ptr, old_count)    \
     reallocate(ptr, sizeof(type) * (old_count), 0)
 
+#define FREE_FLEX(type, array_type, ptr, array_count)   \
+    reallocate(ptr, sizeof(type) + sizeof(array_type) * (array_count), 0)
+
 #define GROW_CAPACITY(capacity)     \
     ((capacity) < 8 ? 8 : (capacity) * 2)
 
@@ -1,4 +1,6 @@
+#include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include "memory.h"
 #include "object.h"
@@ -9,6 +11,9 @@
 #define ALLOCATE_OBJ(type, object_type)     \
     (type *)allocate_object(sizeof(type), object_type)
 
+#define ALLOCATE_FLEX(type, array_type, array_count, object_type)    \
+    (type *)allocate_object(sizeof(type) + sizeof(array_type) * (array_count), object_type)
+
 static Obj *allocate_object(size_t size, ObjType type)
 {
     Obj *object = (Obj *)reallocate(NULL, 0, size);
@@ -16,6 +21,7 @@ static Obj *allocate_object(size_t size, ObjType type)
     object->is_marked = false;
     object->next = vm.objects;
     vm.objects = object;
+    STAT_INC(objects_allocated);
 
 #ifdef DEBUG_LOG_GC
     printf("Addr: %p -- Allocate %zu bytes | Type %d\n", (void *)object, size, type);
@@ -24,29 +30,55 @@ static Obj *allocate_object(size_t size, ObjType type)
     return object;
 }
 
-ObjString *allocate_string(char *chars, int len, uint32_t hash)
+static ObjString *intern_string(ObjString *string)
 {
-    ObjString *string = ALLOCATE_OBJ(ObjString, OBJ_STRING);
-    string->len = len;
-    string->chars = chars;
-    string->hash = hash;
-
     push(OBJ_VAL(string));
     table_set(&vm.strings, string, NIL_VAL);
-
     pop();
+
     return string;
 }
 
+static inline uint64_t rotate_left(uint64_t x, int bits)
+{
+    return (x << bits) | (x >> (64 - bits));
+}
+
+/*
+ * Hashes eight bytes at a time, with MurmurHash3's mixing for each word and
+ * its finalizer at the end so that every input bit reaches every bit of the
+ * result. The last few bytes are zero padded into one more word, and the
+ * length goes into the seed so that padding can't make two strings collide.
+*/
 static uint32_t hash_string(const char *key, int len)
 {
-    uint32_t hash = 2166136261u;
-    for (int i = 0; i < len; i++) {
-        hash ^= (uint8_t)key[i];
-        hash *= 16777619;
+    const uint64_t c1 = 0x87c37b91114253d5ull;
+    const uint64_t c2 = 0x4cf5ad432745937full;
+    uint64_t hash = 0x9e3779b97f4a7c15ull ^ (uint64_t)len;
+
+    int i = 0;
+    for (; i + 8 <= len; i += 8) {
+        uint64_t word;
+        memcpy(&word, key + i, sizeof(word));
+
+        word = rotate_left(word * c1, 31) * c2;
+        hash = rotate_left(hash ^ word, 27) * 5 + 0x52dce729;
+    }
+
+    if (i < len) {
+        uint64_t word = 0;
+        memcpy(&word, key + i, len - i);
+
+        word = rotate_left(word * c1, 31) * c2;
+        hash ^= word;
     }
 
-    return hash;
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdull;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ull;
+    hash ^= hash >> 33;
+    return (uint32_t)hash;
 }
 
 ObjBoundMethod *new_bound_method(Value receiver, ObjClosure *method)
@@ -61,7 +93,15 @@ ObjClass *new_class(ObjString *name)
 {
     ObjClass *klass = ALLOCATE_OBJ(ObjClass, OBJ_CLASS);
     klass->name = name;
-    init_table(&klass->methods);
+    klass->vtable = NULL;
+    klass->vtable_count = 0;
+    klass->root_shape = NULL;
+    klass->slot_hint = 0;
+
+    push(OBJ_VAL(klass));
+    klass->root_shape = new_shape(NULL, NULL);
+    pop();
+
     return klass;
 }
 
@@ -85,15 +125,65 @@ ObjFunction *new_function()
     function->arity = 0;
     function->upvalue_count = 0;
     function->name = NULL;
+    function->source = NULL;
+    function->accessor = ACCESSOR_NONE;
+    function->field = NULL;
+    function->constant = NIL_VAL;
     init_chunk(&function->chunk);
+#if JIT
+    function->hotness = 0;
+    function->jit = NULL;
+#endif // JIT
+#if AOT
+    function->aot = NULL;
+#endif // AOT
+#if REGISTER_VM
+    function->registers = NULL;
+#endif // REGISTER_VM
     return function;
 }
 
+void class_set_method(ObjClass *klass, int selector, Value method)
+{
+    if (selector >= klass->vtable_count) {
+        int old = klass->vtable_count;
+        klass->vtable = GROW_ARRAY(Value, klass->vtable, old, selector + 1);
+        for (int i = old; i < selector; i++) {
+            klass->vtable[i] = NIL_VAL;
+        }
+        klass->vtable_count = selector + 1;
+    }
+
+    klass->vtable[selector] = method;
+}
+
+// Runs before the subclass defines any methods of its own, so it just takes a
+// copy of the superclass's vtable.
+void class_inherit(ObjClass *subclass, ObjClass *superclass)
+{
+    int count = superclass->vtable_count;
+    if (count == 0) return;
+
+    Value *vtable = ALLOCATE(Value, count);
+    memcpy(vtable, superclass->vtable, sizeof(Value) * count);
+    FREE_ARRAY(Value, subclass->vtable, subclass->vtable_count);
+    subclass->vtable = vtable;
+    subclass->vtable_count = count;
+}
+
 ObjInstance *new_instance(ObjClass *klass)
 {
-    ObjInstance *instance = ALLOCATE_OBJ(ObjInstance, OBJ_INSTANCE);
+    // Instances get as many inline slots as the largest instance of their
+    // class has needed so far, so the common case never allocates again.
+    int inline_capacity = klass->slot_hint;
+    ObjInstance *instance = ALLOCATE_FLEX(ObjInstance, Value, inline_capacity, OBJ_INSTANCE);
+
     instance->klass = klass;
-    init_table(&instance->fields);
+    instance->shape = klass->root_shape;
+    instance->dictionary = NULL;
+    instance->slots = instance->inline_slots;
+    instance->slot_capacity = inline_capacity;
+    instance->inline_capacity = inline_capacity;
     return instance;
 }
 
@@ -104,6 +194,119 @@ ObjNative *new_native(ObjString *name, NativeFn function)
     return native;
 }
 
+ObjShape *new_shape(ObjShape *parent, ObjString *name)
+{
+    ObjShape *shape = ALLOCATE_OBJ(ObjShape, OBJ_SHAPE);
+    shape->parent = parent;
+    shape->name = name;
+    shape->field_count = parent == NULL ? 0 : parent->field_count + 1;
+    init_table(&shape->transitions);
+    return shape;
+}
+
+int shape_find_slot(ObjShape *shape, ObjString *name)
+{
+    // The field added by a shape always lives in its last slot, so walking up
+    // the tree visits each field exactly once.
+    for (; shape->name != NULL; shape = shape->parent) {
+        if (shape->name == name) return shape->field_count - 1;
+    }
+
+    return -1;
+}
+
+ObjShape *shape_transition(ObjShape *shape, ObjString *name)
+{
+    Value child;
+    if (table_get(&shape->transitions, name, &child)) {
+        return (ObjShape *)AS_OBJ(child);
+    }
+
+    ObjShape *created = new_shape(shape, name);
+    push(OBJ_VAL(created));
+    table_set(&shape->transitions, name, OBJ_VAL(created));
+    pop();
+
+    return created;
+}
+
+static void to_dictionary(ObjInstance *instance)
+{
+    Table *dictionary = ALLOCATE(Table, 1);
+    init_table(dictionary);
+
+    for (ObjShape *shape = instance->shape; shape->name != NULL; shape = shape->parent) {
+        table_set(dictionary, shape->name, instance->slots[shape->field_count - 1]);
+    }
+
+    if (instance->slots != instance->inline_slots) {
+        FREE_ARRAY(Value, instance->slots, instance->slot_capacity);
+    }
+
+    instance->dictionary = dictionary;
+    instance->shape = NULL;
+    instance->slots = instance->inline_slots;
+    instance->slot_capacity = instance->inline_capacity;
+}
+
+bool instance_get_field(ObjInstance *instance, ObjString *name, Value *value)
+{
+    if (instance->shape == NULL) {
+        return table_get(instance->dictionary, name, value);
+    }
+
+    int slot = shape_find_slot(instance->shape, name);
+    if (slot == -1) return false;
+
+    *value = instance->slots[slot];
+    return true;
+}
+
+void instance_add_field(ObjInstance *instance, ObjShape *shape, Value value)
+{
+    if (instance->slot_capacity < shape->field_count) {
+        int capacity = GROW_CAPACITY(instance->slot_capacity);
+        Value *slots = ALLOCATE(Value, capacity);
+        memcpy(slots, instance->slots, sizeof(Value) * instance->shape->field_count);
+
+        if (instance->slots != instance->inline_slots) {
+            FREE_ARRAY(Value, instance->slots, instance->slot_capacity);
+        }
+
+        instance->slots = slots;
+        instance->slot_capacity = capacity;
+    }
+
+    instance->slots[shape->field_count - 1] = value;
+    instance->shape = shape;
+
+    if (instance->klass->slot_hint < shape->field_count) {
+        instance->klass->slot_hint = shape->field_count;
+    }
+}
+
+int instance_set_field(ObjInstance *instance, ObjString *name, Value value)
+{
+    if (instance->shape != NULL) {
+        int slot = shape_find_slot(instance->shape, name);
+        if (slot != -1) {
+            instance->slots[slot] = value;
+            return slot;
+        }
+
+        if (instance->shape->field_count < SHAPE_MAX_FIELDS) {
+            ObjShape *shape = shape_transition(instance->shape, name);
+            instance_add_field(instance, shape, value);
+            return shape->field_count - 1;
+        }
+
+        to_dictionary(instance);
+    }
+
+    table_set(instance->dictionary, name, value);
+    return -1;
+}
+
 ObjUpvalue *new_upvalue(Value *slot)
 {
     ObjUpvalue *upvalue = ALLOCATE_OBJ(ObjUpvalue, OBJ_UPVALUE);
@@ -113,66 +316,370 @@ ObjUpvalue *new_upvalue(Value *slot)
     return upvalue;
 }
 
-ObjString *take_string(char *chars, int len)
+/*
+ * Makes a flat string with room for `len` characters, which the caller fills
+ * in and hands to take_string() before allocating anything else. Only a copy
+ * of the text of a script is never interned.
+*/
+ObjString *allocate_string(int len)
 {
-    uint32_t hash = hash_string(chars, len);
-    ObjString *interned = table_find_string(&vm.strings, chars, len, hash);
+    ObjString *string = ALLOCATE_FLEX(ObjString, char, len + 1, OBJ_STRING);
+    string->len = len;
+    string->hash = 0;
+    string->chars = string->storage;
+    string->chars[len] = '\0';
+    string->left = NULL;
+    string->right = NULL;
+    string->interned = NULL;
+    string->source = NULL;
+    return string;
+}
+
+// Interns a string from allocate_string(), or returns the one already
+// interned with the same characters.
+ObjString *take_string(ObjString *string)
+{
+    uint32_t hash = hash_string(string->chars, string->len);
+    ObjString *interned = table_find_string(&vm.strings, string->chars, string->len, hash);
     if (interned != NULL) {
-        FREE_ARRAY(char, chars, len + 1);
+        // Nothing has been allocated since, so it can go straight away.
+        if (vm.objects == (Obj *)string) {
+            vm.objects = string->obj.next;
+            FREE_FLEX(ObjString, char, string, string->len + 1);
+        }
         return interned;
     }
 
-    return allocate_string(chars, len, hash);
+    string->hash = hash;
+    return intern_string(string);
 }
 
 ObjString *copy_string(const char *chars, int len)
 {
     uint32_t hash = hash_string(chars, len);
     ObjString *interned = table_find_string(&vm.strings, chars, len, hash);
+    if (interned != NULL) {
+        if (interned->source != NULL) materialize_string(interned);
+        return interned;
+    }
+
+    ObjString *string = allocate_string(len);
+    memcpy(string->chars, chars, len);
+    string->hash = hash;
+    return intern_string(string);
+}
+
+ObjString *new_rope(ObjString *left, ObjString *right)
+{
+    ObjString *rope = ALLOCATE_OBJ(ObjString, OBJ_STRING);
+    rope->len = left->len + right->len;
+    rope->chars = NULL;
+    rope->hash = 0;
+    rope->left = left;
+    rope->right = right;
+    rope->interned = NULL;
+    rope->source = NULL;
+    return rope;
+}
+
+// Wraps characters the VM doesn't own, for views to point into. It isn't
+// interned, and nothing ever frees or copies out its characters.
+ObjString *borrow_string(const char *chars, int len)
+{
+    ObjString *string = ALLOCATE_OBJ(ObjString, OBJ_STRING);
+    string->len = len;
+    string->hash = 0;
+    string->chars = (char *)chars;
+    string->left = NULL;
+    string->right = NULL;
+    string->interned = NULL;
+    string->source = string;
+    return string;
+}
+
+/*
+ * Makes a string out of `len` of the characters of `source` from `start` on,
+ * without copying them, or returns the one already interned with the same
+ * characters. The view points into whatever `source` itself points into.
+*/
+ObjString *new_view(ObjString *source, int start, int len)
+{
+    uint32_t hash = hash_string(source->chars + start, len);
+    ObjString *interned = table_find_string(&vm.strings, source->chars + start, len, hash);
     if (interned != NULL) return interned;
 
-    char *heap_chars = ALLOCATE(char, len + 1);
-    memcpy(heap_chars, chars, len);
-    heap_chars[len] = '\0';
-    return allocate_string(heap_chars, len, hash);
+    // A collection here can copy out `source`'s characters if it's a view
+    // itself, so they are only looked at again afterwards.
+    ObjString *view = ALLOCATE_OBJ(ObjString, OBJ_STRING);
+    view->len = len;
+    view->hash = hash;
+    view->chars = source->chars + start;
+    view->left = NULL;
+    view->right = NULL;
+    view->interned = NULL;
+    view->source = source->source != NULL ? source->source : source;
+    return intern_string(view);
+}
+
+/*
+ * Gives a view characters of its own. This runs in the middle of a
+ * collection, so the copy is made outside reallocate(), which could start
+ * another one, and counted by hand.
+*/
+void materialize_string(ObjString *view)
+{
+    char *chars = malloc(view->len + 1);
+    if (chars == NULL) exit(1);
+
+    memcpy(chars, view->chars, view->len);
+    chars[view->len] = '\0';
+    vm.bytes_allocated += view->len + 1;
+
+    view->chars = chars;
+    view->source = NULL;
+}
+
+// Whether `chars` has to be freed along with the string. Only flat strings and
+// views that have been materialized have characters of their own. A rope, a
+// view and a borrowed string borrow theirs.
+bool string_owns_chars(ObjString *string)
+{
+    return string->chars != NULL && string->interned == NULL && string->source == NULL;
+}
+
+// Copies a rope's characters into a new flat string, right to left. A rope built up
+// by appending in a loop leans left, so the stack of halves still to copy
+// stays short, but one built by prepending would not, so it can grow.
+static ObjString *copy_rope(ObjString *rope)
+{
+    int capacity = 8;
+    int count = 0;
+    ObjString **stack = ALLOCATE(ObjString *, capacity);
+    stack[count++] = rope;
+
+    ObjString *flat = allocate_string(rope->len);
+    char *chars = flat->chars;
+    push(OBJ_VAL(flat));
+
+    int end = rope->len;
+    while (count > 0) {
+        ObjString *string = stack[--count];
+        if (string->chars != NULL) {
+            // A flattened rope's own `chars` go stale if what it flattened to
+            // was a view that has since been materialized.
+            if (string->interned != NULL) string = string->interned;
+            end -= string->len;
+            memcpy(chars + end, string->chars, string->len);
+            continue;
+        }
+
+        if (capacity < count + 2) {
+            int old = capacity;
+            capacity = GROW_CAPACITY(old);
+            stack = GROW_ARRAY(ObjString *, stack, old, capacity);
+        }
+        stack[count++] = string->left;
+        stack[count++] = string->right;
+    }
+
+    pop();
+    FREE_ARRAY(ObjString *, stack, capacity);
+    return flat;
+}
+
+// Returns the interned string with the same characters, flattening a rope
+// the first time it's asked.
+ObjString *flatten_string(ObjString *string)
+{
+    if (string->interned != NULL) return string->interned;
+    if (string->chars != NULL) return string;
+
+    push(OBJ_VAL(string));
+    ObjString *interned = take_string(copy_rope(string));
+    pop();
+
+    string->chars = interned->chars;
+    string->hash = interned->hash;
+    string->left = NULL;
+    string->right = NULL;
+    string->interned = interned;
+    return interned;
+}
+
+static bool is_interned(ObjString *string)
+{
+    return string->chars != NULL && string->interned == NULL;
+}
+
+// Two interned strings are equal only if they are the same string. A rope
+// has to be flattened first to find out.
+bool strings_equal(ObjString *a, ObjString *b)
+{
+    if (a == b) return true;
+    if (a->len != b->len) return false;
+    if (is_interned(a) && is_interned(b)) return false;
+
+    push(OBJ_VAL(a));
+    push(OBJ_VAL(b));
+    bool equal = flatten_string(a) == flatten_string(b);
+    pop();
+    pop();
+    return equal;
+}
+
+ObjStringBuilder *new_string_builder()
+{
+    ObjStringBuilder *builder = ALLOCATE_OBJ(ObjStringBuilder, OBJ_STRING_BUILDER);
+    builder->chars = NULL;
+    builder->len = 0;
+    builder->capacity = 0;
+    builder->built = NULL;
+    return builder;
+}
+
+// Makes room for `len` more characters and the NUL after them, doubling so
+// that appending is amortised constant time.
+static char *builder_reserve(ObjStringBuilder *builder, int len)
+{
+    if (builder->capacity < builder->len + len + 1) {
+        int old = builder->capacity;
+        int capacity = GROW_CAPACITY(old);
+        while (capacity < builder->len + len + 1) capacity *= 2;
+
+        builder->chars = GROW_ARRAY(char, builder->chars, old, capacity);
+        builder->capacity = capacity;
+    }
+
+    builder->built = NULL;
+    return builder->chars + builder->len;
+}
+
+void builder_append(ObjStringBuilder *builder, const char *chars, int len)
+{
+    memcpy(builder_reserve(builder, len), chars, len);
+    builder->len += len;
 }
 
-static void print_function(ObjFunction *function)
+/*
+ * Objects are shown the same way whether they're printed or appended to a
+ * builder. Everything below writes to `out`, or to stdout when it is NULL.
+*/
+
+// Numbers and most names fit in `buffer`, so they are only formatted once.
+static void write_format(ObjStringBuilder *out, const char *fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    if (out == NULL) {
+        vprintf(fmt, args);
+        va_end(args);
+        return;
+    }
+
+    char buffer[64];
+    int len = vsnprintf(buffer, sizeof(buffer), fmt, args);
+    va_end(args);
+
+    if (len < (int)sizeof(buffer)) {
+        builder_append(out, buffer, len);
+        return;
+    }
+
+    va_start(args, fmt);
+    vsnprintf(builder_reserve(out, len), len + 1, fmt, args);
+    va_end(args);
+    out->len += len;
+}
+
+static void write_chars(ObjStringBuilder *out, const char *chars, int len)
+{
+    if (len == 0) return;
+
+    if (out == NULL) {
+        printf("%.*s", len, chars);
+    } else {
+        builder_append(out, chars, len);
+    }
+}
+
+static void write_function(ObjStringBuilder *out, ObjFunction *function)
 {
     if (function->name == NULL) {
-        printf("<script>");
+        write_format(out, "<script>");
         return;
     }
 
-    printf("<user func %s>", function->name->chars);
+    write_format(out, "<user func %s>", function->name->chars);
 }
 
-void print_object(Value value)
+static void write_object(ObjStringBuilder *out, Value value)
 {
     switch (OBJ_TYPE(value)) {
         case OBJ_BOUND_METHOD:
-            print_function(AS_BOUND_METHOD(value)->method->function);
+            write_function(out, AS_BOUND_METHOD(value)->method->function);
             break;
         case OBJ_CLASS:
-            printf("%s Class", AS_CLASS(value)->name->chars);
+            write_format(out, "%s Class", AS_CLASS(value)->name->chars);
             break;
         case OBJ_CLOSURE:
-            print_function(AS_CLOSURE(value)->function);
+            write_function(out, AS_CLOSURE(value)->function);
             break;
         case OBJ_FUNCTION:
-            print_function(AS_FUNCTION(value));
+            write_function(out, AS_FUNCTION(value));
             break;
         case OBJ_INSTANCE:
-            printf("%s Instance", AS_INSTANCE(value)->klass->name->chars);
+            write_format(out, "%s Instance", AS_INSTANCE(value)->klass->name->chars);
             break;
         case OBJ_NATIVE:
-            printf("<native func>");
+            write_format(out, "<native func>");
             break;
-        case OBJ_STRING:
-            printf("%s", AS_CSTRING(value));
+        case OBJ_SHAPE:
+            write_format(out, "shape");
             break;
+        case OBJ_STRING: {
+            ObjString *string = flatten_string(AS_STRING(value));
+            write_chars(out, string->chars, string->len);
+        } break;
+        case OBJ_STRING_BUILDER: {
+            // A builder can be written to itself, so room is made before its
+            // characters are looked up.
+            ObjStringBuilder *builder = AS_STRING_BUILDER(value);
+            if (out != NULL) builder_reserve(out, builder->len);
+            write_chars(out, builder->chars, builder->len);
+        } break;
         case OBJ_UPVALUE:
-            printf("upvalue");
+            write_format(out, "upvalue");
             break;
     }
 }
+
+// Appends a value as `print` would show it, without interning anything.
+// Another builder is appended as the text it holds.
+void builder_append_value(ObjStringBuilder *builder, Value value)
+{
+    if (IS_BOOL(value)) {
+        write_format(builder, AS_BOOL(value) ? "true" : "false");
+    } else if (IS_NIL(value)) {
+        write_format(builder, "nil");
+    } else if (IS_NUMBER(value)) {
+        write_format(builder, "%.32g", AS_NUMBER(value));
+    } else if (IS_OBJ(value)) {
+        write_object(builder, value);
+    }
+}
+
+// Interns what has been appended so far. This is the only string a builder
+// ever makes.
+ObjString *builder_to_string(ObjStringBuilder *builder)
+{
+    if (builder->built == NULL) {
+        builder->built = copy_string(builder->len == 0 ? "" : builder->chars, builder->len);
+    }
+
+    return builder->built;
+}
+
+void print_object(Value value)
+{
+    write_object(NULL, value);
+}
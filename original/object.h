@@ -13,10 +13,20 @@ typedef enum {
     OBJ_FUNCTION,
     OBJ_INSTANCE,
     OBJ_NATIVE,
+    OBJ_SHAPE,
     OBJ_STRING,
+    OBJ_STRING_BUILDER,
     OBJ_UPVALUE
 } ObjType;
 
+// Instances that grow past this many fields leave the shape tree and keep
+// their fields in a hash table instead ("dictionary mode").
+#define SHAPE_MAX_FIELDS 64
+
+// Concatenations at least this long make a rope rather than copying. Shorter
+// ones are cheaper to copy and intern straight away.
+#define ROPE_MIN_LENGTH 64
+
 #define OBJ_TYPE(value)     (AS_OBJ(value)->type)
 
 #define IS_BOUND_METHOD(value)  is_obj_type(value, OBJ_BOUND_METHOD)
@@ -26,6 +36,7 @@ typedef enum {
 #define IS_INSTANCE(value)      is_obj_type(value, OBJ_INSTANCE)
 #define IS_NATIVE(value)        is_obj_type(value, OBJ_NATIVE)
 #define IS_STRING(value)        is_obj_type(value, OBJ_STRING)
+#define IS_STRING_BUILDER(value) is_obj_type(value, OBJ_STRING_BUILDER)
 
 #define AS_BOUND_METHOD(value)  ((ObjBoundMethod *)AS_OBJ(value))
 #define AS_CLASS(value)         ((ObjClass *)AS_OBJ(value))
@@ -35,6 +46,7 @@ typedef enum {
 #define AS_NATIVE(value)        (((ObjNative *)AS_OBJ(value))->function)
 #define AS_STRING(value)        ((ObjString *)AS_OBJ(value))
 #define AS_CSTRING(value)       (((ObjString *)AS_OBJ(value))->chars)
+#define AS_STRING_BUILDER(value) ((ObjStringBuilder *)AS_OBJ(value))
 
 struct Obj {
     ObjType type;
@@ -42,28 +54,111 @@ struct Obj {
     struct Obj *next;
 };
 
+#if JIT
+typedef struct JitCode JitCode;
+#endif // JIT
+
+#if AOT
+struct CallFrame;
+#endif // AOT
+
+#if REGISTER_VM
+typedef struct RegisterCode RegisterCode;
+#endif // REGISTER_VM
+
+/*
+ * What a method does when its whole body is one field read, one field write
+ * or one constant, which is enough for an invoke site to run it inline
+ * instead of calling it. A setter hands back nil, or the value it stored when
+ * its body is `return this.field = value;`.
+*/
+typedef enum {
+    ACCESSOR_NONE,
+    ACCESSOR_GETTER,
+    ACCESSOR_SETTER,
+    ACCESSOR_SETTER_RESULT,
+    ACCESSOR_CONSTANT
+} AccessorKind;
+
 typedef struct {
     Obj obj;
     int arity;
     int upvalue_count;
     Chunk chunk;
     ObjString *name;
+    ObjString *source;  // The text it was compiled from, which literals point into
+    AccessorKind accessor;
+    ObjString *field;   // What a getter or setter reads or writes
+    Value constant;     // What a constant method returns
+#if JIT
+    int hotness;        // Calls plus loop iterations, until it is compiled
+    JitCode *jit;
+#endif // JIT
+#if AOT
+    bool (*aot)(struct CallFrame *frame);   // Generated by cloxc, if any
+#endif // AOT
+#if REGISTER_VM
+    RegisterCode *registers;    // What runs in place of the chunk's bytecode
+#endif // REGISTER_VM
 } ObjFunction;
 
-typedef Value (*NativeFn)(int arg_count, Value *args);
+// A native puts what it returns in `result`, or reports a runtime error and
+// returns false.
+typedef bool (*NativeFn)(int arg_count, Value *args, Value *result);
 
 typedef struct {
     Obj obj;
     NativeFn function;
 } ObjNative;
 
+/*
+ * A string is either flat, with its characters stored right after it in the
+ * same allocation and its entry in vm.strings, or a rope: the result of
+ * concatenating two strings, which keeps the two halves and puts off copying
+ * them.
+ *
+ * A rope is flattened the first time its characters are needed, when it is
+ * compared or printed. That interns its characters like any other string,
+ * and the rope keeps the interned string from then on, sharing its `chars`
+ * and `hash`. Its halves are dropped.
+ *
+ * A view is an interned string whose characters belong to another one, its
+ * source, as string literals belong to the text of the script. A view
+ * doesn't keep its source alive. If nothing else does, the collector copies
+ * the view's characters out instead, and the view owns them from then on.
+ * A view's characters don't end in a NUL, so copy_string(), whose callers
+ * use names as C strings, copies them out too.
+ *
+ * The text of a script is usually borrowed from the caller, who keeps it
+ * until the VM is freed. A borrowed string is its own source, so the
+ * collector never frees its characters.
+*/
 struct ObjString {
     Obj obj;
     int len;
-    char *chars;
     uint32_t hash;
+    char *chars;            // `storage`, or NULL until a rope is flattened
+    ObjString *left;        // A rope's halves, until it is flattened
+    ObjString *right;
+    ObjString *interned;    // What a rope flattened to
+    ObjString *source;      // What a view's characters belong to
+    char storage[FLEXIBLE];
 };
 
+/*
+ * Text being put together a piece at a time. Its buffer grows like any other
+ * dynamic array and none of the pieces are interned, only the finished
+ * string. That string is kept until the next append, so asking again costs
+ * nothing.
+*/
+typedef struct {
+    Obj obj;
+    char *chars;
+    int len;
+    int capacity;
+    ObjString *built;       // What builder_to_string() last returned
+} ObjStringBuilder;
+
 typedef struct ObjUpvalue {
     Obj obj;
     Value *location;
@@ -78,16 +173,47 @@ typedef struct {
     int upvalue_count;
 } ObjClosure;
 
-typedef struct {
+/*
+ * A hidden class describing which fields an instance has and where each one
+ * lives in its slot array.
+ *
+ * Shapes form a transition tree rooted at each class. Adding a field moves an
+ * instance from its shape to the child shape for that field name, so every
+ * instance that gets the same fields in the same order ends up sharing one
+ * shape, and a field always lives at the same slot for a given shape.
+*/
+struct ObjShape {
     Obj obj;
+    ObjShape *parent;
     ObjString *name;
-    Table methods;
-} ObjClass;
+    int field_count;
+    Table transitions;
+};
+
+/*
+ * Methods are indexed by selector, the dense id the VM gives each method name
+ * (see method_selector()). The vtable runs up to the highest selector the
+ * class has a method for, inherited ones included, and holds nil for the
+ * selectors in between that it has none for.
+*/
+struct ObjClass {
+    Obj obj;
+    ObjString *name;
+    Value *vtable;
+    int vtable_count;
+    ObjShape *root_shape;
+    int slot_hint;
+};
 
 typedef struct {
     Obj obj;
     ObjClass *klass;
-    Table fields;
+    ObjShape *shape;
+    Table *dictionary;
+    Value *slots;
+    int slot_capacity;
+    int inline_capacity;
+    Value inline_slots[];
 } ObjInstance;
 
 typedef struct {
@@ -100,11 +226,31 @@ ObjBoundMethod *new_bound_method(Value receiver, ObjClosure *method);
 ObjClass *new_class(ObjString *name);
 ObjClosure *new_closure(ObjFunction *function);
 ObjFunction *new_function();
+void class_set_method(ObjClass *klass, int selector, Value method);
+void class_inherit(ObjClass *subclass, ObjClass *superclass);
 ObjInstance *new_instance(ObjClass *klass);
 ObjNative *new_native(ObjString *name, NativeFn function);
+ObjShape *new_shape(ObjShape *parent, ObjString *name);
+int shape_find_slot(ObjShape *shape, ObjString *name);
+ObjShape *shape_transition(ObjShape *shape, ObjString *name);
+bool instance_get_field(ObjInstance *instance, ObjString *name, Value *value);
+int instance_set_field(ObjInstance *instance, ObjString *name, Value value);
+void instance_add_field(ObjInstance *instance, ObjShape *shape, Value value);
 ObjUpvalue *new_upvalue(Value *slot);
-ObjString *take_string(char *chars, int len);
+ObjString *allocate_string(int len);
+ObjString *take_string(ObjString *string);
 ObjString *copy_string(const char *chars, int len);
+ObjString *new_rope(ObjString *left, ObjString *right);
+ObjString *borrow_string(const char *chars, int len);
+ObjString *new_view(ObjString *source, int start, int len);
+void materialize_string(ObjString *view);
+bool string_owns_chars(ObjString *string);
+ObjString *flatten_string(ObjString *string);
+bool strings_equal(ObjString *a, ObjString *b);
+ObjStringBuilder *new_string_builder();
+void builder_append(ObjStringBuilder *builder, const char *chars, int len);
+void builder_append_value(ObjStringBuilder *builder, Value value);
+ObjString *builder_to_string(ObjStringBuilder *builder);
 void print_object(Value value);
 
 static inline bool is_obj_type(Value value, ObjType type)
@@ -112,4 +258,12 @@ static inline bool is_obj_type(Value value, ObjType type)
     return IS_OBJ(value) && AS_OBJ(value)->type == type;
 }
 
+static inline bool class_method(ObjClass *klass, int selector, Value *method)
+{
+    if (selector >= klass->vtable_count) return false;
+
+    *method = klass->vtable[selector];
+    return !IS_NIL(*method);
+}
+
 #endif // CLOX_OBJECT_H
\ No newline at end of file
@@ -0,0 +1,1101 @@
+#include <string.h>
+
+#include "memory.h"
+#include "optimizer.h"
+
+/*
+ * The mid-level IR, used at -O2. A function's finished bytecode is decoded
+ * into basic blocks, and every value an instruction pushes gets a value
+ * number. Each stack value is made once and used once, so the stack is
+ * already in SSA form, and two values with the same number are sure to be
+ * equal. Locals stay in their slots, and which of them are live is worked out
+ * over the blocks.
+ *
+ * Three passes run over the IR:
+ *
+ *  - Loop-invariant code motion moves global reads out of the loop's
+ *    condition and into a preheader that runs once before the loop. Every
+ *    other read of the same global in the loop reads the result instead. A
+ *    loop that calls anything is left alone, since the call could change what
+ *    was read. The condition always runs before the body, but anything in
+ *    front of the read that could fail or have an effect stops it being moved,
+ *    so errors still happen in the same order. Property reads stay where they
+ *    are: the same name can find a method, and every read of a method has to
+ *    give a new bound method.
+ *  - Common subexpression elimination replaces an operator whose operands
+ *    have already been combined the same way, earlier in the block, with a
+ *    read of a local that still holds the result, or of a temporary the first
+ *    result is kept in.
+ *  - Dead store elimination drops an assignment to a local that is never read
+ *    again. Locals captured by a closure are never dropped. When the value
+ *    assigned was a constant or another read, and only popped afterwards, that
+ *    goes too.
+ *
+ * Temporaries are extra locals right after the parameters. They start as
+ * nil, and every other local moves up to make room. The IR is then lowered
+ * back to bytecode, with jumps worked out again. If anything won't fit, the
+ * function keeps the code it had.
+*/
+
+#define SLOT_WORDS (UINT8_COUNT / 64)
+
+typedef struct {
+    uint64_t bits[SLOT_WORDS];
+} SlotSet;
+
+typedef struct {
+    OpCode op;
+    int from;           // Where it starts in the code being optimised
+    int length;
+    int line;
+    int block;
+    int target;         // The instruction a jump or loop lands on, or -1
+    int first;          // Where the expression for what it pushes starts, or
+                        // -1 if it pushes nothing or the expression doesn't
+                        // start in this block
+    int value;          // The value number of what it pushes, or -1
+    int load_local;     // A local to read instead of this expression, or -1
+    int load_temp;      // A temporary to read instead, or -1
+    int store_temp;     // A temporary to keep what it pushes in, or -1
+    int source;         // The instruction whose temporary it reads, or -1
+    bool removed;
+    bool hoisted;       // Moved out of its loop into a preheader
+} IrInstr;
+
+typedef struct {
+    int start;
+    int end;            // One past its last instruction
+    SlotSet live_in;
+    SlotSet live_out;
+} IrBlock;
+
+// A loop, from the instruction its back edges land on to the last of them.
+typedef struct {
+    int start;
+    int end;
+} IrLoop;
+
+// An expression read once in the preheader in front of `header`.
+typedef struct {
+    int header;
+    int first;
+    int root;
+    int temp;
+} Hoist;
+
+// An entry in the value numbering table. Entries from earlier blocks are
+// never matched.
+typedef struct {
+    OpCode op;
+    int operand;
+    int a;
+    int b;
+    int block;
+    int value;
+} Expression;
+
+typedef struct {
+    int value;
+    int first;
+} StackValue;
+
+typedef struct {
+    ObjFunction *function;
+    Chunk *chunk;
+    IrInstr *instrs;
+    int count;
+    int *index;         // The instruction starting at each offset
+    IrBlock *blocks;
+    int block_count;
+    IrLoop *loops;
+    int loop_count;
+    Hoist *hoists;
+    int hoist_count;
+    int hoist_capacity;
+    Expression *table;
+    int table_capacity;
+    int *roots;         // For each value number, the first operator to make it
+    int *holders;       // For each value number, the local it was last stored in
+    int value_count;
+    int value_capacity;
+    bool captured[UINT8_COUNT];
+    int canonical[UINT8_COUNT];
+    int max_height;
+    int temp_count;     // Temporaries for hoisted reads, one per loop read
+    int pool_count;     // Temporaries shared by the blocks for subexpressions
+    bool changed;
+} Ir;
+
+static bool set_has(SlotSet *set, int slot)
+{
+    return (set->bits[slot / 64] >> (slot % 64)) & 1;
+}
+
+static void set_add(SlotSet *set, int slot)
+{
+    set->bits[slot / 64] |= (uint64_t)1 << (slot % 64);
+}
+
+static void set_remove(SlotSet *set, int slot)
+{
+    set->bits[slot / 64] &= ~((uint64_t)1 << (slot % 64));
+}
+
+static int read_short(Ir *ir, int offset)
+{
+    return (ir->chunk->code[offset] << 8) | ir->chunk->code[offset + 1];
+}
+
+static int operand(Ir *ir, int i)
+{
+    return ir->chunk->code[ir->instrs[i].from + 1];
+}
+
+// How many values an instruction takes off the stack, and how many it puts
+// back. An instruction that leaves its operand where it is, like SET_LOCAL,
+// takes it and puts it back.
+static void stack_effect(Ir *ir, int i, int *pops, int *pushes)
+{
+    IrInstr *instr = &ir->instrs[i];
+    uint8_t *code = ir->chunk->code + instr->from;
+    *pops = 0;
+    *pushes = 0;
+
+    switch (instr->op) {
+        case OP_CLASS:
+        case OP_CONSTANT:
+        case OP_CLOSURE:
+        case OP_GET_GLOBAL:
+        case OP_GET_UPVALUE:
+        case OP_GET_LOCAL:
+        case OP_NIL:
+        case OP_TRUE:
+        case OP_FALSE:
+            *pushes = 1;
+            break;
+        case OP_INHERIT:
+        case OP_METHOD:
+        case OP_DEFINE_GLOBAL:
+        case OP_CLOSE_UPVALUE:
+        case OP_POP:
+        case OP_PRINT:
+        case OP_RETURN:
+            *pops = 1;
+            break;
+        case OP_GET_PROPERTY:
+        case OP_SET_GLOBAL:
+        case OP_SET_UPVALUE:
+        case OP_SET_LOCAL:
+        case OP_JUMP_IF_FALSE:
+        case OP_NOT:
+        case OP_NEGATE:
+            *pops = 1;
+            *pushes = 1;
+            break;
+        case OP_GET_SUPER:
+        case OP_SET_PROPERTY:
+        case OP_EQUAL:
+        case OP_GREATER:
+        case OP_LESS:
+        case OP_GREATER_EQUAL:
+        case OP_LESS_EQUAL:
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+            *pops = 2;
+            *pushes = 1;
+            break;
+        case OP_CALL:
+        case OP_TAIL_CALL:
+            *pops = code[1] + 1;
+            *pushes = 1;
+            break;
+        case OP_INVOKE:
+            *pops = code[2] + 1;
+            *pushes = 1;
+            break;
+        case OP_SUPER_INVOKE:
+            *pops = code[2] + 2;
+            *pushes = 1;
+            break;
+        default:
+            break;
+    }
+}
+
+static bool is_call(OpCode op)
+{
+    return op == OP_CALL || op == OP_TAIL_CALL || op == OP_INVOKE || op == OP_SUPER_INVOKE;
+}
+
+static bool is_operator(OpCode op)
+{
+    switch (op) {
+        case OP_NOT:
+        case OP_NEGATE:
+        case OP_EQUAL:
+        case OP_GREATER:
+        case OP_LESS:
+        case OP_GREATER_EQUAL:
+        case OP_LESS_EQUAL:
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Instructions that can't fail and have no effect beyond what they push.
+static bool is_pure(OpCode op)
+{
+    switch (op) {
+        case OP_CONSTANT:
+        case OP_NIL:
+        case OP_TRUE:
+        case OP_FALSE:
+        case OP_GET_LOCAL:
+        case OP_GET_UPVALUE:
+        case OP_NOT:
+            return true;
+        default:
+            return false;
+    }
+}
+
+static bool ends_block(OpCode op)
+{
+    return op == OP_JUMP || op == OP_JUMP_IF_FALSE || op == OP_LOOP || op == OP_RETURN;
+}
+
+static bool same_constant(Value a, Value b)
+{
+    if (IS_NUMBER(a) && IS_NUMBER(b)) {
+        double x = AS_NUMBER(a);
+        double y = AS_NUMBER(b);
+        return memcmp(&x, &y, sizeof(double)) == 0;
+    }
+
+    return values_equal(a, b);
+}
+
+//----------------------------------------------------------------------------
+// Building the IR
+
+/*
+ * Works out the highest the stack gets, since every temporary adds one to
+ * it and the register VM can't go past UINT8_COUNT slots.
+*/
+static void find_max_height(Ir *ir)
+{
+    int *heights = ALLOCATE(int, ir->count + 1);
+    int *work = ALLOCATE(int, ir->count + 1);
+    int work_count = 0;
+
+    for (int i = 0; i <= ir->count; i++) heights[i] = -1;
+    heights[0] = ir->function->arity + 1;
+    work[work_count++] = 0;
+    ir->max_height = heights[0];
+
+    while (work_count > 0) {
+        int i = work[--work_count];
+        int pops, pushes;
+        stack_effect(ir, i, &pops, &pushes);
+
+        int height = heights[i] - pops + pushes;
+        if (heights[i] + pushes > ir->max_height) ir->max_height = heights[i] + pushes;
+
+        int successors[2];
+        int successor_count = 0;
+        OpCode op = ir->instrs[i].op;
+        if (op != OP_JUMP && op != OP_LOOP && op != OP_RETURN) successors[successor_count++] = i + 1;
+        if (ir->instrs[i].target >= 0) successors[successor_count++] = ir->instrs[i].target;
+
+        for (int j = 0; j < successor_count; j++) {
+            int next = successors[j];
+            if (next < ir->count && heights[next] == -1) {
+                heights[next] = height;
+                work[work_count++] = next;
+            }
+        }
+    }
+
+    FREE_ARRAY(int, heights, ir->count + 1);
+    FREE_ARRAY(int, work, ir->count + 1);
+}
+
+static void decode(Ir *ir)
+{
+    Chunk *chunk = ir->chunk;
+
+    ir->index = ALLOCATE(int, chunk->count + 1);
+    ir->instrs = ALLOCATE(IrInstr, chunk->count);
+    ir->count = 0;
+
+    for (int offset = 0; offset < chunk->count; offset += instruction_length(chunk, offset)) {
+        IrInstr *instr = &ir->instrs[ir->count];
+        instr->op = chunk->code[offset];
+        instr->from = offset;
+        instr->length = instruction_length(chunk, offset);
+        instr->line = chunk->lines[offset];
+        instr->block = -1;
+        instr->target = -1;
+        instr->first = -1;
+        instr->value = -1;
+        instr->load_local = -1;
+        instr->load_temp = -1;
+        instr->store_temp = -1;
+        instr->source = -1;
+        instr->removed = false;
+        instr->hoisted = false;
+        ir->index[offset] = ir->count++;
+    }
+    ir->index[chunk->count] = ir->count;
+
+    for (int i = 0; i < ir->count; i++) {
+        IrInstr *instr = &ir->instrs[i];
+        switch (instr->op) {
+            case OP_JUMP:
+            case OP_JUMP_IF_FALSE:
+                instr->target = ir->index[instr->from + 3 + read_short(ir, instr->from + 1)];
+                break;
+            case OP_LOOP:
+                instr->target = ir->index[instr->from + 5 - read_short(ir, instr->from + 1)];
+                break;
+            case OP_CLOSURE: {
+                ObjFunction *function = AS_FUNCTION(chunk->constants.values[operand(ir, i)]);
+                for (int j = 0; j < function->upvalue_count; j++) {
+                    uint8_t is_local = chunk->code[instr->from + 2 + j * 2];
+                    uint8_t index = chunk->code[instr->from + 3 + j * 2];
+                    if (is_local) ir->captured[index] = true;
+                }
+            } break;
+            default:
+                break;
+        }
+    }
+
+    // A constant is numbered by the first entry in the table with its value,
+    // since the compiler gives every literal its own entry.
+    ValueArray *constants = &chunk->constants;
+    for (int i = 0; i < constants->count && i < UINT8_COUNT; i++) {
+        ir->canonical[i] = i;
+        for (int j = 0; j < i; j++) {
+            if (same_constant(constants->values[i], constants->values[j])) {
+                ir->canonical[i] = j;
+                break;
+            }
+        }
+    }
+}
+
+static void find_blocks(Ir *ir)
+{
+    bool *starts = ALLOCATE(bool, ir->count + 1);
+    for (int i = 0; i <= ir->count; i++) starts[i] = false;
+
+    starts[0] = true;
+    for (int i = 0; i < ir->count; i++) {
+        if (ir->instrs[i].target >= 0) starts[ir->instrs[i].target] = true;
+        if (ends_block(ir->instrs[i].op)) starts[i + 1] = true;
+    }
+
+    ir->block_count = 0;
+    for (int i = 0; i < ir->count; i++) {
+        if (starts[i]) ir->block_count++;
+    }
+
+    ir->blocks = ALLOCATE(IrBlock, ir->block_count);
+    int block = -1;
+    for (int i = 0; i < ir->count; i++) {
+        if (starts[i]) {
+            block++;
+            ir->blocks[block].start = i;
+            memset(&ir->blocks[block].live_in, 0, sizeof(SlotSet));
+            memset(&ir->blocks[block].live_out, 0, sizeof(SlotSet));
+        }
+
+        ir->blocks[block].end = i + 1;
+        ir->instrs[i].block = block;
+    }
+
+    FREE_ARRAY(bool, starts, ir->count + 1);
+}
+
+/*
+ * Every loop is found from its back edges. A for loop with an increment has
+ * two, one from the increment to the condition and one from the body to the
+ * increment, and they cross, so crossing loops are merged into one. Loops
+ * that nest are kept apart.
+*/
+static void find_loops(Ir *ir)
+{
+    ir->loop_count = 0;
+    for (int i = 0; i < ir->count; i++) {
+        if (ir->instrs[i].op == OP_LOOP) ir->loop_count++;
+    }
+
+    ir->loops = ALLOCATE(IrLoop, ir->loop_count);
+    int count = 0;
+    for (int i = 0; i < ir->count; i++) {
+        if (ir->instrs[i].op == OP_LOOP) {
+            ir->loops[count].start = ir->instrs[i].target;
+            ir->loops[count].end = i;
+            count++;
+        }
+    }
+
+    bool merged = true;
+    while (merged) {
+        merged = false;
+        for (int a = 0; a < count && !merged; a++) {
+            for (int b = 0; b < count && !merged; b++) {
+                IrLoop *x = &ir->loops[a];
+                IrLoop *y = &ir->loops[b];
+                if (a == b) continue;
+
+                bool crossing = x->start < y->start && y->start <= x->end && x->end < y->end;
+                if (crossing || (x->start == y->start && a < b)) {
+                    if (y->end > x->end) x->end = y->end;
+                    ir->loops[b] = ir->loops[--count];
+                    merged = true;
+                }
+            }
+        }
+    }
+
+    // Outer loops first, so that an inner loop sees what was already moved
+    // out of it.
+    for (int i = 1; i < count; i++) {
+        IrLoop loop = ir->loops[i];
+        int j = i - 1;
+        while (j >= 0 && ir->loops[j].start > loop.start) {
+            ir->loops[j + 1] = ir->loops[j];
+            j--;
+        }
+        ir->loops[j + 1] = loop;
+    }
+
+    ir->loops = GROW_ARRAY(IrLoop, ir->loops, ir->loop_count, count);
+    ir->loop_count = count;
+}
+
+static bool fits_temp(Ir *ir, int pool_count)
+{
+    return ir->max_height + ir->temp_count + pool_count + 1 <= UINT8_COUNT;
+}
+
+static void remove_range(Ir *ir, int first, int root)
+{
+    for (int i = first; i < root; i++) ir->instrs[i].removed = true;
+    ir->changed = true;
+}
+
+//----------------------------------------------------------------------------
+// Loop-invariant code motion
+
+// Whether the instruction at `i` reads the same global as the one at
+// `candidate`. Returns the read's last instruction, or -1.
+static int same_read(Ir *ir, int i, int candidate)
+{
+    IrInstr *instr = &ir->instrs[i];
+    IrInstr *other = &ir->instrs[candidate];
+    if (instr->removed || instr->load_temp >= 0 || instr->op != other->op) return -1;
+
+    if (instr->op == OP_GET_GLOBAL) {
+        return read_short(ir, instr->from + 1) == read_short(ir, other->from + 1) ? i : -1;
+    }
+
+    return -1;
+}
+
+static void hoist(Ir *ir, IrLoop *loop, int first, int root)
+{
+    if (ir->hoist_capacity < ir->hoist_count + 1) {
+        int old = ir->hoist_capacity;
+        ir->hoist_capacity = GROW_CAPACITY(old);
+        ir->hoists = GROW_ARRAY(Hoist, ir->hoists, old, ir->hoist_capacity);
+    }
+
+    int temp = ir->temp_count++;
+    ir->hoists[ir->hoist_count++] = (Hoist){loop->start, first, root, temp};
+
+    for (int i = first; i <= root; i++) ir->instrs[i].hoisted = true;
+    remove_range(ir, first, root);
+    ir->instrs[root].load_temp = temp;
+
+    for (int i = root + 1; i <= loop->end; i++) {
+        int end = same_read(ir, i, first);
+        if (end < 0) continue;
+
+        remove_range(ir, i, end);
+        ir->instrs[end].load_temp = temp;
+    }
+}
+
+static void hoist_loop(Ir *ir, IrLoop *loop)
+{
+    for (int i = loop->start; i <= loop->end; i++) {
+        if (is_call(ir->instrs[i].op)) return;
+    }
+
+    IrBlock *header = &ir->blocks[ir->instrs[loop->start].block];
+    for (int i = header->start; i < header->end; i++) {
+        IrInstr *instr = &ir->instrs[i];
+        if (instr->removed || instr->load_temp >= 0) continue;
+
+        int root = -1;
+        if (instr->op == OP_GET_GLOBAL) {
+            int slot = read_short(ir, instr->from + 1);
+            bool written = false;
+            for (int w = loop->start; w <= loop->end && !written; w++) {
+                OpCode op = ir->instrs[w].op;
+                if ((op == OP_SET_GLOBAL || op == OP_DEFINE_GLOBAL) &&
+                        read_short(ir, ir->instrs[w].from + 1) == slot) {
+                    written = true;
+                }
+            }
+            if (!written) root = i;
+        }
+
+        if (root >= 0 && fits_temp(ir, 0)) {
+            hoist(ir, loop, i, root);
+            i = root;
+            continue;
+        }
+
+        if (!is_pure(instr->op)) break;
+    }
+}
+
+static void hoist_invariants(Ir *ir)
+{
+    for (int i = 0; i < ir->loop_count; i++) hoist_loop(ir, &ir->loops[i]);
+}
+
+//----------------------------------------------------------------------------
+// Common subexpression elimination
+
+static int new_value(Ir *ir)
+{
+    if (ir->value_capacity < ir->value_count + 1) {
+        int old = ir->value_capacity;
+        ir->value_capacity = GROW_CAPACITY(old);
+        ir->roots = GROW_ARRAY(int, ir->roots, old, ir->value_capacity);
+        ir->holders = GROW_ARRAY(int, ir->holders, old, ir->value_capacity);
+    }
+
+    ir->roots[ir->value_count] = -1;
+    ir->holders[ir->value_count] = -1;
+    return ir->value_count++;
+}
+
+static int number(Ir *ir, int block, OpCode op, int operand, int a, int b)
+{
+    uint32_t hash = 2166136261u;
+    int key[4] = {op, operand, a, b};
+    for (int i = 0; i < 4; i++) {
+        hash ^= (uint32_t)key[i];
+        hash *= 16777619;
+    }
+
+    uint32_t mask = ir->table_capacity - 1;
+    for (uint32_t index = hash & mask;; index = (index + 1) & mask) {
+        Expression *entry = &ir->table[index];
+        if (entry->block != block) {
+            *entry = (Expression){op, operand, a, b, block, new_value(ir)};
+            return entry->value;
+        }
+
+        if (entry->op == op && entry->operand == operand && entry->a == a && entry->b == b) {
+            return entry->value;
+        }
+    }
+}
+
+// How many instructions are left in an expression, or -1 if any of them
+// does more than work out a value, like the assignment in `(a = b) + c`.
+static int expression_length(Ir *ir, int first, int root)
+{
+    int count = 0;
+    for (int i = first; i <= root; i++) {
+        IrInstr *instr = &ir->instrs[i];
+        if (instr->removed) continue;
+
+        bool reads = instr->load_local >= 0 || instr->load_temp >= 0 ||
+            instr->op == OP_GET_GLOBAL;
+        if (!reads && !is_pure(instr->op) && !is_operator(instr->op)) return -1;
+        count++;
+    }
+    return count;
+}
+
+static void number_block(Ir *ir, int block, StackValue *stack, int *slot_values, int *slot_blocks,
+    int *global_epoch, int *upvalue_epoch)
+{
+    IrBlock *b = &ir->blocks[block];
+    int top = 0;
+    int pool = 0;
+
+    for (int i = b->start; i < b->end; i++) {
+        IrInstr *instr = &ir->instrs[i];
+        if (instr->removed) continue;
+
+        if (instr->load_temp >= 0) {
+            instr->first = i;
+            instr->value = number(ir, block, OP_GET_LOCAL, -1 - instr->load_temp, 0, 0);
+            stack[top++] = (StackValue){instr->value, i};
+            continue;
+        }
+
+        int pops, pushes;
+        stack_effect(ir, i, &pops, &pushes);
+
+        StackValue args[2] = {{-1, -1}, {-1, -1}};
+        int first = i;
+        for (int p = pops - 1; p >= 0; p--) {
+            StackValue arg = top > 0 ? stack[--top] : (StackValue){new_value(ir), -1};
+            if (p < 2) args[p] = arg;
+            if (p == 0) first = arg.first;
+        }
+
+        int value = -1;
+        switch (instr->op) {
+            case OP_CONSTANT:
+                value = number(ir, block, OP_CONSTANT, ir->canonical[operand(ir, i)], 0, 0);
+                break;
+            case OP_NIL:
+            case OP_TRUE:
+            case OP_FALSE:
+                value = number(ir, block, instr->op, 0, 0, 0);
+                break;
+            case OP_GET_GLOBAL:
+                value = number(ir, block, OP_GET_GLOBAL, read_short(ir, instr->from + 1),
+                    *global_epoch, 0);
+                break;
+            case OP_GET_UPVALUE:
+                value = number(ir, block, OP_GET_UPVALUE, operand(ir, i), *upvalue_epoch, 0);
+                break;
+            case OP_GET_LOCAL: {
+                int slot = operand(ir, i);
+                if (ir->captured[slot]) {
+                    value = new_value(ir);
+                } else if (slot_blocks[slot] == block) {
+                    value = slot_values[slot];
+                } else {
+                    value = new_value(ir);
+                    slot_values[slot] = value;
+                    slot_blocks[slot] = block;
+                }
+            } break;
+            case OP_SET_LOCAL: {
+                int slot = operand(ir, i);
+                value = args[0].value;
+                if (!ir->captured[slot]) {
+                    slot_values[slot] = value;
+                    slot_blocks[slot] = block;
+                    ir->holders[value] = slot;
+                }
+            } break;
+            case OP_JUMP_IF_FALSE:
+                value = args[0].value;
+                break;
+            case OP_SET_GLOBAL:
+            case OP_DEFINE_GLOBAL:
+                (*global_epoch)++;
+                value = args[0].value;
+                break;
+            case OP_SET_UPVALUE:
+                (*upvalue_epoch)++;
+                value = args[0].value;
+                break;
+            default:
+                if (is_operator(instr->op)) {
+                    value = number(ir, block, instr->op, 0, args[0].value, args[1].value);
+                } else if (pushes > 0) {
+                    value = new_value(ir);
+                }
+                break;
+        }
+
+        if (is_call(instr->op)) {
+            (*global_epoch)++;
+            (*upvalue_epoch)++;
+        }
+
+        if (pushes == 0) {
+            instr->first = -1;
+            instr->value = -1;
+            continue;
+        }
+
+        instr->first = first;
+        instr->value = value;
+        stack[top++] = (StackValue){value, first};
+
+        if (!is_operator(instr->op) || first < 0) continue;
+
+        int length = expression_length(ir, first, i);
+        int holder = ir->holders[value];
+        int root = ir->roots[value];
+        if (length < 0) {
+            continue;
+        } else if (holder >= 0 && slot_blocks[holder] == block && slot_values[holder] == value) {
+            remove_range(ir, first, i);
+            instr->load_local = holder;
+        } else if (root >= 0 && !ir->instrs[root].removed && length >= 3 &&
+                (ir->instrs[root].store_temp >= 0 || fits_temp(ir, pool + 1))) {
+            if (ir->instrs[root].store_temp < 0) {
+                ir->instrs[root].store_temp = ir->temp_count + pool++;
+                if (pool > ir->pool_count) ir->pool_count = pool;
+            }
+
+            remove_range(ir, first, i);
+            instr->load_temp = ir->instrs[root].store_temp;
+            instr->source = root;
+        } else if (root < 0) {
+            ir->roots[value] = i;
+        }
+    }
+}
+
+// How many reads are left of each instruction's temporary.
+static int *temp_reads(Ir *ir)
+{
+    int *reads = ALLOCATE(int, ir->count);
+    for (int i = 0; i < ir->count; i++) reads[i] = 0;
+
+    for (int i = 0; i < ir->count; i++) {
+        IrInstr *instr = &ir->instrs[i];
+        if (!instr->removed && instr->source >= 0) reads[instr->source]++;
+    }
+
+    return reads;
+}
+
+static void eliminate_subexpressions(Ir *ir)
+{
+    int table_capacity = 16;
+    while (table_capacity < ir->count * 2) table_capacity *= 2;
+    ir->table_capacity = table_capacity;
+    ir->table = ALLOCATE(Expression, table_capacity);
+    for (int i = 0; i < table_capacity; i++) ir->table[i].block = -1;
+
+    StackValue *stack = ALLOCATE(StackValue, ir->count + 1);
+    int slot_values[UINT8_COUNT];
+    int slot_blocks[UINT8_COUNT];
+    for (int i = 0; i < UINT8_COUNT; i++) slot_blocks[i] = -1;
+    int global_epoch = 0;
+    int upvalue_epoch = 0;
+
+    for (int block = 0; block < ir->block_count; block++) {
+        number_block(ir, block, stack, slot_values, slot_blocks, &global_epoch, &upvalue_epoch);
+    }
+
+    // A larger expression that was replaced later can take the only reads of
+    // a temporary with it.
+    // The temporaries still in use are then numbered again.
+    int *reads = temp_reads(ir);
+    ir->pool_count = 0;
+    for (int block = 0; block < ir->block_count; block++) {
+        int pool = 0;
+        for (int i = ir->blocks[block].start; i < ir->blocks[block].end; i++) {
+            IrInstr *instr = &ir->instrs[i];
+            if (instr->store_temp < 0) continue;
+
+            instr->store_temp = reads[i] > 0 ? ir->temp_count + pool++ : -1;
+        }
+        if (pool > ir->pool_count) ir->pool_count = pool;
+    }
+
+    for (int i = 0; i < ir->count; i++) {
+        IrInstr *instr = &ir->instrs[i];
+        if (!instr->removed && instr->source >= 0) {
+            instr->load_temp = ir->instrs[instr->source].store_temp;
+        }
+    }
+
+    FREE_ARRAY(int, reads, ir->count);
+    FREE_ARRAY(StackValue, stack, ir->count + 1);
+}
+
+//----------------------------------------------------------------------------
+// Dead store elimination
+
+// The local an instruction reads, or -1.
+static int reads_local(Ir *ir, int i)
+{
+    IrInstr *instr = &ir->instrs[i];
+    if (instr->op == OP_GET_LOCAL && !instr->removed) return operand(ir, i);
+    if (!instr->removed && instr->load_local >= 0) return instr->load_local;
+    return -1;
+}
+
+// The local an instruction writes, or -1.
+static int writes_local(Ir *ir, int i)
+{
+    IrInstr *instr = &ir->instrs[i];
+    if (instr->op == OP_SET_LOCAL && !instr->removed) return operand(ir, i);
+    return -1;
+}
+
+static void add_successor_live(Ir *ir, SlotSet *live, int i)
+{
+    if (i >= ir->count) return;
+
+    SlotSet *in = &ir->blocks[ir->instrs[i].block].live_in;
+    for (int w = 0; w < SLOT_WORDS; w++) live->bits[w] |= in->bits[w];
+}
+
+static void find_live_locals(Ir *ir)
+{
+    bool changed = true;
+    while (changed) {
+        changed = false;
+
+        for (int block = ir->block_count - 1; block >= 0; block--) {
+            IrBlock *b = &ir->blocks[block];
+            IrInstr *last = &ir->instrs[b->end - 1];
+            SlotSet live = {{0}};
+
+            if (last->op != OP_JUMP && last->op != OP_LOOP && last->op != OP_RETURN) {
+                add_successor_live(ir, &live, b->end);
+            }
+            if (last->target >= 0) add_successor_live(ir, &live, last->target);
+            b->live_out = live;
+
+            for (int i = b->end - 1; i >= b->start; i--) {
+                int slot = writes_local(ir, i);
+                if (slot >= 0) set_remove(&live, slot);
+                slot = reads_local(ir, i);
+                if (slot >= 0) set_add(&live, slot);
+            }
+
+            if (memcmp(&live, &b->live_in, sizeof(SlotSet)) != 0) {
+                b->live_in = live;
+                changed = true;
+            }
+        }
+    }
+}
+
+// Whether the value for the SET_LOCAL at `i` can go along with it.
+static bool removable_value(Ir *ir, int i)
+{
+    IrInstr *set = &ir->instrs[i];
+    if (set->first < 0 || i + 1 >= ir->count) return false;
+
+    IrInstr *next = &ir->instrs[i + 1];
+    if (next->op != OP_POP || next->removed || next->block != set->block) return false;
+
+    for (int j = set->first; j < i; j++) {
+        IrInstr *instr = &ir->instrs[j];
+        if (instr->removed) continue;
+        if (instr->hoisted || instr->store_temp >= 0) return false;
+        if (instr->load_local < 0 && instr->load_temp < 0 && !is_pure(instr->op)) return false;
+    }
+
+    return true;
+}
+
+static void eliminate_dead_stores(Ir *ir)
+{
+    find_live_locals(ir);
+
+    for (int block = 0; block < ir->block_count; block++) {
+        IrBlock *b = &ir->blocks[block];
+        SlotSet live = b->live_out;
+
+        for (int i = b->end - 1; i >= b->start; i--) {
+            int slot = writes_local(ir, i);
+            if (slot >= 0) {
+                if (!set_has(&live, slot) && !ir->captured[slot]) {
+                    if (removable_value(ir, i)) {
+                        remove_range(ir, ir->instrs[i].first, i + 1);
+                        ir->instrs[i + 1].removed = true;
+                    } else {
+                        ir->instrs[i].removed = true;
+                        ir->changed = true;
+                    }
+                }
+                set_remove(&live, slot);
+            }
+
+            slot = reads_local(ir, i);
+            if (slot >= 0) set_add(&live, slot);
+        }
+    }
+}
+
+//----------------------------------------------------------------------------
+// Lowering
+
+typedef struct {
+    Chunk out;
+    int temps;
+    int *entries;       // Where each instruction's preheader starts
+    int *starts;        // Where each instruction starts
+} Lowering;
+
+static int move_slot(Ir *ir, Lowering *lowering, int slot)
+{
+    return slot > ir->function->arity ? slot + lowering->temps : slot;
+}
+
+static int temp_slot(Ir *ir, int temp)
+{
+    return ir->function->arity + 1 + temp;
+}
+
+static void emit_local(Lowering *lowering, OpCode op, int slot, int line)
+{
+    write_chunk(&lowering->out, op, line);
+    write_chunk(&lowering->out, slot, line);
+}
+
+static void emit_copy(Ir *ir, Lowering *lowering, int i)
+{
+    IrInstr *instr = &ir->instrs[i];
+    Chunk *out = &lowering->out;
+    int at = out->count;
+
+    for (int b = 0; b < instr->length; b++) {
+        write_chunk(out, ir->chunk->code[instr->from + b], instr->line);
+    }
+
+    switch (instr->op) {
+        case OP_GET_LOCAL:
+        case OP_SET_LOCAL:
+            out->code[at + 1] = move_slot(ir, lowering, out->code[at + 1]);
+            break;
+        case OP_CLOSURE: {
+            ObjFunction *function = AS_FUNCTION(ir->chunk->constants.values[out->code[at + 1]]);
+            for (int j = 0; j < function->upvalue_count; j++) {
+                if (out->code[at + 2 + j * 2]) {
+                    out->code[at + 3 + j * 2] = move_slot(ir, lowering, out->code[at + 3 + j * 2]);
+                }
+            }
+        } break;
+        default:
+            break;
+    }
+}
+
+static bool patch_jumps(Ir *ir, Lowering *lowering)
+{
+    for (int i = 0; i < ir->count; i++) {
+        IrInstr *instr = &ir->instrs[i];
+        if (instr->target < 0 || instr->removed) continue;
+
+        int at = lowering->starts[i];
+        int jump;
+        if (instr->op == OP_LOOP) {
+            jump = at + 5 - lowering->starts[instr->target];
+        } else {
+            jump = lowering->entries[instr->target] - at - 3;
+        }
+
+        if (jump < 0 || jump > UINT16_MAX) return false;
+        lowering->out.code[at + 1] = (jump >> 8) & 0xff;
+        lowering->out.code[at + 2] = jump & 0xff;
+    }
+
+    return true;
+}
+
+static bool lower(Ir *ir)
+{
+    Lowering lowering;
+    init_chunk(&lowering.out);
+    lowering.temps = ir->temp_count + ir->pool_count;
+    lowering.entries = ALLOCATE(int, ir->count + 1);
+    lowering.starts = ALLOCATE(int, ir->count + 1);
+
+    int line = ir->count > 0 ? ir->instrs[0].line : 0;
+    for (int t = 0; t < lowering.temps; t++) write_chunk(&lowering.out, OP_NIL, line);
+
+    int hoist = 0;
+    for (int i = 0; i < ir->count; i++) {
+        IrInstr *instr = &ir->instrs[i];
+
+        lowering.entries[i] = lowering.out.count;
+        for (; hoist < ir->hoist_count && ir->hoists[hoist].header == i; hoist++) {
+            Hoist *h = &ir->hoists[hoist];
+            for (int j = h->first; j <= h->root; j++) emit_copy(ir, &lowering, j);
+            emit_local(&lowering, OP_SET_LOCAL, temp_slot(ir, h->temp), instr->line);
+            write_chunk(&lowering.out, OP_POP, instr->line);
+        }
+
+        lowering.starts[i] = lowering.out.count;
+        if (instr->removed) continue;
+
+        if (instr->load_local >= 0) {
+            emit_local(&lowering, OP_GET_LOCAL, move_slot(ir, &lowering, instr->load_local), instr->line);
+        } else if (instr->load_temp >= 0) {
+            emit_local(&lowering, OP_GET_LOCAL, temp_slot(ir, instr->load_temp), instr->line);
+        } else {
+            emit_copy(ir, &lowering, i);
+        }
+
+        if (instr->store_temp >= 0) {
+            emit_local(&lowering, OP_SET_LOCAL, temp_slot(ir, instr->store_temp), instr->line);
+        }
+    }
+    lowering.entries[ir->count] = lowering.out.count;
+    lowering.starts[ir->count] = lowering.out.count;
+
+    bool ok = patch_jumps(ir, &lowering);
+    if (ok) {
+        Chunk *chunk = ir->chunk;
+        FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
+        FREE_ARRAY(int, chunk->lines, chunk->capacity);
+        chunk->code = lowering.out.code;
+        chunk->lines = lowering.out.lines;
+        chunk->count = lowering.out.count;
+        chunk->capacity = lowering.out.capacity;
+    } else {
+        FREE_ARRAY(uint8_t, lowering.out.code, lowering.out.capacity);
+        FREE_ARRAY(int, lowering.out.lines, lowering.out.capacity);
+    }
+
+    FREE_ARRAY(int, lowering.entries, ir->count + 1);
+    FREE_ARRAY(int, lowering.starts, ir->count + 1);
+    return ok;
+}
+
+//----------------------------------------------------------------------------
+
+void optimize_function(ObjFunction *function)
+{
+    Chunk *chunk = &function->chunk;
+    if (chunk->count == 0) return;
+
+    Ir ir;
+    memset(&ir, 0, sizeof(Ir));
+    ir.function = function;
+    ir.chunk = chunk;
+
+    int code_count = chunk->count;
+    decode(&ir);
+    find_max_height(&ir);
+    find_blocks(&ir);
+    find_loops(&ir);
+
+    hoist_invariants(&ir);
+    eliminate_subexpressions(&ir);
+    eliminate_dead_stores(&ir);
+
+    if (ir.changed) lower(&ir);
+
+    FREE_ARRAY(int, ir.index, code_count + 1);
+    FREE_ARRAY(IrInstr, ir.instrs, code_count);
+    FREE_ARRAY(IrBlock, ir.blocks, ir.block_count);
+    FREE_ARRAY(IrLoop, ir.loops, ir.loop_count);
+    FREE_ARRAY(Hoist, ir.hoists, ir.hoist_capacity);
+    FREE_ARRAY(Expression, ir.table, ir.table_capacity);
+    FREE_ARRAY(int, ir.roots, ir.value_capacity);
+    FREE_ARRAY(int, ir.holders, ir.value_capacity);
+}
@@ -0,0 +1,9 @@
+#ifndef CLOX_OPTIMIZER_H
+#define CLOX_OPTIMIZER_H
+
+#include "common.h"
+#include "object.h"
+
+void optimize_function(ObjFunction *function);
+
+#endif // CLOX_OPTIMIZER_H
@@ -0,0 +1,176 @@
+#include <string.h>
+
+#include "memory.h"
+#include "peephole.h"
+
+/*
+ * Tidies up the control flow the single pass compiler leaves behind, once a
+ * function's bytecode is complete and before anything else looks at it.
+ *
+ * A jump that lands on an OP_JUMP goes straight on to where that one goes,
+ * and an OP_JUMP_IF_FALSE that lands on another one goes straight on to its
+ * target too, since the value it tests is still the one on the stack. Code
+ * that can't be reached from the start of the function, which is mostly
+ * whatever follows a return, is dropped, and so is an OP_JUMP to the
+ * instruction right after it.
+ *
+ * What's left is moved down over the gaps, lines along with it, and every
+ * jump and loop offset is worked out again. Caches and loop sites are looked
+ * up by index, so they stay where they are.
+*/
+
+static int read_short(Chunk *chunk, int offset)
+{
+    return (chunk->code[offset] << 8) | chunk->code[offset + 1];
+}
+
+static void write_short(Chunk *chunk, int offset, int value)
+{
+    chunk->code[offset] = (value >> 8) & 0xff;
+    chunk->code[offset + 1] = value & 0xff;
+}
+
+// Where the jump or loop at `offset` goes, or -1 if it isn't one.
+static int jump_target(Chunk *chunk, int offset)
+{
+    switch (chunk->code[offset]) {
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+            return offset + 3 + read_short(chunk, offset + 1);
+        case OP_LOOP:
+            return offset + 5 - read_short(chunk, offset + 1);
+        default:
+            return -1;
+    }
+}
+
+// Follows a jump on through the jumps it lands on. Only loops go backwards,
+// so this always comes to an end.
+static int thread_jump(Chunk *chunk, OpCode op, int target)
+{
+    while (target < chunk->count) {
+        OpCode next = chunk->code[target];
+        if (next != OP_JUMP && (op != OP_JUMP_IF_FALSE || next != OP_JUMP_IF_FALSE)) break;
+
+        target = jump_target(chunk, target);
+    }
+
+    return target;
+}
+
+static bool falls_through(OpCode op)
+{
+    return op != OP_RETURN && op != OP_JUMP && op != OP_LOOP;
+}
+
+void optimize_chunk(Chunk *chunk)
+{
+    int count = chunk->count;
+    if (count == 0) return;
+
+    // Everything is indexed by the old offset, with one past the end so that
+    // the end of the code can be looked up too. `moved` is where the
+    // instruction at each offset ends up, or for one that is dropped, where
+    // the next one that isn't ends up.
+    int *starts = ALLOCATE(int, count + 1);
+    int *targets = ALLOCATE(int, count + 1);
+    int *moved = ALLOCATE(int, count + 1);
+    bool *live = ALLOCATE(bool, count + 1);
+    int start_count = 0;
+
+    for (int offset = 0; offset < count; offset += instruction_length(chunk, offset)) {
+        starts[start_count++] = offset;
+    }
+    starts[start_count] = count;
+
+    for (int i = 0; i <= count; i++) {
+        targets[i] = -1;
+        live[i] = false;
+    }
+
+    for (int i = 0; i < start_count; i++) {
+        int offset = starts[i];
+        OpCode op = chunk->code[offset];
+        int target = jump_target(chunk, offset);
+
+        // A loop can only go backwards, and going on through a jump at the
+        // top of the loop could take it forwards.
+        if (target >= 0 && op != OP_LOOP) target = thread_jump(chunk, op, target);
+        targets[offset] = target;
+    }
+
+    // Every instruction is pushed at most once, so `moved` can double as the
+    // worklist until it's needed.
+    int *work = moved;
+    int work_count = 0;
+    live[0] = true;
+    work[work_count++] = 0;
+
+    while (work_count > 0) {
+        int offset = work[--work_count];
+        int successors[2];
+        int successor_count = 0;
+
+        if (falls_through(chunk->code[offset])) {
+            successors[successor_count++] = offset + instruction_length(chunk, offset);
+        }
+        if (targets[offset] >= 0) successors[successor_count++] = targets[offset];
+
+        for (int i = 0; i < successor_count; i++) {
+            int successor = successors[i];
+            if (successor < count && !live[successor]) {
+                live[successor] = true;
+                work[work_count++] = successor;
+            }
+        }
+    }
+
+    // Backwards, so that `next` is always where the code after a jump starts
+    // once the jumps after it have gone.
+    int next = count;
+    for (int i = start_count - 1; i >= 0; i--) {
+        int offset = starts[i];
+        if (!live[offset]) continue;
+
+        if (chunk->code[offset] == OP_JUMP && targets[offset] == next) {
+            live[offset] = false;
+        } else {
+            next = offset;
+        }
+    }
+
+    // Instructions only ever move down, and never onto one that hasn't been
+    // moved yet.
+    int new_count = 0;
+    for (int i = 0; i < start_count; i++) {
+        int offset = starts[i];
+        int length = starts[i + 1] - offset;
+        moved[offset] = new_count;
+        if (!live[offset]) continue;
+
+        memmove(chunk->code + new_count, chunk->code + offset, length);
+        memmove(chunk->lines + new_count, chunk->lines + offset, length * sizeof(int));
+        new_count += length;
+    }
+    moved[count] = new_count;
+
+    for (int i = 0; i < start_count; i++) {
+        int offset = starts[i];
+        if (!live[offset] || targets[offset] < 0) continue;
+
+        int at = moved[offset];
+        int target = moved[targets[offset]];
+        if (chunk->code[at] == OP_LOOP) {
+            write_short(chunk, at + 1, at + 5 - target);
+        } else {
+            write_short(chunk, at + 1, target - at - 3);
+        }
+    }
+
+    chunk->count = new_count;
+
+    FREE_ARRAY(int, starts, count + 1);
+    FREE_ARRAY(int, targets, count + 1);
+    FREE_ARRAY(int, moved, count + 1);
+    FREE_ARRAY(bool, live, count + 1);
+}
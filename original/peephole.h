@@ -0,0 +1,9 @@
+#ifndef CLOX_PEEPHOLE_H
+#define CLOX_PEEPHOLE_H
+
+#include "common.h"
+#include "chunk.h"
+
+void optimize_chunk(Chunk *chunk);
+
+#endif // CLOX_PEEPHOLE_H
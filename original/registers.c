@@ -0,0 +1,662 @@
+#include "common.h"
+
+#if REGISTER_VM
+
+#include "memory.h"
+#include "registers.h"
+
+/*
+ * Translates a function's stack bytecode into register code.
+ *
+ * Every stack slot gets the register of the same number, which is where the
+ * bytecode already keeps its locals. The translator walks the bytecode in
+ * order with a model of the stack that records, for each slot, where its
+ * value can be found right now. Pushing a local or a constant emits nothing:
+ * the slot just remembers the local's register or the constant, and the
+ * instruction that uses the value reads it from there. An instruction whose
+ * result is stored straight into a local writes it there instead of into its
+ * slot. So `a = b + c` becomes one ADD from b and c into a, where the stack
+ * bytecode takes four instructions and a POP.
+ *
+ * A value is copied into its own slot before anything could change the
+ * register it was left in: an assignment to that local, or a call, which
+ * could assign to it through an upvalue. Calls also need the callee and its
+ * arguments in consecutive slots, as on the stack. At every jump and jump
+ * target all values are in their own slots, so that the paths that meet
+ * there agree on where everything is.
+*/
+
+typedef enum {
+    IN_SLOT,        // In the slot's own register
+    IN_REGISTER,    // In a local's register, further down
+    IN_CONSTANT,    // A constant that hasn't been loaded yet
+} Location;
+
+typedef struct {
+    Location location;
+    int index;
+} Slot;
+
+// A forward jump, patched once the register code for its target exists.
+typedef struct {
+    int at;
+    int target;
+} Fixup;
+
+typedef struct {
+    Chunk *chunk;
+    RegisterCode *code;
+    Slot slots[REGISTERS_MAX];
+    int depth;
+    int line;
+    int last;           // Where the last instruction emitted starts
+    int result;         // Where its destination register is, or -1
+    bool *targets;      // Which bytecode offsets are jumped to
+    int *depths;        // The stack depth a forward jump arrives with
+    int *offsets;       // Where the register code for each offset starts
+    Fixup *fixups;
+    int fixup_count;
+    int fixup_capacity;
+    bool failed;
+} Translator;
+
+static void emit_byte(Translator *t, uint8_t byte)
+{
+    RegisterCode *code = t->code;
+    if (code->capacity < code->count + 1) {
+        int old = code->capacity;
+        code->capacity = GROW_CAPACITY(old);
+        code->code = GROW_ARRAY(uint8_t, code->code, old, code->capacity);
+        code->lines = GROW_ARRAY(int, code->lines, old, code->capacity);
+    }
+
+    code->code[code->count] = byte;
+    code->lines[code->count] = t->line;
+    code->count++;
+}
+
+static void emit_short(Translator *t, int value)
+{
+    emit_byte(t, (value >> 8) & 0xff);
+    emit_byte(t, value & 0xff);
+}
+
+static void emit_op(Translator *t, RegOpCode op)
+{
+    t->last = t->code->count;
+    t->result = -1;
+    emit_byte(t, op);
+}
+
+// The destination register of the instruction just started. Until the next
+// instruction, an assignment to a local can redirect it.
+static void emit_dest(Translator *t, int reg)
+{
+    t->result = t->code->count;
+    emit_byte(t, (uint8_t)reg);
+}
+
+static void emit_jump(Translator *t, int target)
+{
+    if (t->fixup_capacity < t->fixup_count + 1) {
+        int old = t->fixup_capacity;
+        t->fixup_capacity = GROW_CAPACITY(old);
+        t->fixups = GROW_ARRAY(Fixup, t->fixups, old, t->fixup_capacity);
+    }
+
+    t->fixups[t->fixup_count].at = t->code->count;
+    t->fixups[t->fixup_count].target = target;
+    t->fixup_count++;
+    t->depths[target] = t->depth;
+    emit_short(t, 0xffff);
+}
+
+static void push(Translator *t, Location location, int index)
+{
+    if (t->depth == REGISTERS_MAX) {
+        t->failed = true;
+        return;
+    }
+
+    t->slots[t->depth].location = location;
+    t->slots[t->depth].index = index;
+    t->depth++;
+
+    if (t->depth > t->code->register_count) {
+        t->code->register_count = t->depth;
+    }
+}
+
+// Pushes the result of the next instruction, which it stores in its own slot.
+static int push_result(Translator *t)
+{
+    int slot = t->depth;
+    push(t, IN_SLOT, slot);
+    return slot;
+}
+
+static void materialize(Translator *t, int slot)
+{
+    Slot *s = &t->slots[slot];
+
+    if (s->location == IN_REGISTER) {
+        emit_op(t, REG_MOVE);
+        emit_dest(t, slot);
+        emit_byte(t, s->index);
+    } else if (s->location == IN_CONSTANT) {
+        emit_op(t, REG_CONSTANT);
+        emit_dest(t, slot);
+        emit_byte(t, s->index);
+    }
+
+    s->location = IN_SLOT;
+    s->index = slot;
+}
+
+static void materialize_below(Translator *t, int count)
+{
+    for (int i = 0; i < count; i++) {
+        materialize(t, i);
+    }
+}
+
+// Copies every value below `count` that was left in `reg` into its own slot,
+// before `reg` is assigned.
+static void spill(Translator *t, int reg, int count)
+{
+    for (int i = 0; i < count; i++) {
+        if (t->slots[i].location == IN_REGISTER && t->slots[i].index == reg) {
+            materialize(t, i);
+        }
+    }
+}
+
+// The register an instruction reads the slot's value from.
+static int operand(Translator *t, int slot)
+{
+    Slot *s = &t->slots[slot];
+    if (s->location == IN_CONSTANT) materialize(t, slot);
+
+    return s->location == IN_REGISTER ? s->index : slot;
+}
+
+static int read_short(Translator *t, int offset)
+{
+    return (t->chunk->code[offset] << 8) | t->chunk->code[offset + 1];
+}
+
+// Whether the instruction at `offset` is `op` and can only be reached from
+// the one before it.
+static bool next_is(Translator *t, int offset, OpCode op)
+{
+    return offset < t->chunk->count && !t->targets[offset] &&
+        generic_opcode(t->chunk->code[offset]) == op;
+}
+
+static void find_targets(Translator *t)
+{
+    Chunk *chunk = t->chunk;
+
+    for (int offset = 0; offset < chunk->count; offset += instruction_length(chunk, offset)) {
+        switch (generic_opcode(chunk->code[offset])) {
+            case OP_JUMP:
+            case OP_JUMP_IF_FALSE:
+                t->targets[offset + 3 + read_short(t, offset + 1)] = true;
+                break;
+            case OP_LOOP:
+                t->targets[offset + 5 - read_short(t, offset + 1)] = true;
+                break;
+            default:
+                break;
+        }
+    }
+}
+
+// Everything is put in its own slot before a jump target, so a jump that
+// arrives there finds the values where the code after it expects them.
+static void enter_target(Translator *t, int offset)
+{
+    materialize_below(t, t->depth);
+
+    // Code after an unconditional jump is only reached by jumping to it,
+    // maybe with more on the stack than the code before it left.
+    if (t->depths[offset] != -1) {
+        t->depth = t->depths[offset];
+    }
+
+    for (int i = 0; i < t->depth; i++) {
+        t->slots[i].location = IN_SLOT;
+        t->slots[i].index = i;
+    }
+
+    t->result = -1;
+}
+
+static void set_local(Translator *t, int local)
+{
+    int top = t->depth - 1;
+    Slot *value = &t->slots[top];
+
+    spill(t, local, top);
+    uint8_t *code = t->code->code;
+
+    if (value->location == IN_SLOT && t->result != -1 && code[t->result] == top) {
+        // The value was computed by the instruction just emitted, which can
+        // store it in the local directly.
+        code[t->result] = (uint8_t)local;
+    } else if (value->location == IN_CONSTANT) {
+        emit_op(t, REG_CONSTANT);
+        emit_dest(t, local);
+        emit_byte(t, value->index);
+    } else {
+        int source = operand(t, top);
+        if (source != local) {
+            emit_op(t, REG_MOVE);
+            emit_dest(t, local);
+            emit_byte(t, source);
+        }
+    }
+
+    t->slots[local].location = IN_SLOT;
+    t->slots[local].index = local;
+    value->location = IN_REGISTER;
+    value->index = local;
+}
+
+static void unary(Translator *t, RegOpCode op)
+{
+    int source = operand(t, t->depth - 1);
+    t->depth--;
+
+    int dest = push_result(t);
+    emit_op(t, op);
+    emit_dest(t, dest);
+    emit_byte(t, source);
+}
+
+static void binary(Translator *t, int offset, RegOpCode op)
+{
+    int right = t->depth - 1;
+    int left = right - 1;
+
+    // A comparison that only decides a branch is fused with the jump after
+    // it, so values further down are put in place before it rather than
+    // between the two.
+    if (op == REG_EQUAL || op == REG_GREATER || op == REG_LESS ||
+            op == REG_GREATER_EQUAL || op == REG_LESS_EQUAL) {
+        if (next_is(t, offset + 1, OP_JUMP_IF_FALSE)) materialize_below(t, left);
+    }
+
+    int a = operand(t, left);
+    int b;
+    if (t->slots[right].location == IN_CONSTANT) {
+        b = t->slots[right].index;
+        op += REG_EQUAL_K - REG_EQUAL;
+    } else {
+        b = operand(t, right);
+    }
+
+    t->depth -= 2;
+    int dest = push_result(t);
+    emit_op(t, op);
+    emit_dest(t, dest);
+    emit_byte(t, a);
+    emit_byte(t, b);
+}
+
+static RegOpCode fused_jump(RegOpCode op)
+{
+    switch (op) {
+        case REG_EQUAL:     return REG_EQUAL_JUMP;
+        case REG_GREATER:   return REG_GREATER_JUMP;
+        case REG_LESS:      return REG_LESS_JUMP;
+        case REG_GREATER_EQUAL: return REG_GREATER_EQUAL_JUMP;
+        case REG_LESS_EQUAL: return REG_LESS_EQUAL_JUMP;
+        case REG_EQUAL_K:   return REG_EQUAL_K_JUMP;
+        case REG_GREATER_K: return REG_GREATER_K_JUMP;
+        case REG_LESS_K:    return REG_LESS_K_JUMP;
+        case REG_GREATER_EQUAL_K: return REG_GREATER_EQUAL_K_JUMP;
+        case REG_LESS_EQUAL_K: return REG_LESS_EQUAL_K_JUMP;
+        default:            return REG_JUMP_IF_FALSE;
+    }
+}
+
+static void jump_if_false(Translator *t, int offset)
+{
+    int target = offset + 3 + read_short(t, offset + 1);
+    int top = t->depth - 1;
+
+    // In `and` and `or` the condition is also the value of the expression,
+    // so it has to be in its slot when the jump lands.
+    if (!next_is(t, offset + 3, OP_POP) ||
+            generic_opcode(t->chunk->code[target]) != OP_POP) {
+        materialize_below(t, t->depth);
+        emit_op(t, REG_JUMP_IF_FALSE);
+        emit_byte(t, top);
+        emit_jump(t, target);
+        return;
+    }
+
+    // Otherwise both ways pop it, so it only needs to be tested.
+    materialize_below(t, top);
+
+    uint8_t *code = t->code->code;
+    RegOpCode fused = REG_JUMP_IF_FALSE;
+    if (t->slots[top].location == IN_SLOT && t->result != -1 && code[t->result] == top) {
+        fused = fused_jump(code[t->last]);
+    }
+
+    if (fused != REG_JUMP_IF_FALSE) {
+        uint8_t a = code[t->last + 2];
+        uint8_t b = code[t->last + 3];
+        t->code->count = t->last;
+
+        emit_op(t, fused);
+        emit_byte(t, a);
+        emit_byte(t, b);
+    } else {
+        int condition = operand(t, top);
+        emit_op(t, REG_JUMP_IF_FALSE);
+        emit_byte(t, condition);
+    }
+
+    emit_jump(t, target);
+}
+
+static void call(Translator *t, RegOpCode op, int base, int arg_count)
+{
+    materialize_below(t, t->depth);
+    emit_op(t, op);
+    emit_byte(t, base);
+    emit_byte(t, arg_count);
+
+    t->depth = base;
+    push(t, IN_SLOT, base);
+}
+
+static void translate(Translator *t, int offset)
+{
+    uint8_t *bytecode = &t->chunk->code[offset];
+    OpCode op = generic_opcode(bytecode[0]);
+    int top = t->depth - 1;
+
+    switch (op) {
+        case OP_CONSTANT:
+            push(t, IN_CONSTANT, bytecode[1]);
+            break;
+        case OP_NIL:
+        case OP_TRUE:
+        case OP_FALSE: {
+            int dest = push_result(t);
+            emit_op(t, op == OP_NIL ? REG_NIL : op == OP_TRUE ? REG_TRUE : REG_FALSE);
+            emit_dest(t, dest);
+        } break;
+        case OP_POP:
+            t->depth--;
+            break;
+        case OP_GET_LOCAL: {
+            Slot *local = &t->slots[bytecode[1]];
+            if (local->location == IN_SLOT) {
+                push(t, IN_REGISTER, bytecode[1]);
+            } else {
+                push(t, local->location, local->index);
+            }
+        } break;
+        case OP_SET_LOCAL:
+            set_local(t, bytecode[1]);
+            break;
+        case OP_GET_GLOBAL: {
+            int dest = push_result(t);
+            emit_op(t, REG_GET_GLOBAL);
+            emit_dest(t, dest);
+            emit_short(t, read_short(t, offset + 1));
+        } break;
+        case OP_SET_GLOBAL:
+        case OP_DEFINE_GLOBAL: {
+            int source = operand(t, top);
+            emit_op(t, op == OP_SET_GLOBAL ? REG_SET_GLOBAL : REG_DEFINE_GLOBAL);
+            emit_short(t, read_short(t, offset + 1));
+            emit_byte(t, source);
+            if (op == OP_DEFINE_GLOBAL) t->depth--;
+        } break;
+        case OP_GET_UPVALUE: {
+            int dest = push_result(t);
+            emit_op(t, REG_GET_UPVALUE);
+            emit_dest(t, dest);
+            emit_byte(t, bytecode[1]);
+        } break;
+        case OP_SET_UPVALUE: {
+            int source = operand(t, top);
+            emit_op(t, REG_SET_UPVALUE);
+            emit_byte(t, bytecode[1]);
+            emit_byte(t, source);
+        } break;
+        case OP_CLOSE_UPVALUE:
+            materialize(t, top);
+            emit_op(t, REG_CLOSE_UPVALUE);
+            emit_byte(t, top);
+            t->depth--;
+            break;
+        case OP_GET_PROPERTY: {
+            int object = operand(t, top);
+            t->depth--;
+
+            int dest = push_result(t);
+            emit_op(t, REG_GET_PROPERTY);
+            emit_dest(t, dest);
+            emit_byte(t, object);
+            emit_byte(t, bytecode[1]);
+            emit_short(t, read_short(t, offset + 2));
+        } break;
+        case OP_SET_PROPERTY: {
+            int object = operand(t, top - 1);
+            int value = operand(t, top);
+            Slot result = t->slots[top];
+
+            emit_op(t, REG_SET_PROPERTY);
+            emit_byte(t, object);
+            emit_byte(t, value);
+            emit_byte(t, bytecode[1]);
+            emit_short(t, read_short(t, offset + 2));
+            t->depth -= 2;
+
+            // The assigned value is left where the object was. It is nearly
+            // always popped straight away.
+            if (result.location == IN_REGISTER) {
+                push(t, IN_REGISTER, result.index);
+            } else if (next_is(t, offset + 4, OP_POP)) {
+                push(t, IN_SLOT, top - 1);
+            } else {
+                int dest = push_result(t);
+                emit_op(t, REG_MOVE);
+                emit_dest(t, dest);
+                emit_byte(t, value);
+            }
+        } break;
+        case OP_GET_SUPER: {
+            int receiver = operand(t, top - 1);
+            int superclass = operand(t, top);
+            t->depth -= 2;
+
+            int dest = push_result(t);
+            emit_op(t, REG_GET_SUPER);
+            emit_dest(t, dest);
+            emit_byte(t, receiver);
+            emit_byte(t, superclass);
+            emit_byte(t, bytecode[1]);
+            emit_short(t, read_short(t, offset + 2));
+        } break;
+        case OP_CLASS: {
+            int dest = push_result(t);
+            emit_op(t, REG_CLASS);
+            emit_dest(t, dest);
+            emit_byte(t, bytecode[1]);
+        } break;
+        case OP_INHERIT:
+        case OP_METHOD: {
+            int a = operand(t, top - 1);
+            int b = operand(t, top);
+            emit_op(t, op == OP_INHERIT ? REG_INHERIT : REG_METHOD);
+            emit_byte(t, a);
+            emit_byte(t, b);
+            if (op == OP_METHOD) emit_byte(t, bytecode[1]);
+            t->depth--;
+        } break;
+        case OP_CLOSURE: {
+            ObjFunction *function = AS_FUNCTION(t->chunk->constants.values[bytecode[1]]);
+
+            // Captured locals have to be in their own registers for the
+            // upvalues to point at.
+            for (int i = 0; i < function->upvalue_count; i++) {
+                if (bytecode[2 + i * 2]) materialize(t, bytecode[3 + i * 2]);
+            }
+
+            // Not emit_dest(): the closure is stored before its upvalues are
+            // captured, so it can't go straight into a local.
+            int dest = push_result(t);
+            emit_op(t, REG_CLOSURE);
+            emit_byte(t, dest);
+            emit_byte(t, bytecode[1]);
+            for (int i = 0; i < function->upvalue_count * 2; i++) {
+                emit_byte(t, bytecode[2 + i]);
+            }
+        } break;
+        case OP_JUMP_IF_FALSE:
+            jump_if_false(t, offset);
+            break;
+        case OP_JUMP:
+            materialize_below(t, t->depth);
+            emit_op(t, REG_JUMP);
+            emit_jump(t, offset + 3 + read_short(t, offset + 1));
+            break;
+        case OP_LOOP: {
+            materialize_below(t, t->depth);
+            emit_op(t, REG_LOOP);
+
+            int target = t->offsets[offset + 5 - read_short(t, offset + 1)];
+            int jump = t->code->count + 2 - target;
+            if (jump > UINT16_MAX) t->failed = true;
+            emit_short(t, jump);
+        } break;
+        case OP_CALL:
+            call(t, bytecode[0] == OP_TAIL_CALL ? REG_TAIL_CALL : REG_CALL,
+                t->depth - bytecode[1] - 1, bytecode[1]);
+            break;
+        case OP_INVOKE:
+        case OP_SUPER_INVOKE: {
+            // A super call has the superclass on top of its arguments.
+            int extra = op == OP_SUPER_INVOKE ? 1 : 0;
+            call(t, op == OP_INVOKE ? REG_INVOKE : REG_SUPER_INVOKE,
+                t->depth - bytecode[2] - 1 - extra, bytecode[2]);
+            emit_byte(t, bytecode[1]);
+            emit_short(t, read_short(t, offset + 3));
+        } break;
+        case OP_PRINT:
+        case OP_RETURN: {
+            int source = operand(t, top);
+            emit_op(t, op == OP_PRINT ? REG_PRINT : REG_RETURN);
+            emit_byte(t, source);
+            t->depth--;
+        } break;
+        case OP_NOT:        unary(t, REG_NOT); break;
+        case OP_NEGATE:     unary(t, REG_NEGATE); break;
+        case OP_EQUAL:      binary(t, offset, REG_EQUAL); break;
+        case OP_GREATER:    binary(t, offset, REG_GREATER); break;
+        case OP_LESS:       binary(t, offset, REG_LESS); break;
+        case OP_GREATER_EQUAL: binary(t, offset, REG_GREATER_EQUAL); break;
+        case OP_LESS_EQUAL: binary(t, offset, REG_LESS_EQUAL); break;
+        case OP_ADD:        binary(t, offset, REG_ADD); break;
+        case OP_SUBTRACT:   binary(t, offset, REG_SUBTRACT); break;
+        case OP_MULTIPLY:   binary(t, offset, REG_MULTIPLY); break;
+        case OP_DIVIDE:     binary(t, offset, REG_DIVIDE); break;
+        default:
+            t->failed = true;
+            break;
+    }
+}
+
+/*
+ * Gives the function the register code for its bytecode. Fails if the
+ * function needs more than REGISTERS_MAX registers, or has a jump too long
+ * for its register code.
+*/
+bool compile_registers(ObjFunction *function)
+{
+    Chunk *chunk = &function->chunk;
+    RegisterCode *code = ALLOCATE(RegisterCode, 1);
+    code->capacity = 0;
+    code->count = 0;
+    code->code = NULL;
+    code->lines = NULL;
+    code->register_count = 0;
+    function->registers = code;
+
+    Translator t;
+    t.chunk = chunk;
+    t.code = code;
+    t.depth = 0;
+    t.line = 0;
+    t.last = -1;
+    t.result = -1;
+    t.fixups = NULL;
+    t.fixup_count = 0;
+    t.fixup_capacity = 0;
+    t.failed = false;
+
+    // One past the end too, which is never jumped to, so that a jump's target
+    // can always be looked up.
+    t.targets = ALLOCATE(bool, chunk->count + 1);
+    t.depths = ALLOCATE(int, chunk->count + 1);
+    t.offsets = ALLOCATE(int, chunk->count + 1);
+    for (int i = 0; i <= chunk->count; i++) {
+        t.targets[i] = false;
+        t.depths[i] = -1;
+        t.offsets[i] = -1;
+    }
+
+    find_targets(&t);
+
+    // The callee and the arguments.
+    for (int i = 0; i <= function->arity; i++) {
+        push(&t, IN_SLOT, i);
+    }
+
+    for (int offset = 0; offset < chunk->count && !t.failed;
+            offset += instruction_length(chunk, offset)) {
+        t.line = chunk->lines[offset];
+        if (t.targets[offset]) enter_target(&t, offset);
+
+        t.offsets[offset] = code->count;
+        translate(&t, offset);
+    }
+
+    for (int i = 0; i < t.fixup_count && !t.failed; i++) {
+        int jump = t.offsets[t.fixups[i].target] - t.fixups[i].at - 2;
+        if (jump > UINT16_MAX) {
+            t.failed = true;
+            break;
+        }
+
+        code->code[t.fixups[i].at] = (jump >> 8) & 0xff;
+        code->code[t.fixups[i].at + 1] = jump & 0xff;
+    }
+
+    FREE_ARRAY(bool, t.targets, chunk->count + 1);
+    FREE_ARRAY(int, t.depths, chunk->count + 1);
+    FREE_ARRAY(int, t.offsets, chunk->count + 1);
+    FREE_ARRAY(Fixup, t.fixups, t.fixup_capacity);
+    return !t.failed;
+}
+
+void free_registers(ObjFunction *function)
+{
+    RegisterCode *code = function->registers;
+    if (code == NULL) return;
+
+    FREE_ARRAY(uint8_t, code->code, code->capacity);
+    FREE_ARRAY(int, code->lines, code->capacity);
+    FREE(RegisterCode, code);
+    function->registers = NULL;
+}
+
+#endif // REGISTER_VM
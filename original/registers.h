@@ -0,0 +1,113 @@
+#ifndef CLOX_REGISTERS_H
+#define CLOX_REGISTERS_H
+
+#include "common.h"
+
+#if REGISTER_VM
+
+#include "chunk.h"
+#include "object.h"
+
+/*
+ * The register instruction set. Registers are a frame's slots, so locals keep
+ * the register of their stack slot and a call's callee and arguments sit in
+ * consecutive registers exactly as they would on the stack. Operands are one
+ * byte each, with 16-bit global slots, caches and jump offsets, in the same
+ * byte order as the stack bytecode.
+ *
+ * In the comments, R(x) is a register, K(x) a constant, and a jump's offset
+ * counts from the end of the instruction.
+*/
+typedef enum {
+    REG_MOVE,           // A B              R(A) = R(B)
+    REG_CONSTANT,       // A K              R(A) = K
+    REG_NIL,            // A                R(A) = nil
+    REG_TRUE,           // A                R(A) = true
+    REG_FALSE,          // A                R(A) = false
+    REG_GET_GLOBAL,     // A slot16         R(A) = globals[slot]
+    REG_SET_GLOBAL,     // slot16 B         globals[slot] = R(B)
+    REG_DEFINE_GLOBAL,  // slot16 B         globals[slot] = R(B), defined or not
+    REG_GET_UPVALUE,    // A B              R(A) = upvalues[B]
+    REG_SET_UPVALUE,    // A B              upvalues[A] = R(B)
+    REG_CLOSE_UPVALUE,  // A                close upvalues from R(A) up
+    REG_GET_PROPERTY,   // A B K cache16    R(A) = R(B).K
+    REG_SET_PROPERTY,   // A B K cache16    R(A).K = R(B)
+    REG_GET_SUPER,      // A B C K cache16  R(A) = R(B) bound to super R(C)'s K
+    REG_CLASS,          // A K              R(A) = new class K
+    REG_INHERIT,        // A B              copy R(A)'s methods into R(B)
+    REG_METHOD,         // A B K            R(A).methods[K] = R(B)
+    REG_CLOSURE,        // A K pairs...     R(A) = closure over K
+    REG_JUMP,           // offset16
+    REG_JUMP_IF_FALSE,  // A offset16       jump if R(A) is falsey
+    REG_LOOP,           // offset16         jump back
+    REG_CALL,           // A C              R(A) = R(A)(R(A+1) ... R(A+C))
+    REG_TAIL_CALL,      // A C              as CALL, in this frame's place
+    REG_INVOKE,         // A C K cache16    R(A) = R(A).K(R(A+1) ... R(A+C))
+    REG_SUPER_INVOKE,   // A C K cache16    as INVOKE, on the superclass R(A+C+1)
+    REG_PRINT,          // A
+    REG_RETURN,         // A
+    REG_NOT,            // A B              R(A) = !R(B)
+    REG_NEGATE,         // A B              R(A) = -R(B)
+    REG_EQUAL,          // A B C            R(A) = R(B) == R(C)
+    REG_GREATER,        // A B C            R(A) = R(B) > R(C)
+    REG_LESS,           // A B C            R(A) = R(B) < R(C)
+    REG_GREATER_EQUAL,  // A B C            R(A) = R(B) >= R(C)
+    REG_LESS_EQUAL,     // A B C            R(A) = R(B) <= R(C)
+    REG_ADD,            // A B C            R(A) = R(B) + R(C)
+    REG_SUBTRACT,       // A B C            R(A) = R(B) - R(C)
+    REG_MULTIPLY,       // A B C            R(A) = R(B) * R(C)
+    REG_DIVIDE,         // A B C            R(A) = R(B) / R(C)
+
+    // The same operators with a constant on the right, as in `i < 10`. Each
+    // one is its register form plus (REG_EQUAL_K - REG_EQUAL).
+    REG_EQUAL_K,        // A B K            R(A) = R(B) == K
+    REG_GREATER_K,
+    REG_LESS_K,
+    REG_GREATER_EQUAL_K,
+    REG_LESS_EQUAL_K,
+    REG_ADD_K,
+    REG_SUBTRACT_K,
+    REG_MULTIPLY_K,
+    REG_DIVIDE_K,
+
+    // A comparison whose only use is the condition of an `if`, `while` or
+    // `for`. These jump when the comparison is false and never store it.
+    REG_EQUAL_JUMP,     // B C offset16
+    REG_GREATER_JUMP,
+    REG_LESS_JUMP,
+    REG_GREATER_EQUAL_JUMP,
+    REG_LESS_EQUAL_JUMP,
+    REG_EQUAL_K_JUMP,   // B K offset16
+    REG_GREATER_K_JUMP,
+    REG_LESS_K_JUMP,
+    REG_GREATER_EQUAL_K_JUMP,
+    REG_LESS_EQUAL_K_JUMP,
+} RegOpCode;
+
+#define REG_OPCODE_COUNT (REG_LESS_EQUAL_K_JUMP + 1)
+
+// A frame never uses more registers than this, which leaves the VM a couple
+// of stack slots above the last frame for the helpers it shares with the
+// stack interpreter.
+#define REGISTERS_MAX UINT8_MAX
+
+/*
+ * The register code for one function. It runs the function's Chunk in place
+ * of its bytecode, and shares its constants and inline caches. `lines` holds
+ * the source line of every byte, like the Chunk's. `register_count` is the
+ * size of the function's frame.
+*/
+struct RegisterCode {
+    int capacity;
+    int count;
+    uint8_t *code;
+    int *lines;
+    int register_count;
+};
+
+bool compile_registers(ObjFunction *function);
+void free_registers(ObjFunction *function);
+
+#endif // REGISTER_VM
+
+#endif // CLOX_REGISTERS_H
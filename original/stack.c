@@ -0,0 +1,178 @@
+// sigaction(), sigsetjmp() and MAP_ANONYMOUS are hidden behind feature macros
+// in strict C99.
+#define _DEFAULT_SOURCE
+
+#include <stdlib.h>
+#include "stack.h"
+
+#ifdef _WIN32
+
+#include <windows.h>
+
+static uint8_t *stack_start = NULL;
+static uint8_t *stack_end = NULL;
+static PVOID fault_handler = NULL;
+
+static size_t page_size()
+{
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwPageSize;
+}
+
+// Reserves the stack and its guard page. Pages are committed by on_fault()
+// the first time a script touches them, and the guard page never is.
+static void *map_stack(size_t size, size_t guard)
+{
+    return VirtualAlloc(NULL, size + guard, MEM_RESERVE, PAGE_NOACCESS);
+}
+
+static void unmap_stack(void *stack, size_t size)
+{
+    (void)size;
+    VirtualFree(stack, 0, MEM_RELEASE);
+}
+
+/*
+ * A fault on a reserved page of the stack commits that page and runs the
+ * faulting instruction again. A fault anywhere else, the guard page
+ * included, is left to whatever handles it next.
+*/
+static LONG CALLBACK on_fault(EXCEPTION_POINTERS *exception)
+{
+    EXCEPTION_RECORD *record = exception->ExceptionRecord;
+    if (record->ExceptionCode != EXCEPTION_ACCESS_VIOLATION || record->NumberParameters < 2) {
+        return EXCEPTION_CONTINUE_SEARCH;
+    }
+
+    uint8_t *address = (uint8_t *)record->ExceptionInformation[1];
+    if (address < stack_start || address >= stack_end) return EXCEPTION_CONTINUE_SEARCH;
+
+    size_t page = page_size();
+    uint8_t *start = stack_start + (size_t)(address - stack_start) / page * page;
+    if (VirtualAlloc(start, page, MEM_COMMIT, PAGE_READWRITE) == NULL) {
+        return EXCEPTION_CONTINUE_SEARCH;
+    }
+
+    return EXCEPTION_CONTINUE_EXECUTION;
+}
+
+static void handle_faults(uint8_t *stack, size_t size, size_t guard)
+{
+    (void)guard;
+    stack_start = stack;
+    stack_end = stack + size;
+
+    if (fault_handler == NULL) fault_handler = AddVectoredExceptionHandler(1, on_fault);
+}
+
+void guard_stack(bool enabled)
+{
+    (void)enabled;
+}
+
+#else
+
+#include <signal.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#ifndef MAP_NORESERVE
+#define MAP_NORESERVE 0
+#endif // MAP_NORESERVE
+
+sigjmp_buf stack_overflow;
+
+static uint8_t *guard_start = NULL;
+static uint8_t *guard_end = NULL;
+static volatile sig_atomic_t guarded = false;
+
+// macOS reports a touch of a PROT_NONE page as SIGBUS rather than SIGSEGV.
+static struct sigaction previous_segv;
+static struct sigaction previous_bus;
+
+static size_t page_size()
+{
+    return (size_t)sysconf(_SC_PAGESIZE);
+}
+
+// Reserves the stack and its guard page without committing any memory.
+static void *map_stack(size_t size, size_t guard)
+{
+    uint8_t *stack = mmap(NULL, size + guard, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (stack == MAP_FAILED) return NULL;
+
+    if (mprotect(stack + size, guard, PROT_NONE) != 0) {
+        munmap(stack, size + guard);
+        return NULL;
+    }
+
+    return stack;
+}
+
+static void unmap_stack(void *stack, size_t size)
+{
+    munmap(stack, size);
+}
+
+/*
+ * A fault on the guard page while a script runs is a stack overflow. Any
+ * other fault isn't the stack's, so the handler that was there before is put
+ * back and the faulting instruction runs again to meet it.
+*/
+static void on_fault(int signal, siginfo_t *info, void *context)
+{
+    (void)context;
+    uint8_t *address = info->si_addr;
+
+    if (guarded && address >= guard_start && address < guard_end) {
+        guarded = false;
+        siglongjmp(stack_overflow, 1);
+    }
+
+    sigaction(signal, signal == SIGSEGV ? &previous_segv : &previous_bus, NULL);
+}
+
+static void handle_faults(uint8_t *stack, size_t size, size_t guard)
+{
+    guard_start = stack + size;
+    guard_end = guard_start + guard;
+
+    struct sigaction action;
+    action.sa_sigaction = on_fault;
+    action.sa_flags = SA_SIGINFO;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGSEGV, &action, &previous_segv);
+    sigaction(SIGBUS, &action, &previous_bus);
+}
+
+// Faults on the guard page only jump to stack_overflow while this is enabled.
+void guard_stack(bool enabled)
+{
+    guarded = enabled;
+}
+
+#endif // _WIN32
+
+static size_t stack_size(size_t count)
+{
+    size_t page = page_size();
+    return (sizeof(Value) * count + page - 1) / page * page;
+}
+
+// Reserves room for count Values. Fails like any other allocation would.
+Value *reserve_stack(size_t count)
+{
+    size_t size = stack_size(count);
+    uint8_t *stack = map_stack(size, page_size());
+    if (stack == NULL) exit(1);
+
+    handle_faults(stack, size, page_size());
+    return (Value *)stack;
+}
+
+void release_stack(Value *stack, size_t count)
+{
+    unmap_stack(stack, stack_size(count) + page_size());
+}
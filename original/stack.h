@@ -0,0 +1,39 @@
+#ifndef CLOX_STACK_H
+#define CLOX_STACK_H
+
+#include "common.h"
+#include "value.h"
+
+/*
+ * The value stack is one block of address space, reserved when the VM starts
+ * and followed by a guard page. The OS only backs the pages a script actually
+ * touches with memory, so an idle VM costs next to nothing and a deep one
+ * grows as it goes. Since the block never moves, frames and open upvalues can
+ * keep pointing into it.
+ *
+ * Nothing checks the stack top on a push. A push past the end faults on the
+ * guard page, and while a script is running under STACK_OVERFLOWED() the
+ * fault jumps back there instead of killing the process. On Windows the pages
+ * are only reserved, and a vectored exception handler commits each one when
+ * it is first touched. Nothing catches the guard page there, so an overflow
+ * still crashes, but only on the guard page.
+*/
+
+#ifdef _WIN32
+#define STACK_OVERFLOWED()  false
+#else
+#include <setjmp.h>
+
+extern sigjmp_buf stack_overflow;
+
+// True once a push has run into the guard page. Like sigsetjmp(), it has to be
+// the whole condition of an if, and the function it is in has to outlive the
+// code it guards.
+#define STACK_OVERFLOWED()  (sigsetjmp(stack_overflow, 1) != 0)
+#endif // _WIN32
+
+Value *reserve_stack(size_t count);
+void release_stack(Value *stack, size_t count);
+void guard_stack(bool enabled);
+
+#endif // CLOX_STACK_H
@@ -52,6 +52,16 @@ bool table_get(Table *table, ObjString *key, Value *value)
     return true;
 }
 
+int table_find_slot(Table *table, ObjString *key)
+{
+    if (table->count == 0) return -1;
+
+    Entry *entry = find_entry(table->entries, table->capacity, key);
+    if (entry->key == NULL) return -1;
+
+    return (int)(entry - table->entries);
+}
+
 bool table_delete(Table *table, ObjString *key)
 {
     if (table->count == 0) return false;
@@ -127,15 +137,11 @@ ObjString *table_find_string(Table *table, const char *chars, int len, uint32_t
         if (entry->key == NULL) {
             // Stop if we find an empty non-tombstone entry
             if (IS_NIL(entry->value)) return NULL;
-        } else {
-            bool lens_equal = entry->key->len == len;
-            bool hash_equal = entry->key->hash == hash;
-            bool mem_equal = memcmp(entry->key->chars, chars, len) == 0;
-
-            if (lens_equal && hash_equal && mem_equal) {
-                // We found it
-                return entry->key;
-            }
+        } else if (entry->key->hash == hash && entry->key->len == len &&
+                memcmp(entry->key->chars, chars, len) == 0) {
+            // The hash and length rule out nearly every other string, so the
+            // characters are only compared for the one that matches.
+            return entry->key;
         }
 
         index = (index + 1) & (table->capacity - 1);
@@ -18,6 +18,7 @@ typedef struct {
 void init_table(Table *table);
 void free_table(Table *table);
 bool table_get(Table *table, ObjString *key, Value *value);
+int table_find_slot(Table *table, ObjString *key);
 bool table_delete(Table *table, ObjString *key);
 bool table_set(Table *table, ObjString *key, Value value);
 void table_add_all(Table *from, Table *to);
@@ -0,0 +1,836 @@
+#include "common.h"
+
+#if TRACE_JIT
+
+#include "memory.h"
+#include "trace.h"
+#include "x64.h"
+
+/*
+ * A tracing JIT for hot loops.
+ *
+ * Every OP_LOOP carries a counter. Once a loop has jumped back
+ * TRACE_THRESHOLD times, the interpreter records its next iteration: the
+ * instructions run in the loop's frame, which way each branch went, and
+ * whether the operands of arithmetic were numbers and property accesses hit
+ * a field. Calls are recorded as calls, and the callee runs as usual.
+ *
+ * The recording is compiled into straight-line machine code. Branches become
+ * guards on the recorded direction, arithmetic gets guards that its operands
+ * are numbers, and field accesses get a guard on the receiver's shape. A
+ * guard that fails is a side exit: it writes back the ip of the instruction it
+ * guards and returns to the interpreter, which carries on from there. As the
+ * stack height at every instruction is known, stack slots are addressed off
+ * frame->slots directly and the stack top is only written back when the trace
+ * calls out or exits.
+ *
+ * There are no side traces. If the loop starts taking another path, its trace
+ * stops getting through whole iterations, and it is retired and recorded
+ * again.
+ *
+ * Each trace is compiled twice over. The first copy starts out knowing
+ * nothing about the locals. The second copy runs every later iteration and
+ * starts out with what the first one proved, so a counter that is checked to
+ * be a number once isn't checked again on every iteration.
+*/
+
+#define TRACE_MAX_LENGTH 1000
+#define TRACE_MAX_SLOTS  (UINT8_COUNT * 2)
+
+typedef struct {
+    uint8_t *ip;
+    // For arithmetic, whether the operands were numbers. For OP_JUMP_IF_FALSE,
+    // whether it jumped. For property accesses, whether they hit a field.
+    bool observed;
+} Step;
+
+typedef struct {
+    LoopSite *loop;
+    CallFrame *frame;
+    ObjFunction *function;
+    uint8_t *header;
+    uint8_t *end;
+    int height;
+    Step steps[TRACE_MAX_LENGTH];
+    int count;
+} Recorder;
+
+static Recorder recorder;
+
+typedef enum {
+    TYPE_ANY,
+    TYPE_NUMBER,
+    TYPE_BOOL
+} Type;
+
+typedef struct {
+    Emitter e;
+    Trace *trace;
+    int height;
+    Type types[TRACE_MAX_SLOTS];
+    int sources[TRACE_MAX_SLOTS]; // The local a temporary was copied from
+    bool captured[UINT8_COUNT];
+    int heights[TRACE_MAX_LENGTH];
+    int exits[TRACE_MAX_LENGTH];
+} TraceCompiler;
+
+void trace_start(CallFrame *frame, LoopSite *loop, uint8_t *end)
+{
+    recorder.loop = loop;
+    recorder.frame = frame;
+    recorder.function = frame->closure->function;
+    recorder.header = frame->ip;
+    recorder.end = end;
+    recorder.height = (int)(vm.stack_top - frame->slots);
+    recorder.count = 0;
+    vm.recording = true;
+}
+
+// Counts a failure against the loop and lets it heat up again, unless it has
+// failed too often.
+static void cool_down(LoopSite *loop)
+{
+    loop->aborts++;
+    loop->hotness = loop->aborts < TRACE_MAX_ABORTS ? 0 : TRACE_THRESHOLD + 1;
+}
+
+void trace_abort()
+{
+    vm.recording = false;
+    STAT_INC(traces_aborted);
+    cool_down(recorder.loop);
+}
+
+// Gives up on the recording if it is of this frame, which is about to run
+// somewhere the recorder can't see.
+void trace_stop(CallFrame *frame)
+{
+    if (frame == recorder.frame) trace_abort();
+}
+
+static bool is_field(Value receiver, Value name)
+{
+    if (!IS_INSTANCE(receiver)) return false;
+
+    ObjInstance *instance = AS_INSTANCE(receiver);
+    return instance->shape != NULL && shape_find_slot(instance->shape, AS_STRING(name)) != -1;
+}
+
+static bool is_number_operands(int count)
+{
+    for (int i = 1; i <= count; i++) {
+        if (!IS_NUMBER(vm.stack_top[-i])) return false;
+    }
+
+    return true;
+}
+
+static Trace *compile_trace();
+
+static void complete()
+{
+    vm.recording = false;
+
+    Trace *trace = compile_trace();
+    if (trace == NULL) {
+        trace_abort();
+        return;
+    }
+
+    recorder.loop->trace = trace;
+    STAT_INC(traces_formed);
+}
+
+/*
+ * Called by the interpreter before each instruction while a loop is being
+ * recorded. Instructions in callees are skipped, as the trace calls them
+ * through a helper. The recording ends when the loop is back at its header.
+*/
+void trace_record(CallFrame *frame)
+{
+    if (frame > recorder.frame) return;
+    if (frame < recorder.frame || frame->closure->function != recorder.function) {
+        trace_abort();
+        return;
+    }
+
+    uint8_t *ip = frame->ip;
+
+    // A quickened instruction whose guard failed is run again in its generic
+    // form, and it has already been recorded.
+    if (recorder.count > 0 && recorder.steps[recorder.count - 1].ip == ip) return;
+
+    if (ip == recorder.header && recorder.count > 0) {
+        complete();
+        return;
+    }
+
+    // Leaving the loop, or going round an inner loop, can't be made into a
+    // single path.
+    if (ip > recorder.end || recorder.count == TRACE_MAX_LENGTH) {
+        trace_abort();
+        return;
+    }
+
+    for (int i = 0; i < recorder.count; i++) {
+        if (recorder.steps[i].ip == ip) {
+            trace_abort();
+            return;
+        }
+    }
+
+    Step *step = &recorder.steps[recorder.count++];
+    step->ip = ip;
+    step->observed = false;
+
+    Value *constants = frame->closure->function->chunk.constants.values;
+
+    switch (generic_opcode(*ip)) {
+        case OP_CLASS:
+        case OP_INHERIT:
+        case OP_METHOD:
+        case OP_DEFINE_GLOBAL:
+        case OP_RETURN:
+            trace_abort();
+            break;
+        case OP_JUMP_IF_FALSE: {
+            Value value = vm.stack_top[-1];
+            step->observed = IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
+        } break;
+        case OP_NEGATE:
+            step->observed = is_number_operands(1);
+            break;
+        case OP_GREATER:
+        case OP_LESS:
+        case OP_GREATER_EQUAL:
+        case OP_LESS_EQUAL:
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+            step->observed = is_number_operands(2);
+            break;
+        case OP_GET_PROPERTY:
+            step->observed = is_field(vm.stack_top[-1], constants[ip[1]]);
+            break;
+        case OP_SET_PROPERTY:
+            step->observed = is_field(vm.stack_top[-2], constants[ip[1]]);
+            break;
+        default:
+            break;
+    }
+}
+
+static int32_t slot_offset(int slot)
+{
+    return slot * VALUE_SIZE;
+}
+
+// Writes the stack top back to TOP, where the helpers and the epilogue
+// expect it.
+static void sync_top(TraceCompiler *c)
+{
+    mov_reg(&c->e, TOP, SLOTS);
+    add_imm(&c->e, TOP, slot_offset(c->height));
+}
+
+// Exits the trace through the stub for a step when the rel32 at `at` jumps.
+static void side_exit(TraceCompiler *c, int at, int step)
+{
+    add_fixup(&c->e, at, step);
+}
+
+static void push_type(TraceCompiler *c, Type type)
+{
+    c->types[c->height] = type;
+    c->sources[c->height] = -1;
+    c->height++;
+}
+
+// Forgets what is known about locals that a callee or an upvalue may have
+// changed behind the trace's back.
+static void forget_captured(TraceCompiler *c)
+{
+    for (int i = 0; i < c->height; i++) {
+        if (i < UINT8_COUNT && c->captured[i]) c->types[i] = TYPE_ANY;
+        c->sources[i] = -1;
+    }
+}
+
+static void call_trace_helper(TraceCompiler *c, uint64_t helper, bool can_fail)
+{
+    sync_top(c);
+    call_helper(&c->e, helper);
+    if (can_fail) check_status(&c->e);
+}
+
+static void guard_number(TraceCompiler *c, int slot, int step)
+{
+    if (c->types[slot] == TYPE_NUMBER) return;
+
+    load(&c->e, RAX, SLOTS, slot_offset(slot));
+    side_exit(c, jump_if_not_number(&c->e, RAX), step);
+
+    c->types[slot] = TYPE_NUMBER;
+    if (c->sources[slot] != -1) c->types[c->sources[slot]] = TYPE_NUMBER;
+}
+
+// Leaves the instance in the slot in rax, or exits unless it has the shape.
+static void guard_shape(TraceCompiler *c, int slot, ObjShape *shape, int step)
+{
+    Emitter *e = &c->e;
+
+    load(e, RAX, SLOTS, slot_offset(slot));
+    mov_imm(e, RCX, SIGN_BIT | QNAN);
+    mov_reg(e, RDX, RAX);
+    alu_reg(e, AND_RR, RDX, RCX);
+    alu_reg(e, CMP_RR, RDX, RCX);
+    side_exit(c, jump_if(e, CC_NE), step);
+
+    mov_imm(e, RCX, ~(SIGN_BIT | QNAN));
+    alu_reg(e, AND_RR, RAX, RCX);
+    cmp_int_imm(e, RAX, offsetof(Obj, type), OBJ_INSTANCE);
+    side_exit(c, jump_if(e, CC_NE), step);
+
+    load(e, RCX, RAX, offsetof(ObjInstance, shape));
+    mov_imm(e, RDX, (uint64_t)(uintptr_t)shape);
+    alu_reg(e, CMP_RR, RCX, RDX);
+    side_exit(c, jump_if(e, CC_NE), step);
+
+    Trace *trace = c->trace;
+    if (trace->shape_capacity < trace->shape_count + 1) {
+        int old = trace->shape_capacity;
+        trace->shape_capacity = GROW_CAPACITY(old);
+        trace->shapes = GROW_ARRAY(ObjShape *, trace->shapes, old, trace->shape_capacity);
+    }
+
+    trace->shapes[trace->shape_count++] = shape;
+}
+
+// Exits unless the value in the slot is as truthy as it was when recorded.
+static void guard_branch(TraceCompiler *c, int slot, bool taken, int step)
+{
+    Emitter *e = &c->e;
+    Type type = c->types[slot];
+
+    // Numbers are always truthy.
+    if (type == TYPE_NUMBER) {
+        if (taken) side_exit(c, jump(e), step);
+        return;
+    }
+
+    load(e, RAX, SLOTS, slot_offset(slot));
+
+    if (type == TYPE_BOOL) {
+        mov_imm(e, RCX, FALSE_VAL);
+        alu_reg(e, CMP_RR, RAX, RCX);
+        side_exit(c, jump_if(e, taken ? CC_NE : CC_E), step);
+        return;
+    }
+
+    int if_nil, if_false;
+    jump_if_falsey(e, &if_nil, &if_false);
+    if (taken) {
+        side_exit(c, jump(e), step);
+        patch_here(e, if_nil);
+        patch_here(e, if_false);
+    } else {
+        side_exit(c, if_nil, step);
+        side_exit(c, if_false, step);
+    }
+}
+
+static bool compile_step(TraceCompiler *c, int index)
+{
+    Emitter *e = &c->e;
+    Step *step = &recorder.steps[index];
+    Chunk *chunk = &recorder.function->chunk;
+    uint8_t *ip = step->ip;
+    uint8_t *next = ip + instruction_length(chunk, (int)(ip - chunk->code));
+    int top = c->height - 1;
+
+#define BYTE(n)         (ip[n])
+#define SHORT(n)        ((uint16_t)((ip[n] << 8) | ip[(n) + 1]))
+#define CONSTANT(n)     (chunk->constants.values[ip[n]])
+#define CACHE(n)        (&chunk->caches[SHORT(n)])
+#define POINTER(p)      ((uint64_t)(uintptr_t)(p))
+
+    if (c->height + 2 > TRACE_MAX_SLOTS) return false;
+    c->heights[index] = c->height;
+
+    OpCode op = generic_opcode(*ip);
+    switch (op) {
+        case OP_CONSTANT:
+        case OP_NIL:
+        case OP_TRUE:
+        case OP_FALSE: {
+            Value value = *ip == OP_CONSTANT ? CONSTANT(1)
+                        : *ip == OP_NIL ? NIL_VAL : BOOL_VAL(*ip == OP_TRUE);
+            mov_imm(e, RAX, value);
+            store(e, SLOTS, slot_offset(c->height), RAX);
+            push_type(c, IS_NUMBER(value) ? TYPE_NUMBER : IS_BOOL(value) ? TYPE_BOOL : TYPE_ANY);
+        } break;
+        case OP_POP:
+            c->height--;
+            break;
+        case OP_GET_LOCAL:
+            copy_value(e, SLOTS, slot_offset(c->height), SLOTS, slot_offset(BYTE(1)));
+            push_type(c, c->types[BYTE(1)]);
+            c->sources[top + 1] = BYTE(1);
+            break;
+        case OP_SET_LOCAL:
+            copy_value(e, SLOTS, slot_offset(BYTE(1)), SLOTS, slot_offset(top));
+            c->types[BYTE(1)] = c->types[top];
+            for (int i = 0; i < c->height; i++) {
+                if (c->sources[i] == BYTE(1)) c->sources[i] = -1;
+            }
+            break;
+        case OP_GET_UPVALUE:
+        case OP_SET_UPVALUE:
+            load(e, RAX, FRAME, offsetof(CallFrame, closure));
+            load(e, RAX, RAX, offsetof(ObjClosure, upvalues));
+            load(e, RAX, RAX, BYTE(1) * (int)sizeof(ObjUpvalue *));
+            load(e, RAX, RAX, offsetof(ObjUpvalue, location));
+
+            if (*ip == OP_GET_UPVALUE) {
+                copy_value(e, SLOTS, slot_offset(c->height), RAX, 0);
+                push_type(c, TYPE_ANY);
+            } else {
+                copy_value(e, RAX, 0, SLOTS, slot_offset(top));
+                forget_captured(c);
+            }
+            break;
+        case OP_GET_GLOBAL:
+        case OP_SET_GLOBAL:
+            // The global was defined when it was recorded, and globals are
+            // never undefined again, so there is nothing to check.
+            global_address(e, SHORT(1));
+            if (*ip == OP_GET_GLOBAL) {
+                copy_value(e, SLOTS, slot_offset(c->height), RAX, 0);
+                push_type(c, TYPE_ANY);
+            } else {
+                copy_value(e, RAX, 0, SLOTS, slot_offset(top));
+            }
+            break;
+        case OP_JUMP_IF_FALSE:
+            guard_branch(c, top, step->observed, index);
+            break;
+        case OP_JUMP:
+        case OP_LOOP:
+            // The trace follows the recorded path, so jumps disappear.
+            break;
+        case OP_NOT: {
+            int if_nil, if_false;
+            load(e, RAX, SLOTS, slot_offset(top));
+            jump_if_falsey(e, &if_nil, &if_false);
+            mov_imm(e, RAX, FALSE_VAL);
+            int done = jump(e);
+            patch_here(e, if_nil);
+            patch_here(e, if_false);
+            mov_imm(e, RAX, TRUE_VAL);
+            patch_here(e, done);
+            store(e, SLOTS, slot_offset(top), RAX);
+            c->types[top] = TYPE_BOOL;
+            c->sources[top] = -1;
+        } break;
+        case OP_EQUAL: {
+            if (c->types[top - 1] == TYPE_NUMBER || c->types[top] == TYPE_NUMBER) {
+                // Compared as doubles, as in values_equal(). Anything that
+                // isn't a number is a NaN as a double, so it never matches.
+                if (c->types[top - 1] == TYPE_NUMBER) {
+                    load(e, RAX, SLOTS, slot_offset(top - 1));
+                    load(e, RCX, SLOTS, slot_offset(top));
+                } else {
+                    load(e, RAX, SLOTS, slot_offset(top));
+                    load(e, RCX, SLOTS, slot_offset(top - 1));
+                }
+                number_op(e, OP_EQUAL);
+                store(e, SLOTS, slot_offset(top - 1), RAX);
+            } else if (c->types[top - 1] != TYPE_ANY || c->types[top] != TYPE_ANY) {
+                // A boolean is only equal to the same boolean.
+                load(e, RCX, SLOTS, slot_offset(top - 1));
+                load(e, RDX, SLOTS, slot_offset(top));
+                alu_reg(e, CMP_RR, RCX, RDX);
+                set_condition(e, CC_E);
+                mov_imm(e, RCX, FALSE_VAL);
+                alu_reg(e, ADD_RR, RAX, RCX);
+                store(e, SLOTS, slot_offset(top - 1), RAX);
+            } else {
+                // A number is compared as a double. Otherwise two objects
+                // with different bits can still be equal strings if one is a
+                // rope, which values_equal() sorts out.
+                load(e, RAX, SLOTS, slot_offset(top - 1));
+                load(e, RCX, SLOTS, slot_offset(top));
+                int not_number = jump_if_not_number(e, RAX);
+                number_op(e, OP_EQUAL);
+                int number = jump(e);
+
+                patch_here(e, not_number);
+                alu_reg(e, CMP_RR, RAX, RCX);
+                int same = jump_if(e, CC_E);
+                int not_objects = jump_unless_objects(e, RAX, RCX);
+                sync_ip(e, next);
+                mov_imm(e, RDI, OP_EQUAL);
+                call_trace_helper(c, HELPER(jit_operator), true);
+                int done = jump(e);
+
+                patch_here(e, not_objects);
+                mov_imm(e, RAX, FALSE_VAL);
+                int result = jump(e);
+                patch_here(e, same);
+                mov_imm(e, RAX, TRUE_VAL);
+                patch_here(e, result);
+                patch_here(e, number);
+                store(e, SLOTS, slot_offset(top - 1), RAX);
+                patch_here(e, done);
+            }
+
+            c->height--;
+            c->types[top - 1] = TYPE_BOOL;
+            c->sources[top - 1] = -1;
+        } break;
+        case OP_NEGATE:
+            // Negating anything else is an error, which ends the recording.
+            if (!step->observed) return false;
+
+            guard_number(c, top, index);
+            load(e, RAX, SLOTS, slot_offset(top));
+            mov_imm(e, RCX, SIGN_BIT);
+            alu_reg(e, XOR_RR, RAX, RCX);
+            store(e, SLOTS, slot_offset(top), RAX);
+            c->sources[top] = -1;
+            break;
+        case OP_GREATER:
+        case OP_LESS:
+        case OP_GREATER_EQUAL:
+        case OP_LESS_EQUAL:
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE: {
+            bool compare = op == OP_GREATER || op == OP_LESS ||
+                op == OP_GREATER_EQUAL || op == OP_LESS_EQUAL;
+
+            if (step->observed) {
+                guard_number(c, top - 1, index);
+                guard_number(c, top, index);
+                load(e, RAX, SLOTS, slot_offset(top - 1));
+                load(e, RCX, SLOTS, slot_offset(top));
+                number_op(e, op);
+                store(e, SLOTS, slot_offset(top - 1), RAX);
+                c->types[top - 1] = compare ? TYPE_BOOL : TYPE_NUMBER;
+            } else {
+                // Strings being concatenated, most likely.
+                sync_ip(e, next);
+                mov_imm(e, RDI, op);
+                call_trace_helper(c, HELPER(jit_operator), true);
+                c->types[top - 1] = compare ? TYPE_BOOL : TYPE_ANY;
+            }
+
+            c->height--;
+            c->sources[top - 1] = -1;
+        } break;
+        case OP_GET_PROPERTY: {
+            InlineCache *cache = CACHE(2);
+            if (step->observed && cache->shape != NULL) {
+                guard_shape(c, top, cache->shape, index);
+                load(e, RAX, RAX, offsetof(ObjInstance, slots));
+                copy_value(e, SLOTS, slot_offset(top), RAX, slot_offset(cache->slot));
+            } else {
+                sync_ip(e, next);
+                mov_imm(e, RDI, POINTER(AS_STRING(CONSTANT(1))));
+                mov_imm(e, RSI, POINTER(cache));
+                call_trace_helper(c, HELPER(jit_get_property), true);
+            }
+
+            c->types[top] = TYPE_ANY;
+            c->sources[top] = -1;
+        } break;
+        case OP_SET_PROPERTY: {
+            InlineCache *cache = CACHE(2);
+            if (step->observed && cache->shape != NULL && cache->transition == NULL) {
+                guard_shape(c, top - 1, cache->shape, index);
+                load(e, RAX, RAX, offsetof(ObjInstance, slots));
+                copy_value(e, RAX, slot_offset(cache->slot), SLOTS, slot_offset(top));
+                copy_value(e, SLOTS, slot_offset(top - 1), SLOTS, slot_offset(top));
+                c->types[top - 1] = c->types[top];
+            } else {
+                sync_ip(e, next);
+                mov_imm(e, RDI, POINTER(AS_STRING(CONSTANT(1))));
+                mov_imm(e, RSI, POINTER(cache));
+                call_trace_helper(c, HELPER(jit_set_property), true);
+                c->types[top - 1] = TYPE_ANY;
+            }
+
+            c->height--;
+            c->sources[top - 1] = -1;
+        } break;
+        case OP_GET_SUPER:
+            sync_ip(e, next);
+            mov_imm(e, RDI, POINTER(AS_STRING(CONSTANT(1))));
+            mov_imm(e, RSI, POINTER(CACHE(2)));
+            call_trace_helper(c, HELPER(jit_get_super), true);
+            c->height--;
+            c->types[top - 1] = TYPE_ANY;
+            c->sources[top - 1] = -1;
+            break;
+        case OP_CALL:
+            sync_ip(e, next);
+            mov_imm(e, RDI, BYTE(1));
+            call_trace_helper(c, HELPER(trace_call), true);
+            c->height -= BYTE(1);
+            c->types[c->height - 1] = TYPE_ANY;
+            forget_captured(c);
+            break;
+        case OP_INVOKE:
+        case OP_SUPER_INVOKE:
+            sync_ip(e, next);
+            mov_imm(e, RDI, POINTER(AS_STRING(CONSTANT(1))));
+            mov_imm(e, RSI, BYTE(2));
+            mov_imm(e, RDX, POINTER(CACHE(3)));
+            call_trace_helper(c, *ip == OP_INVOKE ? HELPER(trace_invoke) : HELPER(trace_super_invoke), true);
+            c->height -= BYTE(2) + (*ip == OP_SUPER_INVOKE ? 1 : 0);
+            c->types[c->height - 1] = TYPE_ANY;
+            forget_captured(c);
+            break;
+        case OP_CLOSURE:
+            sync_ip(e, next);
+            mov_reg(e, RDI, FRAME);
+            mov_imm(e, RSI, POINTER(AS_FUNCTION(CONSTANT(1))));
+            mov_imm(e, RDX, POINTER(ip + 2));
+            call_trace_helper(c, HELPER(jit_closure), false);
+            push_type(c, TYPE_ANY);
+            break;
+        case OP_CLOSE_UPVALUE:
+            call_trace_helper(c, HELPER(jit_close_upvalue), false);
+            c->height--;
+            break;
+        case OP_PRINT:
+            call_trace_helper(c, HELPER(jit_print), false);
+            c->height--;
+            break;
+        default:
+            // Never recorded.
+            return false;
+    }
+
+#undef BYTE
+#undef SHORT
+#undef CONSTANT
+#undef CACHE
+#undef POINTER
+
+    return c->height >= 0;
+}
+
+static void forget_all(TraceCompiler *c, int height)
+{
+    for (int i = 0; i < height; i++) {
+        c->types[i] = TYPE_ANY;
+        c->sources[i] = -1;
+    }
+}
+
+// Compiles one copy of the recorded path, starting at the loop header.
+static bool compile_iteration(TraceCompiler *c)
+{
+    c->height = recorder.height;
+    for (int i = 0; i < recorder.count; i++) {
+        if (!compile_step(c, i)) return false;
+    }
+
+    return c->height == recorder.height;
+}
+
+// Whether everything known at the start of the loop still holds at its end.
+static bool types_hold(Type *before, Type *after, int height)
+{
+    for (int i = 0; i < height; i++) {
+        if (before[i] != TYPE_ANY && before[i] != after[i]) return false;
+    }
+
+    return true;
+}
+
+static void compile_exits(TraceCompiler *c)
+{
+    Emitter *e = &c->e;
+
+    for (int i = 0; i < recorder.count; i++) c->exits[i] = -1;
+
+    for (int i = 0; i < e->fixup_count; i++) {
+        int step = e->fixups[i].target;
+        if (c->exits[step] == -1) {
+            c->exits[step] = e->count;
+            c->height = c->heights[step];
+            sync_top(c);
+            sync_ip(e, recorder.steps[step].ip);
+#if VM_STATS
+            mov_imm(e, RDX, (uint64_t)(uintptr_t)&vm.stats.side_exits);
+            emit_rex(e, true, 0, RDX);
+            emit_byte(e, 0xff);
+            emit_modrm_mem(e, 0, RDX, 0); // inc qword [rdx]
+#endif // VM_STATS
+            mov_eax_imm(e, JIT_EXIT);
+            jump_to(e, jump(e), e->epilogue);
+        }
+
+        jump_to(e, e->fixups[i].at, c->exits[step]);
+    }
+}
+
+static void back_edge(TraceCompiler *c, int target)
+{
+    Emitter *e = &c->e;
+    mov_imm(e, RAX, (uint64_t)(uintptr_t)&c->trace->iterations);
+    emit_rex(e, true, 0, RAX);
+    emit_byte(e, 0xff);
+    emit_modrm_mem(e, 0, RAX, 0); // inc qword [rax]
+    jump_to(e, jump(e), target);
+}
+
+static void free_trace(Trace *trace)
+{
+    if (trace->code != NULL) free_code(trace->code, trace->size);
+    FREE_ARRAY(ObjShape *, trace->shapes, trace->shape_capacity);
+    FREE(Trace, trace);
+}
+
+static Trace *compile_trace()
+{
+    TraceCompiler *c = ALLOCATE(TraceCompiler, 1);
+    Emitter *e = &c->e;
+    init_emitter(e);
+
+    Trace *trace = ALLOCATE(Trace, 1);
+    trace->code = NULL;
+    trace->size = 0;
+    trace->shapes = NULL;
+    trace->shape_count = 0;
+    trace->shape_capacity = 0;
+    trace->entries = 0;
+    trace->iterations = 0;
+    trace->next = NULL;
+    c->trace = trace;
+
+    memset(c->captured, 0, sizeof(c->captured));
+    Chunk *chunk = &recorder.function->chunk;
+    for (int offset = 0; offset < chunk->count; offset += instruction_length(chunk, offset)) {
+        if (chunk->code[offset] != OP_CLOSURE) continue;
+
+        int length = instruction_length(chunk, offset);
+        for (int i = 2; i < length; i += 2) {
+            if (chunk->code[offset + i]) c->captured[chunk->code[offset + i + 1]] = true;
+        }
+    }
+
+    epilogue(e);
+    trace->entry = e->count;
+
+    int height = recorder.height;
+    forget_all(c, height);
+    bool ok = compile_iteration(c);
+
+    Type first[TRACE_MAX_SLOTS];
+    memcpy(first, c->types, sizeof(Type) * height);
+
+    bool known = false;
+    for (int i = 0; i < height; i++) {
+        if (first[i] != TYPE_ANY) known = true;
+    }
+
+    if (ok && known) {
+        int loop = e->count;
+        forget_all(c, height);
+        memcpy(c->types, first, sizeof(Type) * height);
+        ok = compile_iteration(c);
+
+        // If a later iteration may not live up to what the first one proved,
+        // it goes round the first copy again instead.
+        int target = types_hold(first, c->types, height) ? loop : trace->entry;
+        back_edge(c, target);
+    } else {
+        back_edge(c, trace->entry);
+    }
+
+    if (ok) compile_exits(c);
+
+    FREE_ARRAY(Fixup, e->fixups, e->fixup_capacity);
+
+    if (ok) {
+        trace->size = (size_t)e->count;
+        trace->code = install_code(e);
+        ok = trace->code != NULL;
+    } else {
+        FREE_ARRAY(uint8_t, e->code, e->capacity);
+    }
+
+    FREE(TraceCompiler, c);
+
+    if (!ok) {
+        free_trace(trace);
+        return NULL;
+    }
+
+    return trace;
+}
+
+// Runs the loop's trace from its header.
+JitStatus trace_enter(CallFrame *frame, LoopSite *loop)
+{
+    Trace *trace = loop->trace;
+    JitStatus status = enter_code(frame, trace->code + trace->entry);
+
+    if (++trace->entries == TRACE_WINDOW) {
+        if (trace->iterations < TRACE_WINDOW) {
+            STAT_INC(traces_retired);
+            loop->trace = NULL;
+            trace->next = loop->retired;
+            loop->retired = trace;
+            cool_down(loop);
+        }
+
+        trace->entries = 0;
+        trace->iterations = 0;
+    }
+
+    return status;
+}
+
+static void mark_traces(Trace *trace)
+{
+    for (; trace != NULL; trace = trace->next) {
+        for (int i = 0; i < trace->shape_count; i++) {
+            mark_object((Obj *)trace->shapes[i]);
+        }
+    }
+}
+
+void trace_mark(Chunk *chunk)
+{
+    for (int i = 0; i < chunk->loop_count; i++) {
+        mark_traces(chunk->loops[i].trace);
+        mark_traces(chunk->loops[i].retired);
+    }
+}
+
+static void free_traces(Trace *trace)
+{
+    while (trace != NULL) {
+        Trace *next = trace->next;
+        free_trace(trace);
+        trace = next;
+    }
+}
+
+void trace_free(Chunk *chunk)
+{
+    for (int i = 0; i < chunk->loop_count; i++) {
+        free_traces(chunk->loops[i].trace);
+        free_traces(chunk->loops[i].retired);
+        chunk->loops[i].trace = NULL;
+        chunk->loops[i].retired = NULL;
+    }
+}
+
+#endif // TRACE_JIT
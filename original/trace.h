@@ -0,0 +1,58 @@
+#ifndef CLOX_TRACE_H
+#define CLOX_TRACE_H
+
+#include "common.h"
+
+#if TRACE_JIT
+
+#include "chunk.h"
+#include "jit.h"
+#include "object.h"
+#include "vm.h"
+
+// How many recordings of a loop are given up on before it is left to the
+// interpreter for good.
+#define TRACE_MAX_ABORTS 3
+
+// A trace that doesn't get through this many iterations in this many entries
+// is retired, and its loop is recorded again.
+#define TRACE_WINDOW 64
+
+/*
+ * The machine code for one iteration of a hot loop, specialised to the path
+ * that was recorded. Guards check that each iteration takes the same path on
+ * the same types and shapes, and leave the trace for the interpreter when it
+ * doesn't. `shapes` holds the shapes the guards compare against, so that the
+ * GC keeps them alive.
+ *
+ * A retired trace may still be running further up the C stack, so it is kept
+ * on its loop's `retired` list until the function is freed.
+*/
+struct Trace {
+    uint8_t *code;
+    size_t size;
+    int entry;
+    ObjShape **shapes;
+    int shape_count;
+    int shape_capacity;
+    int entries;
+    uint64_t iterations;
+    Trace *next;
+};
+
+void trace_start(CallFrame *frame, LoopSite *loop, uint8_t *end);
+void trace_record(CallFrame *frame);
+void trace_abort();
+void trace_stop(CallFrame *frame);
+JitStatus trace_enter(CallFrame *frame, LoopSite *loop);
+void trace_mark(Chunk *chunk);
+void trace_free(Chunk *chunk);
+
+// Helpers for the calls a trace makes, implemented in vm.c.
+JitStatus trace_call(int arg_count);
+JitStatus trace_invoke(ObjString *name, int arg_count, InlineCache *cache);
+JitStatus trace_super_invoke(ObjString *name, int arg_count, InlineCache *cache);
+
+#endif // TRACE_JIT
+
+#endif // CLOX_TRACE_H
@@ -7,18 +7,24 @@
 bool values_equal(Value a, Value b)
 {
 #ifdef NAN_BOXING
-    return a == b;
+    // NaN is not equal to itself, and 0 is equal to -0, so numbers have to be
+    // compared as doubles.
+    if (IS_NUMBER(a) && IS_NUMBER(b)) return AS_NUMBER(a) == AS_NUMBER(b);
+    if (a == b) return true;
+    return IS_STRING(a) && IS_STRING(b) && strings_equal(AS_STRING(a), AS_STRING(b));
 #else
     if (a.type != b.type) return false;
     switch (a.type) {
         case VL_BOOL:
             return AS_BOOL(a) == AS_BOOL(b);
         case VL_NIL:
+        case VL_UNDEFINED:
             return true;
         case VL_NUMBER:
             return AS_NUMBER(a) == AS_NUMBER(b);
         case VL_OBJ:
-            return AS_OBJ(a) == AS_OBJ(b);
+            if (AS_OBJ(a) == AS_OBJ(b)) return true;
+            return IS_STRING(a) && IS_STRING(b) && strings_equal(AS_STRING(a), AS_STRING(b));
         default:
             return false; // Unreachable
     }
@@ -76,6 +82,9 @@ void print_value(Value value)
         case VL_OBJ:
             print_object(value);
             break;
+        case VL_UNDEFINED:
+            printf("undefined");
+            break;
     }
 #endif
 }
@@ -4,6 +4,8 @@
 #include <string.h>
 
 typedef struct Obj Obj;
+typedef struct ObjClass ObjClass;
+typedef struct ObjShape ObjShape;
 typedef struct ObjString ObjString;
 
 #ifdef NAN_BOXING
@@ -11,9 +13,10 @@ typedef struct ObjString ObjString;
 #define SIGN_BIT    ((uint64_t)0x8000000000000000)
 #define QNAN        ((uint64_t)0x7ffc000000000000)
 
-#define TAG_NIL     1 // 01
-#define TAG_FALSE   2 // 10
-#define TAG_TRUE    3 // 11
+#define TAG_NIL         1 // 001
+#define TAG_FALSE       2 // 010
+#define TAG_TRUE        3 // 011
+#define TAG_UNDEFINED   4 // 100
 
 typedef uint64_t Value;
 
@@ -21,6 +24,7 @@ typedef uint64_t Value;
 #define IS_NIL(value)       ((value) == NIL_VAL)
 #define IS_NUMBER(value)    (((value) & QNAN) != QNAN)
 #define IS_OBJ(value)       (((value) & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT))
+#define IS_UNDEFINED(value) ((value) == UNDEFINED_VAL)
 
 #define AS_BOOL(value)      ((value) == TRUE_VAL)
 #define AS_NUMBER(value)    value_to_num(value)
@@ -30,6 +34,7 @@ typedef uint64_t Value;
 #define FALSE_VAL           ((Value)(uint64_t)(QNAN | TAG_FALSE))
 #define TRUE_VAL            ((Value)(uint64_t)(QNAN | TAG_TRUE))
 #define NIL_VAL             ((Value)(uint64_t)(QNAN | TAG_NIL))
+#define UNDEFINED_VAL       ((Value)(uint64_t)(QNAN | TAG_UNDEFINED))
 #define NUMBER_VAL(num)     num_to_value(num)
 #define OBJ_VAL(obj)        (Value)(SIGN_BIT | QNAN | (uint64_t)(uintptr_t)(obj))
 
@@ -53,7 +58,8 @@ typedef enum {
     VL_BOOL,
     VL_NIL,
     VL_NUMBER,
-    VL_OBJ
+    VL_OBJ,
+    VL_UNDEFINED
 } ValueType;
 
 typedef struct {
@@ -70,6 +76,7 @@ typedef struct {
 #define IS_NIL(value)       ((value).type == VL_NIL)
 #define IS_NUMBER(value)    ((value).type == VL_NUMBER)
 #define IS_OBJ(value)       ((value).type == VL_OBJ)
+#define IS_UNDEFINED(value) ((value).type == VL_UNDEFINED)
 
 // The underlying C value converted back from a Lox Value
 #define AS_BOOL(value)      ((value).as.boolean)
@@ -82,6 +89,10 @@ typedef struct {
 #define NUMBER_VAL(value)   ((Value){ VL_NUMBER, { .number = value } })
 #define OBJ_VAL(object)     ((Value){ VL_OBJ, { .obj = (Obj *)object } })
 
+// Marks a global slot the compiler has handed out but nothing has defined yet.
+// It never escapes into user code.
+#define UNDEFINED_VAL       ((Value){ VL_UNDEFINED, { .number = 0 } })
+
 #endif // NAN_BOXING
 
 static inline bool value_is_bool(Value value)
@@ -1,21 +1,31 @@
+// sigsetjmp(), used by STACK_OVERFLOWED(), is hidden behind feature macros in
+// strict C99.
+#define _DEFAULT_SOURCE
+
 #include <stdarg.h>
 #include <stdio.h>
 #include <string.h>
 #include <time.h>
+#include "aot.h"
 #include "compiler.h"
+#include "jit.h"
 #include "memory.h"
 #include "object.h"
+#include "registers.h"
+#include "stack.h"
+#include "trace.h"
 #include "vm.h"
 
-#ifdef DEBUG_TRACE_EXECUTION
-#include "include/debug.h"
-#endif // DEBUG_TRACE_EXECUTION
+#if defined(DEBUG_TRACE_EXECUTION) || OPCODE_PROFILE
+#include "debug.h"
+#endif // DEBUG_TRACE_EXECUTION || OPCODE_PROFILE
 
 VM vm;
 
-static Value clock_native(int arg_count, Value *args)
+static bool clock_native(int arg_count, Value *args, Value *result)
 {
-    return NUMBER_VAL((double)clock() / CLOCKS_PER_SEC);
+    *result = NUMBER_VAL((double)clock() / CLOCKS_PER_SEC);
+    return true;
 }
 
 static void reset_stack()
@@ -34,12 +44,24 @@ static void runtime_error(const char *fmt, ...)
     va_end(args);
     fputs("\n", stderr);
 
+#if TRACE_JIT
+    if (vm.recording) trace_abort();
+#endif // TRACE_JIT
+
     for (int i = vm.frame_count - 1; i >= 0; i--) {
         CallFrame *frame = &vm.frames[i];
         ObjFunction *function = frame->closure->function;
-        size_t instruction = frame->ip - function->chunk.code - 1;
-
-        fprintf(stderr, "[line %d] in ", function->chunk.lines[instruction]);
+#if REGISTER_VM
+        uint8_t *code = function->registers->code;
+        int *lines = function->registers->lines;
+#else
+        uint8_t *code = function->chunk.code;
+        int *lines = function->chunk.lines;
+#endif // REGISTER_VM
+        // Native code only writes back the ip before it calls into the VM, so
+        // a frame that overflowed the stack may not have moved off its start.
+        size_t instruction = frame->ip > code ? frame->ip - code - 1 : 0;
+        fprintf(stderr, "[line %d] in ", lines[instruction]);
         if (function->name == NULL) {
             fprintf(stderr, "script\n");
         } else {
@@ -50,17 +72,110 @@ static void runtime_error(const char *fmt, ...)
     reset_stack();
 }
 
+static bool string_builder_native(int arg_count, Value *args, Value *result)
+{
+    (void)args;
+
+    if (arg_count != 0) {
+        runtime_error("Expected 0 arguments but got %d instead", arg_count);
+        return false;
+    }
+
+    *result = OBJ_VAL(new_string_builder());
+    return true;
+}
+
+// append(builder, ...) adds each of the values after the builder to it, and
+// returns the builder so that calls can be chained.
+static bool append_native(int arg_count, Value *args, Value *result)
+{
+    if (arg_count == 0 || !IS_STRING_BUILDER(args[0])) {
+        runtime_error("Can only append to a string builder");
+        return false;
+    }
+
+    ObjStringBuilder *builder = AS_STRING_BUILDER(args[0]);
+    for (int i = 1; i < arg_count; i++) {
+        builder_append_value(builder, args[i]);
+    }
+
+    *result = args[0];
+    return true;
+}
+
+static bool build_native(int arg_count, Value *args, Value *result)
+{
+    if (arg_count != 1) {
+        runtime_error("Expected 1 argument but got %d instead", arg_count);
+        return false;
+    }
+    if (!IS_STRING_BUILDER(args[0])) {
+        runtime_error("Can only build a string builder");
+        return false;
+    }
+
+    *result = OBJ_VAL(builder_to_string(AS_STRING_BUILDER(args[0])));
+    return true;
+}
+
+static bool join_native(int arg_count, Value *args, Value *result)
+{
+    // Nothing else ever sees this builder, so it can live on the C stack, and
+    // its buffer can go as soon as the string is made.
+    ObjStringBuilder builder;
+    builder.chars = NULL;
+    builder.len = 0;
+    builder.capacity = 0;
+    builder.built = NULL;
+
+    for (int i = 0; i < arg_count; i++) {
+        builder_append_value(&builder, args[i]);
+    }
+
+    *result = OBJ_VAL(builder_to_string(&builder));
+    FREE_ARRAY(char, builder.chars, builder.capacity);
+    return true;
+}
+
+// substring(string, start, end) is the characters from `start` up to but not
+// including `end`. It points into `string` rather than copying them.
+static bool substring_native(int arg_count, Value *args, Value *result)
+{
+    if (arg_count != 3) {
+        runtime_error("Expected 3 arguments but got %d instead", arg_count);
+        return false;
+    }
+    if (!IS_STRING(args[0]) || !IS_NUMBER(args[1]) || !IS_NUMBER(args[2])) {
+        runtime_error("Expected a string and two numbers");
+        return false;
+    }
+
+    ObjString *string = flatten_string(AS_STRING(args[0]));
+    double start = AS_NUMBER(args[1]);
+    double end = AS_NUMBER(args[2]);
+    if (!(start >= 0 && start <= end && end <= string->len) ||
+        start != (int)start || end != (int)end) {
+        runtime_error("Substring out of bounds");
+        return false;
+    }
+
+    *result = OBJ_VAL(new_view(string, (int)start, (int)(end - start)));
+    return true;
+}
+
 static void define_native(const char *name, NativeFn function)
 {
     push(OBJ_VAL(copy_string(name, (int)strlen(name))));
     push(OBJ_VAL(new_native(AS_STRING(vm.stack[0]), function)));
-    table_set(&vm.globals, AS_STRING(vm.stack[0]), vm.stack[1]);
+    int slot = global_slot(AS_STRING(vm.stack[0]));
+    vm.globals.values[slot] = vm.stack[1];
     pop();
     pop();
 }
 
 void init_vm()
 {
+    vm.stack = reserve_stack(STACK_MAX);
     reset_stack();
     vm.objects = NULL;
     vm.bytes_allocated = 0;
@@ -70,21 +185,178 @@ void init_vm()
     vm.gray_count = 0;
     vm.gray_stack = NULL;
 
-    init_table(&vm.globals);
+    init_table(&vm.global_slots);
+    init_value_array(&vm.globals);
+    init_table(&vm.selectors);
+    vm.selector_count = 0;
     init_table(&vm.strings);
 
     vm.init_string = NULL;
     vm.init_string = copy_string("init", 4);
+    vm.init_selector = method_selector(vm.init_string);
+
+#if TRACE_JIT
+    vm.recording = false;
+#endif // TRACE_JIT
 
     define_native("clock", clock_native);
+    define_native("StringBuilder", string_builder_native);
+    define_native("append", append_native);
+    define_native("build", build_native);
+    define_native("join", join_native);
+    define_native("substring", substring_native);
+
+#if VM_STATS
+    memset(&vm.stats, 0, sizeof(VMStats));
+#endif // VM_STATS
+}
+
+#if VM_STATS
+static void print_stats()
+{
+    fprintf(stderr, "[STATS] instructions: %llu\n",
+        (unsigned long long)vm.stats.instructions);
+    fprintf(stderr, "[STATS] property cache: %llu hits, %llu misses\n",
+        (unsigned long long)vm.stats.property_hits,
+        (unsigned long long)vm.stats.property_misses);
+    fprintf(stderr, "[STATS] method cache: %llu hits, %llu misses, %llu megamorphic\n",
+        (unsigned long long)vm.stats.method_hits,
+        (unsigned long long)vm.stats.method_misses,
+        (unsigned long long)vm.stats.method_megamorphic);
+    fprintf(stderr, "[STATS] accessors inlined: %llu\n",
+        (unsigned long long)vm.stats.accessors_inlined);
+    fprintf(stderr, "[STATS] objects allocated: %llu\n",
+        (unsigned long long)vm.stats.objects_allocated);
+#if TRACE_JIT
+    fprintf(stderr, "[STATS] traces: %llu formed, %llu aborted, %llu retired, %llu side exits\n",
+        (unsigned long long)vm.stats.traces_formed,
+        (unsigned long long)vm.stats.traces_aborted,
+        (unsigned long long)vm.stats.traces_retired,
+        (unsigned long long)vm.stats.side_exits);
+#endif // TRACE_JIT
 }
+#endif // VM_STATS
+
+#if OPCODE_PROFILE
+/*
+ * How often each opcode, and each sequence of two and three opcodes, ran.
+ * The compiler leaves out superinstructions in this build and quickened
+ * opcodes count as their generic forms, so the counts describe plain
+ * bytecode. Sequences run on across calls and returns.
+*/
+static uint64_t opcode_counts[OPCODE_COUNT];
+static uint64_t pair_counts[OPCODE_COUNT][OPCODE_COUNT];
+static uint64_t triple_counts[OPCODE_COUNT][OPCODE_COUNT][OPCODE_COUNT];
+static int last_opcodes[2] = { -1, -1 };
+
+static void profile_opcode(uint8_t instruction)
+{
+    OpCode op = generic_opcode(instruction);
+    int first = last_opcodes[0];
+    int second = last_opcodes[1];
+
+    opcode_counts[op]++;
+    if (second != -1) pair_counts[second][op]++;
+    if (first != -1) triple_counts[first][second][op]++;
+
+    last_opcodes[0] = second;
+    last_opcodes[1] = op;
+}
+
+// One line per sequence that ran, in a form that is easy to add up across
+// several scripts with sort and awk.
+static void print_profile()
+{
+    for (int a = 0; a < OPCODE_COUNT; a++) {
+        if (opcode_counts[a] == 0) continue;
+        fprintf(stderr, "[PROFILE] %llu %s\n",
+            (unsigned long long)opcode_counts[a], opcode_name(a));
+
+        for (int b = 0; b < OPCODE_COUNT; b++) {
+            if (pair_counts[a][b] == 0) continue;
+            fprintf(stderr, "[PROFILE] %llu %s %s\n",
+                (unsigned long long)pair_counts[a][b], opcode_name(a), opcode_name(b));
+
+            for (int c = 0; c < OPCODE_COUNT; c++) {
+                if (triple_counts[a][b][c] == 0) continue;
+                fprintf(stderr, "[PROFILE] %llu %s %s %s\n",
+                    (unsigned long long)triple_counts[a][b][c],
+                    opcode_name(a), opcode_name(b), opcode_name(c));
+            }
+        }
+    }
+}
+#endif // OPCODE_PROFILE
 
 void free_vm()
 {
-    free_table(&vm.globals);
+#if VM_STATS
+    print_stats();
+#endif // VM_STATS
+#if OPCODE_PROFILE
+    print_profile();
+#endif // OPCODE_PROFILE
+
+    free_table(&vm.global_slots);
+    free_table(&vm.selectors);
+    free_value_array(&vm.globals);
     free_table(&vm.strings);
     vm.init_string = NULL;
     free_objects();
+    release_stack(vm.stack, STACK_MAX);
+}
+
+/*
+ * Globals live in a flat array. The compiler asks for a name's slot when it
+ * compiles a reference to it, so the same name always maps to the same slot,
+ * even across REPL lines. Slots hold UNDEFINED_VAL until the global is
+ * defined.
+*/
+int global_slot(ObjString *name)
+{
+    Value slot;
+    if (table_get(&vm.global_slots, name, &slot)) {
+        return (int)AS_NUMBER(slot);
+    }
+
+    push(OBJ_VAL(name));
+    write_value_array(&vm.globals, UNDEFINED_VAL);
+    table_set(&vm.global_slots, name, NUMBER_VAL(vm.globals.count - 1));
+    pop();
+
+    return vm.globals.count - 1;
+}
+
+// Only needed for error messages and disassembly, so a linear scan is fine.
+ObjString *global_name(int slot)
+{
+    for (int i = 0; i < vm.global_slots.capacity; i++) {
+        Entry *entry = &vm.global_slots.entries[i];
+        if (entry->key != NULL && (int)AS_NUMBER(entry->value) == slot) {
+            return entry->key;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Every method name gets a selector, the index of its method in a class's
+ * vtable, when a method by that name is first defined. A name that is only
+ * ever used for fields never gets one, so it doesn't make vtables any longer.
+*/
+int method_selector(ObjString *name)
+{
+    Value selector;
+    if (table_get(&vm.selectors, name, &selector)) {
+        return (int)AS_NUMBER(selector);
+    }
+
+    push(OBJ_VAL(name));
+    table_set(&vm.selectors, name, NUMBER_VAL(vm.selector_count));
+    pop();
+
+    return vm.selector_count++;
 }
 
 void push(Value value)
@@ -104,7 +376,18 @@ static Value peek(int distance)
     return vm.stack_top[-1 - distance];
 }
 
-static bool call(ObjClosure *closure, int arg_count)
+#if JIT
+// Compiles a function once it has been called, or has looped, often enough.
+// A function that fails to compile is not tried again.
+static inline void warm_up(ObjFunction *function)
+{
+    if (function->jit == NULL && function->hotness++ == JIT_THRESHOLD) {
+        jit_compile(function);
+    }
+}
+#endif // JIT
+
+static inline bool call(ObjClosure *closure, int arg_count)
 {
     if (arg_count != closure->function->arity) {
         runtime_error("Expected %d arguments but got %d instead", closure->function->arity, arg_count);
@@ -118,8 +401,25 @@ static bool call(ObjClosure *closure, int arg_count)
 
     CallFrame *frame = &vm.frames[vm.frame_count++];
     frame->closure = closure;
-    frame->ip = closure->function->chunk.code;
     frame->slots = vm.stack_top - arg_count - 1;
+
+#if REGISTER_VM
+    // The registers past the arguments may hold anything the stack held
+    // before, which the GC may already have freed.
+    RegisterCode *registers = closure->function->registers;
+    frame->ip = registers->code;
+    frame->top = frame->slots + registers->register_count;
+    for (Value *slot = vm.stack_top; slot < frame->top; slot++) {
+        *slot = NIL_VAL;
+    }
+#else
+    frame->ip = closure->function->chunk.code;
+#endif // REGISTER_VM
+
+#if JIT
+    warm_up(closure->function);
+#endif // JIT
+
     return true;
 }
 
@@ -138,7 +438,7 @@ static bool call_value(Value callee, int arg_count)
                 vm.stack_top[-arg_count - 1] = OBJ_VAL(new_instance(klass));
 
                 Value initializer;
-                if (table_get(&klass->methods, vm.init_string, &initializer)) {
+                if (class_method(klass, vm.init_selector, &initializer)) {
                     return call(AS_CLOSURE(initializer), arg_count);
                 } else if (arg_count != 0) {
                     runtime_error("Expected 0 arguments but got %d instead", arg_count);
@@ -151,7 +451,9 @@ static bool call_value(Value callee, int arg_count)
                 return call(AS_CLOSURE(callee), arg_count);
             case OBJ_NATIVE: {
                 NativeFn native = AS_NATIVE(callee);
-                Value result = native(arg_count, vm.stack_top - arg_count);
+                Value result;
+                if (!native(arg_count, vm.stack_top - arg_count, &result)) return false;
+
                 vm.stack_top -= arg_count + 1;
                 push(result);
                 return true;
@@ -165,18 +467,127 @@ static bool call_value(Value callee, int arg_count)
     return false;
 }
 
-static bool invoke_from_class(ObjClass *klass, ObjString *name, int arg_count)
+static CacheEntry *cache_lookup(InlineCache *cache, Obj *key)
 {
-    Value method;
-    if (!table_get(&klass->methods, name, &method)) {
+    for (int i = 0; i < cache->count; i++) {
+        if (cache->entries[i].key == key) {
+            STAT_INC(method_hits);
+            return &cache->entries[i];
+        }
+    }
+
+    return NULL;
+}
+
+// Whether invoking `method` on an instance with the shape `key` can skip the
+// call, and if so where the field it touches lives.
+static bool find_accessor_slot(Obj *key, Value method, int *slot)
+{
+    ObjFunction *function = AS_CLOSURE(method)->function;
+    *slot = -1;
+
+    if (key->type != OBJ_SHAPE) return false;
+
+    switch (function->accessor) {
+        case ACCESSOR_NONE:
+            return false;
+        case ACCESSOR_CONSTANT:
+            return true;
+        default:
+            *slot = shape_find_slot((ObjShape *)key, function->field);
+            return *slot >= 0;
+    }
+}
+
+static bool find_method(ObjClass *klass, Obj *key, ObjString *name, InlineCache *cache, Value *method)
+{
+    CacheEntry *entry = cache_lookup(cache, key);
+    if (entry != NULL) {
+        *method = entry->method;
+        return true;
+    }
+
+    // A name with no selector yet isn't the name of any method so far, so the
+    // site keeps asking until one is defined.
+    Value selector;
+    if (cache->selector < 0 && table_get(&vm.selectors, name, &selector)) {
+        cache->selector = (int)AS_NUMBER(selector);
+    }
+
+    if (cache->selector < 0 || !class_method(klass, cache->selector, method)) {
         runtime_error("Undefined property '%s'", name->chars);
         return false;
     }
 
+    // Once every entry is taken the site is megamorphic: the entries stay as
+    // they are and any other receiver goes through the method table each time.
+    if (cache->count < INLINE_CACHE_SIZE) {
+        STAT_INC(method_misses);
+        entry = &cache->entries[cache->count++];
+        entry->key = key;
+        entry->method = *method;
+        entry->inlined = find_accessor_slot(key, *method, &entry->slot);
+    } else {
+        STAT_INC(method_megamorphic);
+    }
+
+    return true;
+}
+
+// The cache key for a method looked up on an instance. Since a shape is only
+// cached once it is known not to hold a field by that name, a hit on a shape
+// also proves the method isn't shadowed.
+static inline Obj *receiver_key(ObjInstance *instance)
+{
+    return instance->shape != NULL ? (Obj *)instance->shape : (Obj *)instance->klass;
+}
+
+static bool invoke_from_class(ObjClass *klass, Obj *key, ObjString *name, int arg_count, InlineCache *cache)
+{
+    Value method;
+    if (!find_method(klass, key, name, cache, &method)) {
+        return false;
+    }
+
     return call(AS_CLOSURE(method), arg_count);
 }
 
-static bool invoke(ObjString *name, int arg_count)
+/*
+ * Runs an accessor the way its body would, straight on the caller's stack:
+ * the receiver and arguments are replaced by the result and no frame is
+ * pushed. A call with the wrong number of arguments still goes through
+ * call() so that it fails the same way.
+*/
+static bool run_accessor(ObjInstance *instance, CacheEntry *entry, int arg_count)
+{
+    ObjClosure *closure = AS_CLOSURE(entry->method);
+    ObjFunction *function = closure->function;
+    if (arg_count != function->arity) return call(closure, arg_count);
+
+    Value result;
+    switch (function->accessor) {
+        case ACCESSOR_GETTER:
+            result = instance->slots[entry->slot];
+            break;
+        case ACCESSOR_SETTER:
+            instance->slots[entry->slot] = peek(0);
+            result = NIL_VAL;
+            break;
+        case ACCESSOR_SETTER_RESULT:
+            result = instance->slots[entry->slot] = peek(0);
+            break;
+        default:
+            result = function->constant;
+            break;
+    }
+
+    STAT_INC(accessors_inlined);
+    vm.stack_top -= arg_count + 1;
+    push(result);
+    return true;
+}
+
+static bool invoke(ObjString *name, int arg_count, InlineCache *cache)
 {
     Value receiver = peek(arg_count);
 
@@ -188,19 +599,26 @@ static bool invoke(ObjString *name, int arg_count)
     ObjInstance *instance = AS_INSTANCE(receiver);
     Value value;
 
-    if (table_get(&instance->fields, name, &value)) {
+    if (instance->shape != NULL) {
+        CacheEntry *entry = cache_lookup(cache, (Obj *)instance->shape);
+        if (entry != NULL) {
+            if (entry->inlined) return run_accessor(instance, entry, arg_count);
+            return call(AS_CLOSURE(entry->method), arg_count);
+        }
+    }
+
+    if (instance_get_field(instance, name, &value)) {
         vm.stack_top[-arg_count - 1] = value;
         return call_value(value, arg_count);
     }
 
-    return invoke_from_class(instance->klass, name, arg_count);
+    return invoke_from_class(instance->klass, receiver_key(instance), name, arg_count, cache);
 }
 
-static bool bind_method(ObjClass *klass, ObjString *name)
+static bool bind_method(ObjClass *klass, Obj *key, ObjString *name, InlineCache *cache)
 {
     Value method;
-    if (!table_get(&klass->methods, name, &method)) {
-        runtime_error("Undefined property '%s'", name->chars);
+    if (!find_method(klass, key, name, cache, &method)) {
         return false;
     }
 
@@ -246,11 +664,32 @@ static void close_upvalues(Value *last)
     }
 }
 
+/*
+ * Calls the callee below the top arg_count values in frame's place, for a
+ * call whose result frame returns. The callee and its arguments are moved
+ * down over frame's slots. Returns false without doing anything unless the
+ * callee is a closure that takes that many arguments. Anything else is
+ * called as usual, so that its errors are reported from frame.
+*/
+static bool tail_call(CallFrame *frame, int arg_count)
+{
+    Value callee = peek(arg_count);
+    if (!IS_CLOSURE(callee) || AS_CLOSURE(callee)->function->arity != arg_count) {
+        return false;
+    }
+
+    close_upvalues(frame->slots);
+    memmove(frame->slots, vm.stack_top - arg_count - 1, sizeof(Value) * (arg_count + 1));
+    vm.stack_top = frame->slots + arg_count + 1;
+    vm.frame_count--;
+    return call(AS_CLOSURE(callee), arg_count);
+}
+
 static void define_method(ObjString *name)
 {
     Value method = peek(0);
     ObjClass *klass = AS_CLASS(peek(1));
-    table_set(&klass->methods, name, method);
+    class_set_method(klass, method_selector(name), method);
     pop();
 }
 
@@ -259,25 +698,848 @@ static bool is_falsey(Value value)
     return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
 }
 
+static inline bool get_property(ObjString *name, InlineCache *cache)
+{
+    if (!IS_INSTANCE(peek(0))) {
+        runtime_error("Only instances have properties");
+        return false;
+    }
+
+    ObjInstance *instance = AS_INSTANCE(peek(0));
+
+    if (cache->shape != NULL && cache->shape == instance->shape) {
+        STAT_INC(property_hits);
+        pop(); // Instance
+        push(instance->slots[cache->slot]);
+        return true;
+    }
+
+    Value value;
+    if (instance_get_field(instance, name, &value)) {
+        STAT_INC(property_misses);
+        if (instance->shape != NULL) {
+            cache->shape = instance->shape;
+            cache->slot = shape_find_slot(instance->shape, name);
+        }
+
+        pop(); // Instance
+        push(value);
+        return true;
+    }
+
+    return bind_method(instance->klass, receiver_key(instance), name, cache);
+}
+
+static inline bool set_property(ObjString *name, InlineCache *cache)
+{
+    if (!IS_INSTANCE(peek(1))) {
+        runtime_error("Only instances have fields");
+        return false;
+    }
+
+    ObjInstance *instance = AS_INSTANCE(peek(1));
+
+    if (cache->shape != NULL && cache->shape == instance->shape) {
+        STAT_INC(property_hits);
+        if (cache->transition != NULL) {
+            instance_add_field(instance, cache->transition, peek(0));
+        } else {
+            instance->slots[cache->slot] = peek(0);
+        }
+    } else {
+        STAT_INC(property_misses);
+        ObjShape *before = instance->shape;
+        int slot = instance_set_field(instance, name, peek(0));
+
+        if (slot != -1) {
+            cache->shape = before;
+            cache->transition = instance->shape != before ? instance->shape : NULL;
+            cache->slot = slot;
+        }
+    }
+
+    Value value = pop();
+    pop();
+    push(value);
+    return true;
+}
+
 static void concatenate()
 {
     ObjString *b = AS_STRING(peek(0));
     ObjString *a = AS_STRING(peek(1));
 
     int len = a->len + b->len;
-    char *chars = ALLOCATE(char, len + 1);
+    if (len >= ROPE_MIN_LENGTH) {
+        ObjString *rope = new_rope(a, b);
+        pop();
+        pop();
+        push(OBJ_VAL(rope));
+        return;
+    }
+
+    // Short enough to put together on the C stack, so a result that is
+    // already interned costs no allocation at all.
+    char chars[ROPE_MIN_LENGTH];
     memcpy(chars, a->chars, a->len);
     memcpy(chars + a->len, b->chars, b->len);
-    chars[len] = '\0';
 
-    ObjString *result = take_string(chars, len);
+    ObjString *result = copy_string(chars, len);
     pop();
     pop();
 
     push(OBJ_VAL(result));
 }
 
-static VMResult run()
+#if JIT || TRACE_JIT || AOT
+/*
+ * Runtime helpers for jit.c, trace.c and the C that cloxc generates. Native
+ * code calls these for anything that allocates, can fail, or changes the
+ * frame stack. By then frame->ip already points past the instruction, as it
+ * would in the interpreter.
+*/
+JitStatus jit_operator(OpCode op)
+{
+    switch (op) {
+        case OP_NOT:
+            push(BOOL_VAL(is_falsey(pop())));
+            return JIT_NEXT;
+        case OP_EQUAL: {
+            Value b = pop();
+            Value a = pop();
+            push(BOOL_VAL(values_equal(a, b)));
+        } return JIT_NEXT;
+        case OP_NEGATE:
+            if (!IS_NUMBER(peek(0))) {
+                runtime_error("Unary operand must be a number");
+                return JIT_ERROR;
+            }
+
+            push(NUMBER_VAL(-AS_NUMBER(pop())));
+            return JIT_NEXT;
+        case OP_ADD:
+            if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
+                concatenate();
+                return JIT_NEXT;
+            }
+
+            if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) {
+                runtime_error("Binary (addition) operands must be numbers or strings");
+                return JIT_ERROR;
+            }
+            break;
+        default:
+            if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) {
+                runtime_error("Binary (non-addition) operands must be numbers");
+                return JIT_ERROR;
+            }
+            break;
+    }
+
+    double b = AS_NUMBER(pop());
+    double a = AS_NUMBER(pop());
+
+    switch (op) {
+        case OP_GREATER:    push(BOOL_VAL(a > b)); break;
+        case OP_LESS:       push(BOOL_VAL(a < b)); break;
+        case OP_GREATER_EQUAL: push(BOOL_VAL(a >= b)); break;
+        case OP_LESS_EQUAL: push(BOOL_VAL(a <= b)); break;
+        case OP_ADD:        push(NUMBER_VAL(a + b)); break;
+        case OP_SUBTRACT:   push(NUMBER_VAL(a - b)); break;
+        case OP_MULTIPLY:   push(NUMBER_VAL(a * b)); break;
+        default:            push(NUMBER_VAL(a / b)); break;
+    }
+
+    return JIT_NEXT;
+}
+
+JitStatus jit_get_global(int slot)
+{
+    Value value = vm.globals.values[slot];
+    if (IS_UNDEFINED(value)) {
+        runtime_error("Undefined variable '%s'", global_name(slot)->chars);
+        return JIT_ERROR;
+    }
+
+    push(value);
+    return JIT_NEXT;
+}
+
+JitStatus jit_set_global(int slot)
+{
+    if (IS_UNDEFINED(vm.globals.values[slot])) {
+        runtime_error("Undefined variable '%s'", global_name(slot)->chars);
+        return JIT_ERROR;
+    }
+
+    vm.globals.values[slot] = peek(0);
+    return JIT_NEXT;
+}
+
+JitStatus jit_get_property(ObjString *name, InlineCache *cache)
+{
+    return get_property(name, cache) ? JIT_NEXT : JIT_ERROR;
+}
+
+JitStatus jit_set_property(ObjString *name, InlineCache *cache)
+{
+    return set_property(name, cache) ? JIT_NEXT : JIT_ERROR;
+}
+
+JitStatus jit_get_super(ObjString *name, InlineCache *cache)
+{
+    ObjClass *superclass = AS_CLASS(pop());
+    return bind_method(superclass, (Obj *)superclass, name, cache) ? JIT_NEXT : JIT_ERROR;
+}
+
+#if JIT
+/*
+ * Finishes a call made from native code. Calls to natives, and to classes
+ * without an initializer, don't push a frame, so the caller just carries on.
+ * A callee with machine code is run right here, and if it returns normally
+ * the caller carries on too. Anything else unwinds to run(), which resumes
+ * whatever frame is on top and re-enters the callers' machine code as they
+ * are returned to.
+*/
+static JitStatus finish_call(int frame_count)
+{
+    if (vm.frame_count == frame_count) return JIT_NEXT;
+
+    CallFrame *callee = &vm.frames[vm.frame_count - 1];
+    if (callee->closure->function->jit == NULL) return JIT_EXIT;
+
+    JitStatus status = jit_enter(callee);
+    if (status == JIT_EXIT && vm.frame_count == frame_count) {
+        return JIT_NEXT;
+    }
+
+    return status;
+}
+
+JitStatus jit_call(int arg_count)
+{
+    int frame_count = vm.frame_count;
+    if (!call_value(peek(arg_count), arg_count)) {
+        return JIT_ERROR;
+    }
+
+    return finish_call(frame_count);
+}
+
+// A callee that takes over the caller's frame is run by run(), which the
+// caller's machine code unwinds to.
+JitStatus jit_tail_call(int arg_count)
+{
+    if (tail_call(&vm.frames[vm.frame_count - 1], arg_count)) return JIT_EXIT;
+    return jit_call(arg_count);
+}
+
+JitStatus jit_invoke(ObjString *name, int arg_count, InlineCache *cache)
+{
+    int frame_count = vm.frame_count;
+    if (!invoke(name, arg_count, cache)) {
+        return JIT_ERROR;
+    }
+
+    return finish_call(frame_count);
+}
+
+JitStatus jit_super_invoke(ObjString *name, int arg_count, InlineCache *cache)
+{
+    int frame_count = vm.frame_count;
+    ObjClass *superclass = AS_CLASS(pop());
+    if (!invoke_from_class(superclass, (Obj *)superclass, name, arg_count, cache)) {
+        return JIT_ERROR;
+    }
+
+    return finish_call(frame_count);
+}
+
+JitStatus jit_return(CallFrame *frame)
+{
+    Value result = pop();
+    close_upvalues(frame->slots);
+    vm.frame_count--;
+
+    if (vm.frame_count == 0) {
+        pop();
+        return JIT_DONE;
+    }
+
+    vm.stack_top = frame->slots;
+    push(result);
+    return JIT_EXIT;
+}
+#endif // JIT
+
+void jit_closure(CallFrame *frame, ObjFunction *function, uint8_t *upvalues)
+{
+    ObjClosure *closure = new_closure(function);
+    push(OBJ_VAL(closure));
+
+    for (int i = 0; i < closure->upvalue_count; i++) {
+        uint8_t is_local = upvalues[i * 2];
+        uint8_t index = upvalues[i * 2 + 1];
+        if (is_local) {
+            closure->upvalues[i] = capture_upvalue(frame->slots + index);
+        } else {
+            closure->upvalues[i] = frame->closure->upvalues[index];
+        }
+    }
+}
+
+void jit_close_upvalue()
+{
+    close_upvalues(vm.stack_top - 1);
+    pop();
+}
+
+void jit_print()
+{
+    print_value(pop());
+    printf("\n");
+}
+
+bool jit_is_falsey(Value *value)
+{
+    return is_falsey(*value);
+}
+#endif // JIT || TRACE_JIT || AOT
+
+#if REGISTER_VM
+/*
+ * Runs the register code of the frame on top until the script finishes.
+ *
+ * A frame's registers are its stack slots. vm.stack_top is kept just past
+ * the last of them, so the helpers shared with the stack interpreter can push
+ * and pop above them. For a call it is moved down to just past the
+ * arguments while the helper runs, which is where the helpers expect it.
+*/
+static VMResult run_registers()
+{
+    CallFrame *frame;
+    Value *regs;
+
+#define READ_BYTE()     (*frame->ip++)
+#define READ_SHORT()    (frame->ip += 2, (uint16_t)((frame->ip[-2] << 8) | frame->ip[-1]))
+#define READ_CONSTANT() (frame->closure->function->chunk.constants.values[READ_BYTE()])
+#define READ_STRING()   AS_STRING(READ_CONSTANT())
+#define READ_CACHE()    (&frame->closure->function->chunk.caches[READ_SHORT()])
+#define READ_REGISTER() (regs[READ_BYTE()])
+#define CHECK_NUMBERS(a, b)                                     \
+    do {                                                        \
+        if (!IS_NUMBER(a) || !IS_NUMBER(b)) {                   \
+            runtime_error("Binary (non-addition) operands must be numbers");   \
+            return VM_RUNTIME_ERROR;                            \
+        }                                                       \
+    } while (false)
+#define BINARY_OP(value_type, op, read_right)                   \
+    do {                                                        \
+        uint8_t dest = READ_BYTE();                             \
+        Value a = READ_REGISTER();                              \
+        Value b = read_right();                                 \
+        CHECK_NUMBERS(a, b);                                    \
+        regs[dest] = value_type(AS_NUMBER(a) op AS_NUMBER(b));  \
+    } while (false)
+#define ADD_OP(read_right)                                      \
+    do {                                                        \
+        uint8_t dest = READ_BYTE();                             \
+        Value a = READ_REGISTER();                              \
+        Value b = read_right();                                 \
+        if (IS_NUMBER(a) && IS_NUMBER(b)) {                     \
+            regs[dest] = NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b)); \
+        } else if (IS_STRING(a) && IS_STRING(b)) {              \
+            push(a);                                            \
+            push(b);                                            \
+            concatenate();                                      \
+            regs[dest] = pop();                                 \
+        } else {                                                \
+            runtime_error("Binary (addition) operands must be numbers or strings"); \
+            return VM_RUNTIME_ERROR;                            \
+        }                                                       \
+    } while (false)
+// Jumps unless the comparison holds.
+#define COMPARE_JUMP(op, read_right)                            \
+    do {                                                        \
+        Value a = READ_REGISTER();                              \
+        Value b = read_right();                                 \
+        uint16_t offset = READ_SHORT();                         \
+        CHECK_NUMBERS(a, b);                                    \
+        if (!(AS_NUMBER(a) op AS_NUMBER(b))) frame->ip += offset; \
+    } while (false)
+#define EQUAL_JUMP(read_right)                                  \
+    do {                                                        \
+        Value a = READ_REGISTER();                              \
+        Value b = read_right();                                 \
+        uint16_t offset = READ_SHORT();                         \
+        if (!values_equal(a, b)) frame->ip += offset;           \
+    } while (false)
+
+#ifdef DEBUG_TRACE_EXECUTION
+#define TRACE_INSTRUCTION()                                     \
+    do {                                                        \
+        printf("        ");                                     \
+        for (Value *slot = regs; slot < vm.stack_top; slot++) { \
+            printf("[ ");                                       \
+            print_value(*slot);                                 \
+            printf(" ]");                                       \
+        }                                                       \
+        printf("\n");                                           \
+        disassemble_register_instruction(frame->closure->function, \
+            (int)(frame->ip - frame->closure->function->registers->code)); \
+    } while (false)
+#else
+#define TRACE_INSTRUCTION() do {} while (false)
+#endif // DEBUG_TRACE_EXECUTION
+
+#if COMPUTED_GOTO
+    static void *dispatch_table[] = {
+        [REG_MOVE]          = &&code_REG_MOVE,
+        [REG_CONSTANT]      = &&code_REG_CONSTANT,
+        [REG_NIL]           = &&code_REG_NIL,
+        [REG_TRUE]          = &&code_REG_TRUE,
+        [REG_FALSE]         = &&code_REG_FALSE,
+        [REG_GET_GLOBAL]    = &&code_REG_GET_GLOBAL,
+        [REG_SET_GLOBAL]    = &&code_REG_SET_GLOBAL,
+        [REG_DEFINE_GLOBAL] = &&code_REG_DEFINE_GLOBAL,
+        [REG_GET_UPVALUE]   = &&code_REG_GET_UPVALUE,
+        [REG_SET_UPVALUE]   = &&code_REG_SET_UPVALUE,
+        [REG_CLOSE_UPVALUE] = &&code_REG_CLOSE_UPVALUE,
+        [REG_GET_PROPERTY]  = &&code_REG_GET_PROPERTY,
+        [REG_SET_PROPERTY]  = &&code_REG_SET_PROPERTY,
+        [REG_GET_SUPER]     = &&code_REG_GET_SUPER,
+        [REG_CLASS]         = &&code_REG_CLASS,
+        [REG_INHERIT]       = &&code_REG_INHERIT,
+        [REG_METHOD]        = &&code_REG_METHOD,
+        [REG_CLOSURE]       = &&code_REG_CLOSURE,
+        [REG_JUMP]          = &&code_REG_JUMP,
+        [REG_JUMP_IF_FALSE] = &&code_REG_JUMP_IF_FALSE,
+        [REG_LOOP]          = &&code_REG_LOOP,
+        [REG_CALL]          = &&code_REG_CALL,
+        [REG_TAIL_CALL]     = &&code_REG_TAIL_CALL,
+        [REG_INVOKE]        = &&code_REG_INVOKE,
+        [REG_SUPER_INVOKE]  = &&code_REG_SUPER_INVOKE,
+        [REG_PRINT]         = &&code_REG_PRINT,
+        [REG_RETURN]        = &&code_REG_RETURN,
+        [REG_NOT]           = &&code_REG_NOT,
+        [REG_NEGATE]        = &&code_REG_NEGATE,
+        [REG_EQUAL]         = &&code_REG_EQUAL,
+        [REG_GREATER]       = &&code_REG_GREATER,
+        [REG_LESS]          = &&code_REG_LESS,
+        [REG_GREATER_EQUAL] = &&code_REG_GREATER_EQUAL,
+        [REG_LESS_EQUAL]    = &&code_REG_LESS_EQUAL,
+        [REG_ADD]           = &&code_REG_ADD,
+        [REG_SUBTRACT]      = &&code_REG_SUBTRACT,
+        [REG_MULTIPLY]      = &&code_REG_MULTIPLY,
+        [REG_DIVIDE]        = &&code_REG_DIVIDE,
+        [REG_EQUAL_K]       = &&code_REG_EQUAL_K,
+        [REG_GREATER_K]     = &&code_REG_GREATER_K,
+        [REG_LESS_K]        = &&code_REG_LESS_K,
+        [REG_GREATER_EQUAL_K] = &&code_REG_GREATER_EQUAL_K,
+        [REG_LESS_EQUAL_K]  = &&code_REG_LESS_EQUAL_K,
+        [REG_ADD_K]         = &&code_REG_ADD_K,
+        [REG_SUBTRACT_K]    = &&code_REG_SUBTRACT_K,
+        [REG_MULTIPLY_K]    = &&code_REG_MULTIPLY_K,
+        [REG_DIVIDE_K]      = &&code_REG_DIVIDE_K,
+        [REG_EQUAL_JUMP]    = &&code_REG_EQUAL_JUMP,
+        [REG_GREATER_JUMP]  = &&code_REG_GREATER_JUMP,
+        [REG_LESS_JUMP]     = &&code_REG_LESS_JUMP,
+        [REG_GREATER_EQUAL_JUMP] = &&code_REG_GREATER_EQUAL_JUMP,
+        [REG_LESS_EQUAL_JUMP] = &&code_REG_LESS_EQUAL_JUMP,
+        [REG_EQUAL_K_JUMP]  = &&code_REG_EQUAL_K_JUMP,
+        [REG_GREATER_K_JUMP] = &&code_REG_GREATER_K_JUMP,
+        [REG_LESS_K_JUMP]   = &&code_REG_LESS_K_JUMP,
+        [REG_GREATER_EQUAL_K_JUMP] = &&code_REG_GREATER_EQUAL_K_JUMP,
+        [REG_LESS_EQUAL_K_JUMP] = &&code_REG_LESS_EQUAL_K_JUMP,
+    };
+
+#define INTERPRET_LOOP      DISPATCH();
+#define CASE_CODE(name)     code_##name
+#define DISPATCH()                                              \
+    do {                                                        \
+        TRACE_INSTRUCTION();                                    \
+        STAT_INC(instructions);                                 \
+        goto *dispatch_table[READ_BYTE()];                      \
+    } while (false)
+#else
+#define INTERPRET_LOOP                                          \
+    loop:                                                       \
+        TRACE_INSTRUCTION();                                    \
+        STAT_INC(instructions);                                 \
+        switch (READ_BYTE())
+#define CASE_CODE(name)     case name
+#define DISPATCH()          goto loop
+#endif // COMPUTED_GOTO
+
+#define ENTER_FRAME()                                           \
+    do {                                                        \
+        frame = &vm.frames[vm.frame_count - 1];                 \
+        regs = frame->slots;                                    \
+        vm.stack_top = frame->top;                              \
+    } while (false)
+
+    ENTER_FRAME();
+
+    INTERPRET_LOOP
+    {
+        CASE_CODE(REG_MOVE): {
+            uint8_t dest = READ_BYTE();
+            regs[dest] = READ_REGISTER();
+        } DISPATCH();
+        CASE_CODE(REG_CONSTANT): {
+            uint8_t dest = READ_BYTE();
+            regs[dest] = READ_CONSTANT();
+        } DISPATCH();
+        CASE_CODE(REG_NIL):
+            READ_REGISTER() = NIL_VAL;
+            DISPATCH();
+        CASE_CODE(REG_TRUE):
+            READ_REGISTER() = BOOL_VAL(true);
+            DISPATCH();
+        CASE_CODE(REG_FALSE):
+            READ_REGISTER() = BOOL_VAL(false);
+            DISPATCH();
+        CASE_CODE(REG_GET_GLOBAL): {
+            uint8_t dest = READ_BYTE();
+            int slot = READ_SHORT();
+            Value value = vm.globals.values[slot];
+
+            if (IS_UNDEFINED(value)) {
+                runtime_error("Undefined variable '%s'", global_name(slot)->chars);
+                return VM_RUNTIME_ERROR;
+            }
+
+            regs[dest] = value;
+        } DISPATCH();
+        CASE_CODE(REG_SET_GLOBAL): {
+            int slot = READ_SHORT();
+            Value value = READ_REGISTER();
+
+            if (IS_UNDEFINED(vm.globals.values[slot])) {
+                runtime_error("Undefined variable '%s'", global_name(slot)->chars);
+                return VM_RUNTIME_ERROR;
+            }
+
+            vm.globals.values[slot] = value;
+        } DISPATCH();
+        CASE_CODE(REG_DEFINE_GLOBAL): {
+            int slot = READ_SHORT();
+            vm.globals.values[slot] = READ_REGISTER();
+        } DISPATCH();
+        CASE_CODE(REG_GET_UPVALUE): {
+            uint8_t dest = READ_BYTE();
+            regs[dest] = *frame->closure->upvalues[READ_BYTE()]->location;
+        } DISPATCH();
+        CASE_CODE(REG_SET_UPVALUE): {
+            uint8_t slot = READ_BYTE();
+            *frame->closure->upvalues[slot]->location = READ_REGISTER();
+        } DISPATCH();
+        CASE_CODE(REG_CLOSE_UPVALUE):
+            close_upvalues(&READ_REGISTER());
+            DISPATCH();
+        CASE_CODE(REG_GET_PROPERTY): {
+            uint8_t dest = READ_BYTE();
+            Value object = READ_REGISTER();
+            ObjString *name = READ_STRING();
+            InlineCache *cache = READ_CACHE();
+
+            if (IS_INSTANCE(object)) {
+                ObjInstance *instance = AS_INSTANCE(object);
+                if (cache->shape != NULL && cache->shape == instance->shape) {
+                    STAT_INC(property_hits);
+                    regs[dest] = instance->slots[cache->slot];
+                    DISPATCH();
+                }
+            }
+
+            push(object);
+            if (!get_property(name, cache)) {
+                return VM_RUNTIME_ERROR;
+            }
+            regs[dest] = pop();
+        } DISPATCH();
+        CASE_CODE(REG_SET_PROPERTY): {
+            Value object = READ_REGISTER();
+            Value value = READ_REGISTER();
+            ObjString *name = READ_STRING();
+            InlineCache *cache = READ_CACHE();
+
+            if (IS_INSTANCE(object)) {
+                ObjInstance *instance = AS_INSTANCE(object);
+                if (cache->shape != NULL && cache->shape == instance->shape &&
+                        cache->transition == NULL) {
+                    STAT_INC(property_hits);
+                    instance->slots[cache->slot] = value;
+                    DISPATCH();
+                }
+            }
+
+            push(object);
+            push(value);
+            if (!set_property(name, cache)) {
+                return VM_RUNTIME_ERROR;
+            }
+            pop();
+        } DISPATCH();
+        CASE_CODE(REG_GET_SUPER): {
+            uint8_t dest = READ_BYTE();
+            Value receiver = READ_REGISTER();
+            ObjClass *superclass = AS_CLASS(READ_REGISTER());
+            ObjString *name = READ_STRING();
+            InlineCache *cache = READ_CACHE();
+
+            push(receiver);
+            if (!bind_method(superclass, (Obj *)superclass, name, cache)) {
+                return VM_RUNTIME_ERROR;
+            }
+            regs[dest] = pop();
+        } DISPATCH();
+        CASE_CODE(REG_CLASS): {
+            uint8_t dest = READ_BYTE();
+            regs[dest] = OBJ_VAL(new_class(READ_STRING()));
+        } DISPATCH();
+        CASE_CODE(REG_INHERIT): {
+            Value superclass = READ_REGISTER();
+            ObjClass *subclass = AS_CLASS(READ_REGISTER());
+            if (!IS_CLASS(superclass)) {
+                runtime_error("Superclass must be a class");
+                return VM_RUNTIME_ERROR;
+            }
+
+            class_inherit(subclass, AS_CLASS(superclass));
+        } DISPATCH();
+        CASE_CODE(REG_METHOD): {
+            Value klass = READ_REGISTER();
+            Value method = READ_REGISTER();
+
+            push(klass);
+            push(method);
+            define_method(READ_STRING());
+            pop(); // Class
+        } DISPATCH();
+        CASE_CODE(REG_CLOSURE): {
+            uint8_t dest = READ_BYTE();
+            ObjFunction *function = AS_FUNCTION(READ_CONSTANT());
+            ObjClosure *closure = new_closure(function);
+            regs[dest] = OBJ_VAL(closure);
+
+            for (int i = 0; i < closure->upvalue_count; i++) {
+                uint8_t is_local = READ_BYTE();
+                uint8_t index = READ_BYTE();
+                if (is_local) {
+                    closure->upvalues[i] = capture_upvalue(regs + index);
+                } else {
+                    closure->upvalues[i] = frame->closure->upvalues[index];
+                }
+            }
+        } DISPATCH();
+        CASE_CODE(REG_JUMP): {
+            uint16_t offset = READ_SHORT();
+            frame->ip += offset;
+        } DISPATCH();
+        CASE_CODE(REG_JUMP_IF_FALSE): {
+            Value condition = READ_REGISTER();
+            uint16_t offset = READ_SHORT();
+            if (is_falsey(condition)) frame->ip += offset;
+        } DISPATCH();
+        CASE_CODE(REG_LOOP): {
+            uint16_t offset = READ_SHORT();
+            frame->ip -= offset;
+        } DISPATCH();
+        CASE_CODE(REG_CALL): {
+            uint8_t base = READ_BYTE();
+            int arg_count = READ_BYTE();
+
+            vm.stack_top = regs + base + arg_count + 1;
+            if (!call_value(regs[base], arg_count)) {
+                return VM_RUNTIME_ERROR;
+            }
+            ENTER_FRAME();
+        } DISPATCH();
+        CASE_CODE(REG_TAIL_CALL): {
+            uint8_t base = READ_BYTE();
+            int arg_count = READ_BYTE();
+
+            vm.stack_top = regs + base + arg_count + 1;
+            if (!tail_call(frame, arg_count) && !call_value(regs[base], arg_count)) {
+                return VM_RUNTIME_ERROR;
+            }
+            ENTER_FRAME();
+        } DISPATCH();
+        CASE_CODE(REG_INVOKE): {
+            uint8_t base = READ_BYTE();
+            int arg_count = READ_BYTE();
+            ObjString *method = READ_STRING();
+            InlineCache *cache = READ_CACHE();
+
+            vm.stack_top = regs + base + arg_count + 1;
+            if (!invoke(method, arg_count, cache)) {
+                return VM_RUNTIME_ERROR;
+            }
+            ENTER_FRAME();
+        } DISPATCH();
+        CASE_CODE(REG_SUPER_INVOKE): {
+            uint8_t base = READ_BYTE();
+            int arg_count = READ_BYTE();
+            ObjString *method = READ_STRING();
+            InlineCache *cache = READ_CACHE();
+            ObjClass *superclass = AS_CLASS(regs[base + arg_count + 1]);
+
+            vm.stack_top = regs + base + arg_count + 1;
+            if (!invoke_from_class(superclass, (Obj *)superclass, method, arg_count, cache)) {
+                return VM_RUNTIME_ERROR;
+            }
+            ENTER_FRAME();
+        } DISPATCH();
+        CASE_CODE(REG_PRINT): {
+            print_value(READ_REGISTER());
+            printf("\n");
+        } DISPATCH();
+        CASE_CODE(REG_RETURN): {
+            Value result = READ_REGISTER();
+            close_upvalues(frame->slots);
+            vm.frame_count--;
+
+            if (vm.frame_count == 0) {
+                vm.stack_top = frame->slots;
+                return VM_OK;
+            }
+
+            frame->slots[0] = result;
+            ENTER_FRAME();
+        } DISPATCH();
+        CASE_CODE(REG_NOT): {
+            uint8_t dest = READ_BYTE();
+            regs[dest] = BOOL_VAL(is_falsey(READ_REGISTER()));
+        } DISPATCH();
+        CASE_CODE(REG_NEGATE): {
+            uint8_t dest = READ_BYTE();
+            Value value = READ_REGISTER();
+            if (!IS_NUMBER(value)) {
+                runtime_error("Unary operand must be a number");
+                return VM_RUNTIME_ERROR;
+            }
+
+            regs[dest] = NUMBER_VAL(-AS_NUMBER(value));
+        } DISPATCH();
+        CASE_CODE(REG_EQUAL): {
+            uint8_t dest = READ_BYTE();
+            Value a = READ_REGISTER();
+            Value b = READ_REGISTER();
+            regs[dest] = BOOL_VAL(values_equal(a, b));
+        } DISPATCH();
+        CASE_CODE(REG_GREATER):
+            BINARY_OP(BOOL_VAL, >, READ_REGISTER);
+            DISPATCH();
+        CASE_CODE(REG_LESS):
+            BINARY_OP(BOOL_VAL, <, READ_REGISTER);
+            DISPATCH();
+        CASE_CODE(REG_GREATER_EQUAL):
+            BINARY_OP(BOOL_VAL, >=, READ_REGISTER);
+            DISPATCH();
+        CASE_CODE(REG_LESS_EQUAL):
+            BINARY_OP(BOOL_VAL, <=, READ_REGISTER);
+            DISPATCH();
+        CASE_CODE(REG_ADD):
+            ADD_OP(READ_REGISTER);
+            DISPATCH();
+        CASE_CODE(REG_SUBTRACT):
+            BINARY_OP(NUMBER_VAL, -, READ_REGISTER);
+            DISPATCH();
+        CASE_CODE(REG_MULTIPLY):
+            BINARY_OP(NUMBER_VAL, *, READ_REGISTER);
+            DISPATCH();
+        CASE_CODE(REG_DIVIDE):
+            BINARY_OP(NUMBER_VAL, /, READ_REGISTER);
+            DISPATCH();
+        CASE_CODE(REG_EQUAL_K): {
+            uint8_t dest = READ_BYTE();
+            Value a = READ_REGISTER();
+            Value b = READ_CONSTANT();
+            regs[dest] = BOOL_VAL(values_equal(a, b));
+        } DISPATCH();
+        CASE_CODE(REG_GREATER_K):
+            BINARY_OP(BOOL_VAL, >, READ_CONSTANT);
+            DISPATCH();
+        CASE_CODE(REG_LESS_K):
+            BINARY_OP(BOOL_VAL, <, READ_CONSTANT);
+            DISPATCH();
+        CASE_CODE(REG_GREATER_EQUAL_K):
+            BINARY_OP(BOOL_VAL, >=, READ_CONSTANT);
+            DISPATCH();
+        CASE_CODE(REG_LESS_EQUAL_K):
+            BINARY_OP(BOOL_VAL, <=, READ_CONSTANT);
+            DISPATCH();
+        CASE_CODE(REG_ADD_K):
+            ADD_OP(READ_CONSTANT);
+            DISPATCH();
+        CASE_CODE(REG_SUBTRACT_K):
+            BINARY_OP(NUMBER_VAL, -, READ_CONSTANT);
+            DISPATCH();
+        CASE_CODE(REG_MULTIPLY_K):
+            BINARY_OP(NUMBER_VAL, *, READ_CONSTANT);
+            DISPATCH();
+        CASE_CODE(REG_DIVIDE_K):
+            BINARY_OP(NUMBER_VAL, /, READ_CONSTANT);
+            DISPATCH();
+        CASE_CODE(REG_EQUAL_JUMP):
+            EQUAL_JUMP(READ_REGISTER);
+            DISPATCH();
+        CASE_CODE(REG_GREATER_JUMP):
+            COMPARE_JUMP(>, READ_REGISTER);
+            DISPATCH();
+        CASE_CODE(REG_LESS_JUMP):
+            COMPARE_JUMP(<, READ_REGISTER);
+            DISPATCH();
+        CASE_CODE(REG_GREATER_EQUAL_JUMP):
+            COMPARE_JUMP(>=, READ_REGISTER);
+            DISPATCH();
+        CASE_CODE(REG_LESS_EQUAL_JUMP):
+            COMPARE_JUMP(<=, READ_REGISTER);
+            DISPATCH();
+        CASE_CODE(REG_EQUAL_K_JUMP):
+            EQUAL_JUMP(READ_CONSTANT);
+            DISPATCH();
+        CASE_CODE(REG_GREATER_K_JUMP):
+            COMPARE_JUMP(>, READ_CONSTANT);
+            DISPATCH();
+        CASE_CODE(REG_LESS_K_JUMP):
+            COMPARE_JUMP(<, READ_CONSTANT);
+            DISPATCH();
+        CASE_CODE(REG_GREATER_EQUAL_K_JUMP):
+            COMPARE_JUMP(>=, READ_CONSTANT);
+            DISPATCH();
+        CASE_CODE(REG_LESS_EQUAL_K_JUMP):
+            COMPARE_JUMP(<=, READ_CONSTANT);
+            DISPATCH();
+    }
+
+    return VM_RUNTIME_ERROR; // Unreachable
+
+#undef READ_BYTE
+#undef READ_SHORT
+#undef READ_CONSTANT
+#undef READ_STRING
+#undef READ_CACHE
+#undef READ_REGISTER
+#undef CHECK_NUMBERS
+#undef BINARY_OP
+#undef ADD_OP
+#undef COMPARE_JUMP
+#undef EQUAL_JUMP
+#undef TRACE_INSTRUCTION
+#undef INTERPRET_LOOP
+#undef CASE_CODE
+#undef DISPATCH
+#undef ENTER_FRAME
+}
+#else
+/*
+ * Runs the frame on top until it returns to the frame at `base`, or until the
+ * script finishes when that is 0. Traces use a nested run() to finish the
+ * calls they make.
+*/
+static VMResult run(int base)
 {
     CallFrame *frame = &vm.frames[vm.frame_count - 1];
 
@@ -285,282 +1547,804 @@ static VMResult run()
 #define READ_CONSTANT() (frame->closure->function->chunk.constants.values[READ_BYTE()])
 #define READ_SHORT()    (frame->ip += 2, (uint16_t)((frame->ip[-2] << 8) | frame->ip[-1]))
 #define READ_STRING()   AS_STRING(READ_CONSTANT())
-#define BINARY_OP(value_type, op)                               \
+#define READ_CACHE()    (&frame->closure->function->chunk.caches[READ_SHORT()])
+#define READ_LOOP()     (&frame->closure->function->chunk.loops[READ_SHORT()])
+// Rewrites the one-byte instruction that was just read.
+#define QUICKEN(op)     (frame->ip[-1] = (op))
+#define BINARY_OP(value_type, op, quickened)                    \
     do {                                                        \
         if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) {       \
             runtime_error("Binary (non-addition) operands must be numbers");   \
             return VM_RUNTIME_ERROR;                            \
         }                                                       \
                                                                 \
+        QUICKEN(quickened);                                     \
         double b = AS_NUMBER(pop());                            \
         double a = AS_NUMBER(pop());                            \
         push(value_type(a op b));                               \
     } while (false)
 
-    for (;;) {
+/*
+ * The quickened form of BINARY_OP. If either operand isn't a number, the
+ * instruction is turned back into the generic one and run again as that.
+*/
+#define NUMBER_OP(value_type, op, generic)                      \
+    do {                                                        \
+        Value b = vm.stack_top[-1];                             \
+        Value a = vm.stack_top[-2];                             \
+        if (!IS_NUMBER(a) || !IS_NUMBER(b)) {                   \
+            DEOPTIMIZE(generic);                                \
+        }                                                       \
+                                                                \
+        vm.stack_top[-2] = value_type(AS_NUMBER(a) op AS_NUMBER(b)); \
+        vm.stack_top--;                                         \
+    } while (false)
+#define DEOPTIMIZE(generic)                                     \
+    do {                                                        \
+        frame->ip[-1] = (generic);                              \
+        frame->ip--;                                            \
+        DISPATCH();                                             \
+    } while (false)
 
-#ifdef DEBUG_TRACE_EXECUTION
-        printf("        ");
-        for (Value *slot = vm.stack; slot < vm.stack_top; slot++) {
-            printf("[ ");
-            print_value(*slot);
-            printf(" ]");
-        }
-        printf("\n");
-        disassemble_instruction(&frame->closure->function->chunk,
-            (int)(frame->ip - frame->closure->function->chunk.code));
-#endif
-
-        uint8_t instruction;
-        switch (instruction = READ_BYTE()) {
-            case OP_CLASS: {
-                push(OBJ_VAL(new_class(READ_STRING())));
-            } break;
-            case OP_INHERIT: {
-                Value superclass = peek(1);
-                if (!IS_CLASS(superclass)) {
-                    runtime_error("Superclass must be a class");
-                    return VM_RUNTIME_ERROR;
-                }
+/*
+ * The trace recorder has to see every instruction on its own, so while a
+ * loop is being recorded a superinstruction runs just the first instruction
+ * of its sequence and lets the rest run as they were compiled.
+*/
+#if TRACE_JIT
+#define RECORDING()     vm.recording
+#else
+#define RECORDING()     false
+#endif // TRACE_JIT
+
+/*
+ * The comparison and JUMP_IF_FALSE/POP of a superinstruction. The ip is left
+ * on the jump, which either falls through past its POP or takes the jump with
+ * the false result still on the stack for the POP at the other end.
+*/
+#define COMPARE_JUMP(result)                                    \
+    do {                                                        \
+        bool condition = (result);                              \
+        vm.stack_top--;                                         \
+        if (RECORDING()) {                                      \
+            vm.stack_top[-1] = BOOL_VAL(condition);             \
+            DISPATCH();                                         \
+        }                                                       \
+                                                                \
+        if (condition) {                                        \
+            vm.stack_top--;                                     \
+            frame->ip += 4;                                     \
+        } else {                                                \
+            vm.stack_top[-1] = BOOL_VAL(false);                 \
+            frame->ip += 3 + ((frame->ip[1] << 8) | frame->ip[2]); \
+        }                                                       \
+    } while (false)
 
-                ObjClass *subclass = AS_CLASS(peek(0));
-                table_add_all(&AS_CLASS(superclass)->methods, &subclass->methods);
-                pop(); // Subclass
-            } break;
-            case OP_GET_SUPER: {
-                ObjString *name = READ_STRING();
-                ObjClass *superclass = AS_CLASS(pop());
+#ifdef DEBUG_TRACE_EXECUTION
+#define TRACE_INSTRUCTION()                                     \
+    do {                                                        \
+        printf("        ");                                     \
+        for (Value *slot = vm.stack; slot < vm.stack_top; slot++) { \
+            printf("[ ");                                       \
+            print_value(*slot);                                 \
+            printf(" ]");                                       \
+        }                                                       \
+        printf("\n");                                           \
+        disassemble_instruction(&frame->closure->function->chunk, \
+            (int)(frame->ip - frame->closure->function->chunk.code)); \
+    } while (false)
+#else
+#define TRACE_INSTRUCTION() do {} while (false)
+#endif // DEBUG_TRACE_EXECUTION
 
-                if (!bind_method(superclass, name)) {
-                    return VM_RUNTIME_ERROR;
-                }
-            } break;
-            case OP_CONSTANT: {
-                Value constant = READ_CONSTANT();
-                push(constant);
-            } break;
-            case OP_GET_PROPERTY: {
-                if (!IS_INSTANCE(peek(0))) {
-                    runtime_error("Only instances have properties");
-                    return VM_RUNTIME_ERROR;
-                }
+#if OPCODE_PROFILE
+#define PROFILE_INSTRUCTION() profile_opcode(*frame->ip)
+#else
+#define PROFILE_INSTRUCTION() do {} while (false)
+#endif // OPCODE_PROFILE
+
+/*
+ * With computed gotos every handler ends in its own indirect jump through the
+ * label table, so the branch predictor gets one history slot per opcode
+ * instead of sharing a single one for the whole loop. The switch is kept as
+ * the portable fallback for compilers without the labels-as-values extension.
+*/
+#if COMPUTED_GOTO
+    static void *dispatch_table[] = {
+        [OP_CLASS]          = &&code_OP_CLASS,
+        [OP_INHERIT]        = &&code_OP_INHERIT,
+        [OP_GET_SUPER]      = &&code_OP_GET_SUPER,
+        [OP_CONSTANT]       = &&code_OP_CONSTANT,
+        [OP_GET_PROPERTY]   = &&code_OP_GET_PROPERTY,
+        [OP_SET_PROPERTY]   = &&code_OP_SET_PROPERTY,
+        [OP_METHOD]         = &&code_OP_METHOD,
+        [OP_CLOSURE]        = &&code_OP_CLOSURE,
+        [OP_DEFINE_GLOBAL]  = &&code_OP_DEFINE_GLOBAL,
+        [OP_GET_GLOBAL]     = &&code_OP_GET_GLOBAL,
+        [OP_SET_GLOBAL]     = &&code_OP_SET_GLOBAL,
+        [OP_GET_UPVALUE]    = &&code_OP_GET_UPVALUE,
+        [OP_SET_UPVALUE]    = &&code_OP_SET_UPVALUE,
+        [OP_CLOSE_UPVALUE]  = &&code_OP_CLOSE_UPVALUE,
+        [OP_GET_LOCAL]      = &&code_OP_GET_LOCAL,
+        [OP_SET_LOCAL]      = &&code_OP_SET_LOCAL,
+        [OP_JUMP_IF_FALSE]  = &&code_OP_JUMP_IF_FALSE,
+        [OP_JUMP]           = &&code_OP_JUMP,
+        [OP_LOOP]           = &&code_OP_LOOP,
+        [OP_CALL]           = &&code_OP_CALL,
+        [OP_INVOKE]         = &&code_OP_INVOKE,
+        [OP_SUPER_INVOKE]   = &&code_OP_SUPER_INVOKE,
+        [OP_POP]            = &&code_OP_POP,
+        [OP_PRINT]          = &&code_OP_PRINT,
+        [OP_RETURN]         = &&code_OP_RETURN,
+        [OP_NIL]            = &&code_OP_NIL,
+        [OP_TRUE]           = &&code_OP_TRUE,
+        [OP_FALSE]          = &&code_OP_FALSE,
+        [OP_NOT]            = &&code_OP_NOT,
+        [OP_EQUAL]          = &&code_OP_EQUAL,
+        [OP_GREATER]        = &&code_OP_GREATER,
+        [OP_LESS]           = &&code_OP_LESS,
+        [OP_GREATER_EQUAL]  = &&code_OP_GREATER_EQUAL,
+        [OP_LESS_EQUAL]     = &&code_OP_LESS_EQUAL,
+        [OP_NEGATE]         = &&code_OP_NEGATE,
+        [OP_ADD]            = &&code_OP_ADD,
+        [OP_SUBTRACT]       = &&code_OP_SUBTRACT,
+        [OP_MULTIPLY]       = &&code_OP_MULTIPLY,
+        [OP_DIVIDE]         = &&code_OP_DIVIDE,
+        [OP_GREATER_NUM]    = &&code_OP_GREATER_NUM,
+        [OP_LESS_NUM]       = &&code_OP_LESS_NUM,
+        [OP_GREATER_EQUAL_NUM] = &&code_OP_GREATER_EQUAL_NUM,
+        [OP_LESS_EQUAL_NUM] = &&code_OP_LESS_EQUAL_NUM,
+        [OP_ADD_NUM]        = &&code_OP_ADD_NUM,
+        [OP_ADD_STR]        = &&code_OP_ADD_STR,
+        [OP_SUBTRACT_NUM]   = &&code_OP_SUBTRACT_NUM,
+        [OP_MULTIPLY_NUM]   = &&code_OP_MULTIPLY_NUM,
+        [OP_DIVIDE_NUM]     = &&code_OP_DIVIDE_NUM,
+        [OP_GET_LOCAL_PROPERTY] = &&code_OP_GET_LOCAL_PROPERTY,
+        [OP_LESS_JUMP]      = &&code_OP_LESS_JUMP,
+        [OP_EQUAL_JUMP]     = &&code_OP_EQUAL_JUMP,
+        [OP_JUMP_IF_FALSE_POP] = &&code_OP_JUMP_IF_FALSE_POP,
+        [OP_TAIL_CALL]      = &&code_OP_TAIL_CALL,
+    };
+
+#if TRACE_JIT
+    // While a loop is being recorded, every instruction takes a detour
+    // through the recorder. Swapping tables keeps the check off the path of
+    // every other instruction.
+    static void *record_table[] = {
+        [0 ... OPCODE_COUNT - 1] = &&record,
+    };
+
+    void **table = vm.recording ? record_table : dispatch_table;
+#define RECORDING_CHANGED() (table = vm.recording ? record_table : dispatch_table)
+#else
+    void **table = dispatch_table;
+#endif // TRACE_JIT
+
+#define INTERPRET_LOOP      DISPATCH();
+#define CASE_CODE(name)     code_##name
+#define DISPATCH()                                              \
+    do {                                                        \
+        TRACE_INSTRUCTION();                                    \
+        PROFILE_INSTRUCTION();                                  \
+        STAT_INC(instructions);                                 \
+        goto *table[READ_BYTE()];                               \
+    } while (false)
+#else
+    uint8_t instruction;
 
-                ObjInstance *instance = AS_INSTANCE(peek(0));
-                ObjString *name = READ_STRING();
-                Value value;
+#if TRACE_JIT
+#define RECORD_INSTRUCTION()                                    \
+    do {                                                        \
+        if (vm.recording) trace_record(frame);                  \
+    } while (false)
+#else
+#define RECORD_INSTRUCTION() do {} while (false)
+#endif // TRACE_JIT
+#define RECORDING_CHANGED() ((void)0)
+
+#define INTERPRET_LOOP                                          \
+    loop:                                                       \
+        TRACE_INSTRUCTION();                                    \
+        PROFILE_INSTRUCTION();                                  \
+        RECORD_INSTRUCTION();                                   \
+        STAT_INC(instructions);                                 \
+        switch (instruction = READ_BYTE())
+#define CASE_CODE(name)     case name
+#define DISPATCH()          goto loop
+#endif // COMPUTED_GOTO
+
+// Picks up the frame on top after a call or return, and runs it as machine
+// code if its function has been compiled.
+#if JIT
+#define ENTER_FRAME()                                           \
+    do {                                                        \
+        frame = &vm.frames[vm.frame_count - 1];                 \
+        if (frame->closure->function->jit != NULL) goto native; \
+    } while (false)
+#else
+#define ENTER_FRAME()       (frame = &vm.frames[vm.frame_count - 1])
+#endif // JIT
+
+    ENTER_FRAME();
+
+    INTERPRET_LOOP
+    {
+        CASE_CODE(OP_CLASS): {
+            push(OBJ_VAL(new_class(READ_STRING())));
+        } DISPATCH();
+        CASE_CODE(OP_INHERIT): {
+            Value superclass = peek(1);
+            if (!IS_CLASS(superclass)) {
+                runtime_error("Superclass must be a class");
+                return VM_RUNTIME_ERROR;
+            }
 
-                if (table_get(&instance->fields, name, &value)) {
-                    pop(); // Instance
-                    push(value);
-                    break;
-                }
+            ObjClass *subclass = AS_CLASS(peek(0));
+            class_inherit(subclass, AS_CLASS(superclass));
+            pop(); // Subclass
+        } DISPATCH();
+        CASE_CODE(OP_GET_SUPER): {
+            ObjString *name = READ_STRING();
+            InlineCache *cache = READ_CACHE();
+            ObjClass *superclass = AS_CLASS(pop());
+
+            if (!bind_method(superclass, (Obj *)superclass, name, cache)) {
+                return VM_RUNTIME_ERROR;
+            }
+        } DISPATCH();
+        CASE_CODE(OP_CONSTANT): {
+            Value constant = READ_CONSTANT();
+            push(constant);
+        } DISPATCH();
+        CASE_CODE(OP_GET_PROPERTY): {
+            ObjString *name = READ_STRING();
+            InlineCache *cache = READ_CACHE();
+
+            if (!get_property(name, cache)) {
+                return VM_RUNTIME_ERROR;
+            }
+        } DISPATCH();
+        CASE_CODE(OP_SET_PROPERTY): {
+            ObjString *name = READ_STRING();
+            InlineCache *cache = READ_CACHE();
 
-                if (!bind_method(instance->klass, name)) {
-                    return VM_RUNTIME_ERROR;
-                }
-                break;
+            if (!set_property(name, cache)) {
+                return VM_RUNTIME_ERROR;
             }
-            case OP_SET_PROPERTY: {
-                if (!IS_INSTANCE(peek(1))) {
-                    runtime_error("Only instances have fields");
-                    return VM_RUNTIME_ERROR;
+        } DISPATCH();
+        CASE_CODE(OP_METHOD): {
+            define_method(READ_STRING());
+        } DISPATCH();
+        CASE_CODE(OP_CLOSURE): {
+            ObjFunction *function = AS_FUNCTION(READ_CONSTANT());
+            ObjClosure *closure = new_closure(function);
+            push(OBJ_VAL(closure));
+
+            for (int i = 0; i < closure->upvalue_count; i++) {
+                uint8_t is_local = READ_BYTE();
+                uint8_t index = READ_BYTE();
+                if (is_local) {
+                    closure->upvalues[i] = capture_upvalue(frame->slots + index);
+                } else {
+                    closure->upvalues[i] = frame->closure->upvalues[index];
                 }
+            }
 
-                ObjInstance *instance = AS_INSTANCE(peek(1));
-                table_set(&instance->fields, READ_STRING(), peek(0));
-                Value value = pop();
-                pop();
-                push(value);
-            } break;
-            case OP_METHOD: {
-                define_method(READ_STRING());
-            } break;
-            case OP_CLOSURE: {
-                ObjFunction *function = AS_FUNCTION(READ_CONSTANT());
-                ObjClosure *closure = new_closure(function);
-                push(OBJ_VAL(closure));
-
-                for (int i = 0; i < closure->upvalue_count; i++) {
-                    uint8_t is_local = READ_BYTE();
-                    uint8_t index = READ_BYTE();
-                    if (is_local) {
-                        closure->upvalues[i] = capture_upvalue(frame->slots + index);
-                    } else {
-                        closure->upvalues[i] = frame->closure->upvalues[index];
-                    }
-                }
+        } DISPATCH();
+        CASE_CODE(OP_DEFINE_GLOBAL): {
+            vm.globals.values[READ_SHORT()] = peek(0);
+            pop();
+        } DISPATCH();
+        CASE_CODE(OP_GET_GLOBAL): {
+            int slot = READ_SHORT();
+            Value value = vm.globals.values[slot];
+
+            if (IS_UNDEFINED(value)) {
+                runtime_error("Undefined variable '%s'", global_name(slot)->chars);
+                return VM_RUNTIME_ERROR;
+            }
 
-            } break;
-            case OP_DEFINE_GLOBAL: {
-                ObjString *name = READ_STRING();
-                table_set(&vm.globals, name, peek(0));
-                pop();
-            } break;
-            case OP_GET_GLOBAL: {
-                ObjString *name = READ_STRING();
-                Value value;
+            push(value);
+        } DISPATCH();
+        CASE_CODE(OP_SET_GLOBAL): {
+            int slot = READ_SHORT();
+            if (IS_UNDEFINED(vm.globals.values[slot])) {
+                runtime_error("Undefined variable '%s'", global_name(slot)->chars);
+                return VM_RUNTIME_ERROR;
+            }
 
-                if (!table_get(&vm.globals, name, &value)) {
-                    runtime_error("Undefined variable '%s'", name->chars);
+            vm.globals.values[slot] = peek(0);
+        } DISPATCH();
+        CASE_CODE(OP_GET_UPVALUE): {
+            uint8_t slot = READ_BYTE();
+            push(*frame->closure->upvalues[slot]->location);
+        } DISPATCH();
+        CASE_CODE(OP_SET_UPVALUE): {
+            uint8_t slot = READ_BYTE();
+            *frame->closure->upvalues[slot]->location = peek(0);
+        } DISPATCH();
+        CASE_CODE(OP_CLOSE_UPVALUE): {
+            close_upvalues(vm.stack_top - 1);
+            pop();
+        } DISPATCH();
+        CASE_CODE(OP_GET_LOCAL): {
+            uint8_t slot = READ_BYTE();
+            push(frame->slots[slot]);
+        } DISPATCH();
+        CASE_CODE(OP_SET_LOCAL): {
+            uint8_t slot = READ_BYTE();
+            frame->slots[slot] = peek(0);
+        } DISPATCH();
+        CASE_CODE(OP_JUMP_IF_FALSE): {
+            uint16_t offset = READ_SHORT();
+            if (is_falsey(peek(0))) frame->ip += offset;
+        } DISPATCH();
+        CASE_CODE(OP_JUMP): {
+            uint16_t offset = READ_SHORT();
+            frame->ip += offset;
+        } DISPATCH();
+        CASE_CODE(OP_LOOP): {
+            uint16_t offset = READ_SHORT();
+            LoopSite *loop = READ_LOOP();
+            frame->ip -= offset;
+
+#if TRACE_JIT
+            if (loop->trace != NULL) {
+                if (trace_enter(frame, loop) == JIT_ERROR) {
                     return VM_RUNTIME_ERROR;
                 }
 
-                push(value);
-            } break;
-            case OP_SET_GLOBAL: {
-                ObjString *name = READ_STRING();
-                if (table_set(&vm.globals, name, peek(0))) {
-                    table_delete(&vm.globals, name);
-                    runtime_error("Undefined variable '%s'", name->chars);
-                    return VM_RUNTIME_ERROR;
-                }
-            } break;
-            case OP_GET_UPVALUE: {
-                uint8_t slot = READ_BYTE();
-                push(*frame->closure->upvalues[slot]->location);
-            } break;
-            case OP_SET_UPVALUE: {
-                uint8_t slot = READ_BYTE();
-                *frame->closure->upvalues[slot]->location = peek(0);
-            } break;
-            case OP_CLOSE_UPVALUE: {
-                close_upvalues(vm.stack_top - 1);
-                pop();
-            } break;
-            case OP_GET_LOCAL: {
-                uint8_t slot = READ_BYTE();
-                push(frame->slots[slot]);
-            } break;
-            case OP_SET_LOCAL: {
-                uint8_t slot = READ_BYTE();
-                frame->slots[slot] = peek(0);
-            } break;
-            case OP_JUMP_IF_FALSE: {
-                uint16_t offset = READ_SHORT();
-                if (is_falsey(peek(0))) frame->ip += offset;
-            } break;
-            case OP_JUMP: {
-                uint16_t offset = READ_SHORT();
-                frame->ip += offset;
-            } break;
-            case OP_LOOP: {
-                uint16_t offset = READ_SHORT();
-                frame->ip -= offset;
-            } break;
-            case OP_CALL: {
-                int arg_count = READ_BYTE();
+                ENTER_FRAME();
+                DISPATCH();
+            }
+#endif // TRACE_JIT
+
+#if JIT
+            // A hot loop switches to machine code at its next iteration, so
+            // a function called only once, like the script, still gets
+            // compiled.
+            ObjFunction *function = frame->closure->function;
+            warm_up(function);
+            if (function->jit != NULL) goto native;
+#endif // JIT
+
+#if TRACE_JIT
+            // Loops that keep failing to record end up past the threshold
+            // for good.
+            if (!vm.recording && loop->hotness <= TRACE_THRESHOLD &&
+                loop->hotness++ == TRACE_THRESHOLD) {
+                trace_start(frame, loop, frame->ip + offset - 5);
+                RECORDING_CHANGED();
+            }
+#else
+            (void)loop;
+#endif // TRACE_JIT
+        } DISPATCH();
+        CASE_CODE(OP_CALL): {
+            int arg_count = READ_BYTE();
+            if (!call_value(peek(arg_count), arg_count)) {
+                return VM_RUNTIME_ERROR;
+            }
+            ENTER_FRAME();
+        } DISPATCH();
+        CASE_CODE(OP_TAIL_CALL): {
+            int arg_count = READ_BYTE();
+
+            // A plain call leaves its result to the RETURN that follows. The
+            // trace recorder has to see the callee return, so it gets one too.
+            if (RECORDING() || !tail_call(frame, arg_count)) {
                 if (!call_value(peek(arg_count), arg_count)) {
                     return VM_RUNTIME_ERROR;
                 }
-                frame = &vm.frames[vm.frame_count - 1];
-            } break;
-            case OP_INVOKE: {
-                ObjString *method = READ_STRING();
-                int arg_count = READ_BYTE();
-
-                if (!invoke(method, arg_count)) {
-                    return VM_RUNTIME_ERROR;
-                }
+            }
+            ENTER_FRAME();
+        } DISPATCH();
+        CASE_CODE(OP_INVOKE): {
+            ObjString *method = READ_STRING();
+            int arg_count = READ_BYTE();
+            InlineCache *cache = READ_CACHE();
+
+            if (!invoke(method, arg_count, cache)) {
+                return VM_RUNTIME_ERROR;
+            }
 
-                frame = &vm.frames[vm.frame_count - 1];
-            } break;
-            case OP_SUPER_INVOKE: {
-                ObjString *method = READ_STRING();
-                int arg_count = READ_BYTE();
-                ObjClass *superclass = AS_CLASS(pop());
+            ENTER_FRAME();
+        } DISPATCH();
+        CASE_CODE(OP_SUPER_INVOKE): {
+            ObjString *method = READ_STRING();
+            int arg_count = READ_BYTE();
+            InlineCache *cache = READ_CACHE();
+            ObjClass *superclass = AS_CLASS(pop());
 
-                if (!invoke_from_class(superclass, method, arg_count)) {
-                    return VM_RUNTIME_ERROR;
-                }
+            if (!invoke_from_class(superclass, (Obj *)superclass, method, arg_count, cache)) {
+                return VM_RUNTIME_ERROR;
+            }
 
-                frame = &vm.frames[vm.frame_count - 1];
-            } break;
-            case OP_POP:
+            ENTER_FRAME();
+        } DISPATCH();
+        CASE_CODE(OP_POP):
+            pop();
+            DISPATCH();
+        CASE_CODE(OP_PRINT): {
+            print_value(pop());
+            printf("\n");
+        } DISPATCH();
+        CASE_CODE(OP_RETURN): {
+            Value result = pop();
+            close_upvalues(frame->slots);
+            vm.frame_count--;
+
+            if (vm.frame_count == 0) {
                 pop();
-                break;
-            case OP_PRINT: {
-                print_value(pop());
-                printf("\n");
-            } break;
-            case OP_RETURN: {
-                Value result = pop();
-                close_upvalues(frame->slots);
-                vm.frame_count--;
-
-                if (vm.frame_count == 0) {
-                    pop();
-                    return VM_OK;
-                }
+                return VM_OK;
+            }
 
-                vm.stack_top = frame->slots;
-                push(result);
-                frame = &vm.frames[vm.frame_count - 1];
-            } break;
-            case OP_NIL:
-                push(NIL_VAL);
-                break;
-            case OP_TRUE:
-                push(BOOL_VAL(true));
-                break;
-            case OP_FALSE:
-                push(BOOL_VAL(false));
-                break;
-            case OP_NOT:
-                push(BOOL_VAL(is_falsey(pop())));
-                break;
-            case OP_EQUAL: {
-                Value b = pop();
-                Value a = pop();
-                push(BOOL_VAL(values_equal(a, b)));
-            } break;
-            case OP_GREATER:
-                BINARY_OP(BOOL_VAL, >);
-                break;
-            case OP_LESS:
-                BINARY_OP(BOOL_VAL, <);
-                break;
-            case OP_NEGATE: {
-                if (!IS_NUMBER(peek(0))) {
-                    runtime_error("Unary operand must be a number");
-                    return VM_RUNTIME_ERROR;
-                }
+            vm.stack_top = frame->slots;
+            push(result);
+            if (vm.frame_count == base) return VM_OK;
+
+            ENTER_FRAME();
+        } DISPATCH();
+        CASE_CODE(OP_NIL):
+            push(NIL_VAL);
+            DISPATCH();
+        CASE_CODE(OP_TRUE):
+            push(BOOL_VAL(true));
+            DISPATCH();
+        CASE_CODE(OP_FALSE):
+            push(BOOL_VAL(false));
+            DISPATCH();
+        CASE_CODE(OP_NOT):
+            push(BOOL_VAL(is_falsey(pop())));
+            DISPATCH();
+        CASE_CODE(OP_EQUAL): {
+            Value b = pop();
+            Value a = pop();
+            push(BOOL_VAL(values_equal(a, b)));
+        } DISPATCH();
+        CASE_CODE(OP_GREATER):
+            BINARY_OP(BOOL_VAL, >, OP_GREATER_NUM);
+            DISPATCH();
+        CASE_CODE(OP_LESS):
+            BINARY_OP(BOOL_VAL, <, OP_LESS_NUM);
+            DISPATCH();
+        CASE_CODE(OP_GREATER_EQUAL):
+            BINARY_OP(BOOL_VAL, >=, OP_GREATER_EQUAL_NUM);
+            DISPATCH();
+        CASE_CODE(OP_LESS_EQUAL):
+            BINARY_OP(BOOL_VAL, <=, OP_LESS_EQUAL_NUM);
+            DISPATCH();
+        CASE_CODE(OP_NEGATE): {
+            if (!IS_NUMBER(peek(0))) {
+                runtime_error("Unary operand must be a number");
+                return VM_RUNTIME_ERROR;
+            }
 
-                push(NUMBER_VAL(-AS_NUMBER(pop())));
-            } break;
-            case OP_ADD: {
-                if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
-                    concatenate();
-                } else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
-                    double b = AS_NUMBER(pop());
-                    double a = AS_NUMBER(pop());
-                    push(NUMBER_VAL(a + b));
-                } else {
-                    runtime_error("Binary (addition) operands must be numbers or strings");
-                    return VM_RUNTIME_ERROR;
+            push(NUMBER_VAL(-AS_NUMBER(pop())));
+        } DISPATCH();
+        CASE_CODE(OP_ADD): {
+            if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
+                QUICKEN(OP_ADD_STR);
+                concatenate();
+            } else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
+                QUICKEN(OP_ADD_NUM);
+                double b = AS_NUMBER(pop());
+                double a = AS_NUMBER(pop());
+                push(NUMBER_VAL(a + b));
+            } else {
+                runtime_error("Binary (addition) operands must be numbers or strings");
+                return VM_RUNTIME_ERROR;
+            }
+        } DISPATCH();
+        CASE_CODE(OP_SUBTRACT):
+            BINARY_OP(NUMBER_VAL, -, OP_SUBTRACT_NUM);
+            DISPATCH();
+        CASE_CODE(OP_MULTIPLY):
+            BINARY_OP(NUMBER_VAL, *, OP_MULTIPLY_NUM);
+            DISPATCH();
+        CASE_CODE(OP_DIVIDE):
+            BINARY_OP(NUMBER_VAL, /, OP_DIVIDE_NUM);
+            DISPATCH();
+        CASE_CODE(OP_GREATER_NUM):
+            NUMBER_OP(BOOL_VAL, >, OP_GREATER);
+            DISPATCH();
+        CASE_CODE(OP_LESS_NUM):
+            NUMBER_OP(BOOL_VAL, <, OP_LESS);
+            DISPATCH();
+        CASE_CODE(OP_GREATER_EQUAL_NUM):
+            NUMBER_OP(BOOL_VAL, >=, OP_GREATER_EQUAL);
+            DISPATCH();
+        CASE_CODE(OP_LESS_EQUAL_NUM):
+            NUMBER_OP(BOOL_VAL, <=, OP_LESS_EQUAL);
+            DISPATCH();
+        CASE_CODE(OP_ADD_NUM):
+            NUMBER_OP(NUMBER_VAL, +, OP_ADD);
+            DISPATCH();
+        CASE_CODE(OP_ADD_STR): {
+            if (!IS_STRING(peek(0)) || !IS_STRING(peek(1))) {
+                DEOPTIMIZE(OP_ADD);
+            }
+
+            concatenate();
+        } DISPATCH();
+        CASE_CODE(OP_SUBTRACT_NUM):
+            NUMBER_OP(NUMBER_VAL, -, OP_SUBTRACT);
+            DISPATCH();
+        CASE_CODE(OP_MULTIPLY_NUM):
+            NUMBER_OP(NUMBER_VAL, *, OP_MULTIPLY);
+            DISPATCH();
+        CASE_CODE(OP_DIVIDE_NUM):
+            NUMBER_OP(NUMBER_VAL, /, OP_DIVIDE);
+            DISPATCH();
+        CASE_CODE(OP_GET_LOCAL_PROPERTY): {
+            Value receiver = frame->slots[READ_BYTE()];
+
+            // Only a cache hit is handled here. Anything else is left to the
+            // GET_PROPERTY that follows.
+            if (!RECORDING() && IS_INSTANCE(receiver)) {
+                ObjInstance *instance = AS_INSTANCE(receiver);
+                InlineCache *cache = &frame->closure->function->chunk.caches[
+                    (frame->ip[2] << 8) | frame->ip[3]];
+
+                if (cache->shape != NULL && cache->shape == instance->shape) {
+                    STAT_INC(property_hits);
+                    push(instance->slots[cache->slot]);
+                    frame->ip += 4;
+                    DISPATCH();
                 }
-            } break;
-            case OP_SUBTRACT:
-                BINARY_OP(NUMBER_VAL, -);
-                break;
-            case OP_MULTIPLY:
-                BINARY_OP(NUMBER_VAL, *);
-                break;
-            case OP_DIVIDE:
-                BINARY_OP(NUMBER_VAL, /);
-                break;
-        }
+            }
+
+            push(receiver);
+        } DISPATCH();
+        CASE_CODE(OP_LESS_JUMP): {
+            Value b = vm.stack_top[-1];
+            Value a = vm.stack_top[-2];
+            if (!IS_NUMBER(a) || !IS_NUMBER(b)) {
+                runtime_error("Binary (non-addition) operands must be numbers");
+                return VM_RUNTIME_ERROR;
+            }
+
+            COMPARE_JUMP(AS_NUMBER(a) < AS_NUMBER(b));
+        } DISPATCH();
+        CASE_CODE(OP_EQUAL_JUMP):
+            COMPARE_JUMP(values_equal(vm.stack_top[-2], vm.stack_top[-1]));
+            DISPATCH();
+        CASE_CODE(OP_JUMP_IF_FALSE_POP): {
+            uint16_t offset = READ_SHORT();
+            if (is_falsey(peek(0))) {
+                frame->ip += offset;
+            } else if (!RECORDING()) {
+                vm.stack_top--;
+                frame->ip++;
+            }
+        } DISPATCH();
     }
 
+    return VM_RUNTIME_ERROR; // Unreachable
+
+#if TRACE_JIT && COMPUTED_GOTO
+record:
+    frame->ip--;
+    if (vm.recording) trace_record(frame);
+    RECORDING_CHANGED();
+    goto *dispatch_table[READ_BYTE()];
+#endif // TRACE_JIT && COMPUTED_GOTO
+
+#if JIT
+native:
+#if TRACE_JIT
+    if (vm.recording) trace_stop(frame);
+#endif // TRACE_JIT
+
+    switch (jit_enter(frame)) {
+        case JIT_ERROR:
+            return VM_RUNTIME_ERROR;
+        case JIT_DONE:
+            return VM_OK;
+        case JIT_FALLBACK:
+            // Interpret from here until the next call or return. The frame
+            // that gave up may be a callee the native code ran directly.
+            frame = &vm.frames[vm.frame_count - 1];
+            DISPATCH();
+        default:
+            if (vm.frame_count == base) return VM_OK;
+
+            ENTER_FRAME();
+            DISPATCH();
+    }
+#endif // JIT
+
 #undef READ_BYTE
 #undef READ_CONSTANT
 #undef READ_SHORT
 #undef READ_STRING
+#undef READ_CACHE
+#undef READ_LOOP
+#undef QUICKEN
 #undef BINARY_OP
+#undef NUMBER_OP
+#undef DEOPTIMIZE
+#undef RECORDING
+#undef COMPARE_JUMP
+#undef TRACE_INSTRUCTION
+#undef PROFILE_INSTRUCTION
+#undef RECORD_INSTRUCTION
+#undef RECORDING_CHANGED
+#undef INTERPRET_LOOP
+#undef CASE_CODE
+#undef DISPATCH
+#undef ENTER_FRAME
+}
+#endif // REGISTER_VM
+
+#if TRACE_JIT
+/*
+ * Calls made from a trace. A trace never leaves its frame, so a callee that
+ * pushes a frame is run to completion before the trace carries on.
+*/
+static JitStatus finish_trace_call(int frame_count)
+{
+    if (vm.frame_count == frame_count) return JIT_NEXT;
+    return run(frame_count) == VM_OK ? JIT_NEXT : JIT_ERROR;
+}
+
+JitStatus trace_call(int arg_count)
+{
+    int frame_count = vm.frame_count;
+    if (!call_value(peek(arg_count), arg_count)) {
+        return JIT_ERROR;
+    }
+
+    return finish_trace_call(frame_count);
+}
+
+JitStatus trace_invoke(ObjString *name, int arg_count, InlineCache *cache)
+{
+    int frame_count = vm.frame_count;
+    if (!invoke(name, arg_count, cache)) {
+        return JIT_ERROR;
+    }
+
+    return finish_trace_call(frame_count);
+}
+
+JitStatus trace_super_invoke(ObjString *name, int arg_count, InlineCache *cache)
+{
+    int frame_count = vm.frame_count;
+    ObjClass *superclass = AS_CLASS(pop());
+    if (!invoke_from_class(superclass, (Obj *)superclass, name, arg_count, cache)) {
+        return JIT_ERROR;
+    }
+
+    return finish_trace_call(frame_count);
+}
+#endif // TRACE_JIT
+
+#if AOT
+/*
+ * Calls made from code generated by cloxc. Every function in the script has
+ * generated code, so a callee that pushes a frame runs to completion right
+ * here, and the caller carries on once it returns. A callee that makes a tail
+ * call returns early and leaves its frame to the function it called, which
+ * then runs here in turn.
+*/
+static bool finish_aot_call(int frame_count)
+{
+    while (vm.frame_count > frame_count) {
+        CallFrame *callee = &vm.frames[vm.frame_count - 1];
+        if (callee->closure->function->aot == NULL) {
+            return run(frame_count) == VM_OK;
+        }
+
+        if (!callee->closure->function->aot(callee)) return false;
+    }
+
+    return true;
+}
+
+bool aot_call(int arg_count)
+{
+    int frame_count = vm.frame_count;
+    return call_value(peek(arg_count), arg_count) && finish_aot_call(frame_count);
+}
+
+bool aot_tail_call(CallFrame *frame, int arg_count)
+{
+    return tail_call(frame, arg_count);
+}
+
+bool aot_invoke(ObjString *name, int arg_count, InlineCache *cache)
+{
+    int frame_count = vm.frame_count;
+    return invoke(name, arg_count, cache) && finish_aot_call(frame_count);
+}
+
+bool aot_super_invoke(ObjString *name, int arg_count, InlineCache *cache)
+{
+    int frame_count = vm.frame_count;
+    ObjClass *superclass = AS_CLASS(pop());
+    return invoke_from_class(superclass, (Obj *)superclass, name, arg_count, cache) &&
+        finish_aot_call(frame_count);
+}
+
+void aot_return(CallFrame *frame)
+{
+    Value result = pop();
+    close_upvalues(frame->slots);
+    vm.frame_count--;
+
+    if (vm.frame_count == 0) {
+        pop();
+        return;
+    }
+
+    vm.stack_top = frame->slots;
+    push(result);
+}
+
+bool aot_inherit()
+{
+    Value superclass = peek(1);
+    if (!IS_CLASS(superclass)) {
+        runtime_error("Superclass must be a class");
+        return false;
+    }
+
+    ObjClass *subclass = AS_CLASS(peek(0));
+    class_inherit(subclass, AS_CLASS(superclass));
+    pop(); // Subclass
+    return true;
+}
+
+void aot_method(ObjString *name)
+{
+    define_method(name);
+}
+#endif // AOT
+
+/*
+ * Runs the script with its value stack guarded. Whatever was running when a
+ * push hit the guard page is abandoned where it stood, native code included,
+ * and the overflow is reported from the frames it left behind.
+*/
+static VMResult run_guarded(VMResult (*script)())
+{
+    if (STACK_OVERFLOWED()) {
+        guard_stack(false);
+        runtime_error("Stack overflow");
+        return VM_RUNTIME_ERROR;
+    }
+
+    guard_stack(true);
+    VMResult result = script();
+    guard_stack(false);
+    return result;
+}
+
+#if AOT
+static VMResult run_aot()
+{
+    return aot_call(0) ? VM_OK : VM_RUNTIME_ERROR;
+}
+
+VMResult aot_run()
+{
+    return run_guarded(run_aot);
+}
+#endif // AOT
+
+static VMResult run_script()
+{
+#if REGISTER_VM
+    return run_registers();
+#else
+    return run(0);
+#endif // REGISTER_VM
 }
 
-VMResult interpret(const char *source)
+VMResult interpret(const char *source, bool copy_source)
 {
-    ObjFunction *function = compile(source);
+    ObjFunction *function = compile(source, copy_source);
     if (function == NULL) return VM_COMPILE_ERROR;
 
     push(OBJ_VAL(function));
@@ -569,5 +2353,5 @@ VMResult interpret(const char *source)
     push(OBJ_VAL(closure));
     call(closure, 0);
 
-    return run();
+    return run_guarded(run_script);
 }
@@ -6,21 +6,49 @@
 #include "table.h"
 #include "value.h"
 
-#define FRAMES_MAX 64
+#define FRAMES_MAX 1024
 #define STACK_MAX (FRAMES_MAX * UINT8_COUNT)
 
-typedef struct {
+typedef struct CallFrame {
     ObjClosure *closure;
     uint8_t *ip;
     Value *slots;
+#if REGISTER_VM
+    Value *top;     // Just past the frame's last register
+#endif // REGISTER_VM
 } CallFrame;
 
+#if VM_STATS
+typedef struct {
+    uint64_t instructions;
+    uint64_t property_hits;
+    uint64_t property_misses;
+    uint64_t method_hits;
+    uint64_t method_misses;
+    uint64_t method_megamorphic;
+    uint64_t accessors_inlined;
+    uint64_t objects_allocated;
+    uint64_t traces_formed;
+    uint64_t traces_aborted;
+    uint64_t traces_retired;
+    uint64_t side_exits;
+} VMStats;
+
+#define STAT_INC(counter)   (vm.stats.counter++)
+#else
+#define STAT_INC(counter)   ((void)0)
+#endif // VM_STATS
+
 typedef struct {
     CallFrame frames[FRAMES_MAX];
     int frame_count;
-    Value stack[STACK_MAX];
+    Value *stack;       // STACK_MAX Values, reserved by reserve_stack()
     Value *stack_top;
-    Table globals;
+    Table global_slots;
+    ValueArray globals;
+    Table selectors;
+    int selector_count;
+    int init_selector;
     Table strings;
     ObjString *init_string;
     ObjUpvalue *open_upvalues;
@@ -31,6 +59,14 @@ typedef struct {
     int gray_capacity;
     int gray_count;
     Obj **gray_stack;
+
+#if TRACE_JIT
+    bool recording;
+#endif // TRACE_JIT
+
+#if VM_STATS
+    VMStats stats;
+#endif // VM_STATS
 } VM;
 
 typedef enum {
@@ -45,6 +81,9 @@ void init_vm();
 void free_vm();
 void push(Value value);
 Value pop();
-VMResult interpret(const char *source);
+VMResult interpret(const char *source, bool copy_source);
+int global_slot(ObjString *name);
+ObjString *global_name(int slot);
+int method_selector(ObjString *name);
 
 #endif // CLOX_VM_H
\ No newline at end of file
@@ -0,0 +1,107 @@
+// mmap() and MAP_ANONYMOUS are hidden behind feature macros in strict C99.
+#define _DEFAULT_SOURCE
+
+#include "common.h"
+
+#if JIT || TRACE_JIT
+
+#include <sys/mman.h>
+#include "x64.h"
+
+typedef JitStatus (*JitEntry)(CallFrame *frame, uint8_t *resume);
+
+static JitEntry entry = NULL;
+
+/*
+ * The one entry point shared by all native code. It sets up the registers and
+ * jumps to the resume address, so the call into it from enter_code() always
+ * goes to the same place and predicts well however much code is compiled.
+ * Five pushes on top of the return address leave rsp 16-byte aligned for the
+ * helper calls.
+*/
+static void entry_stub(Emitter *e)
+{
+    push_reg(e, RBX);
+    push_reg(e, R12);
+    push_reg(e, R13);
+    push_reg(e, R14);
+    push_reg(e, R15);
+
+    mov_reg(e, FRAME, RDI);
+    load(e, SLOTS, FRAME, offsetof(CallFrame, slots));
+    mov_imm(e, TOP_PTR, (uint64_t)(uintptr_t)&vm.stack_top);
+    load(e, TOP, TOP_PTR, 0);
+#ifdef NAN_BOXING
+    mov_imm(e, NAN_REG, QNAN);
+#endif // NAN_BOXING
+
+    emit_byte(e, 0xff);
+    emit_byte(e, 0xe6); // jmp rsi
+}
+
+void init_emitter(Emitter *e)
+{
+    e->code = NULL;
+    e->count = 0;
+    e->capacity = 0;
+    e->fixups = NULL;
+    e->fixup_count = 0;
+    e->fixup_capacity = 0;
+    e->entries = NULL;
+    e->epilogue = 0;
+}
+
+/*
+ * Copies the emitted code into fresh pages and flips them to executable, so
+ * no page is ever writable and executable at once. Frees the emitter's code
+ * buffer either way.
+*/
+static uint8_t *map_code(Emitter *e)
+{
+    size_t size = (size_t)e->count;
+    uint8_t *code = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (code != MAP_FAILED) {
+        memcpy(code, e->code, size);
+        if (mprotect(code, size, PROT_READ | PROT_EXEC) != 0) {
+            munmap(code, size);
+            code = MAP_FAILED;
+        }
+    }
+
+    FREE_ARRAY(uint8_t, e->code, e->capacity);
+    return code != MAP_FAILED ? code : NULL;
+}
+
+// Installs the emitted code, along with the entry stub the first time round.
+uint8_t *install_code(Emitter *e)
+{
+    if (entry == NULL) {
+        Emitter stub;
+        init_emitter(&stub);
+        entry_stub(&stub);
+
+        void *code = map_code(&stub);
+        if (code == NULL) {
+            FREE_ARRAY(uint8_t, e->code, e->capacity);
+            return NULL;
+        }
+
+        memcpy(&entry, &code, sizeof(entry));
+    }
+
+    return map_code(e);
+}
+
+// Runs native code from `code` on behalf of the frame.
+JitStatus enter_code(CallFrame *frame, uint8_t *code)
+{
+    return entry(frame, code);
+}
+
+void free_code(uint8_t *code, size_t size)
+{
+    munmap(code, size);
+}
+
+#endif // JIT || TRACE_JIT
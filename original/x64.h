@@ -0,0 +1,477 @@
+#ifndef CLOX_X64_H
+#define CLOX_X64_H
+
+#include "common.h"
+
+#if JIT || TRACE_JIT
+
+#include <stddef.h>
+#include <string.h>
+#include "jit.h"
+#include "memory.h"
+#include "vm.h"
+
+/*
+ * A small x86-64 assembler shared by the baseline JIT in jit.c and the trace
+ * compiler in trace.c. Both generate code that runs on the VM's own stack and
+ * frames, entered through one shared stub.
+ *
+ * While native code runs, a few VM registers live in callee-saved machine
+ * registers:
+ *
+ *   rbx  the CallFrame being run
+ *   r12  frame->slots
+ *   r13  &vm.stack_top
+ *   r14  vm.stack_top, written back around every helper call
+ *   r15  QNAN, for the number checks
+*/
+
+typedef enum {
+    RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+    R8, R9, R10, R11, R12, R13, R14, R15
+} Register;
+
+#define FRAME   RBX
+#define SLOTS   R12
+#define TOP_PTR R13
+#define TOP     R14
+#define NAN_REG R15
+
+typedef enum {
+    CC_AE = 0x3,
+    CC_E  = 0x4,
+    CC_NE = 0x5,
+    CC_A  = 0x7
+} Condition;
+
+#define VALUE_SIZE  ((int)sizeof(Value))
+
+typedef struct {
+    int at;     // Where the rel32 operand is in the machine code
+    int target; // The bytecode offset it jumps to
+} Fixup;
+
+typedef struct {
+    uint8_t *code;
+    int count;
+    int capacity;
+    Fixup *fixups;
+    int fixup_count;
+    int fixup_capacity;
+    uint32_t *entries;
+    int epilogue;
+} Emitter;
+
+static inline void emit_byte(Emitter *e, uint8_t byte)
+{
+    if (e->capacity < e->count + 1) {
+        int old = e->capacity;
+        e->capacity = GROW_CAPACITY(old);
+        e->code = GROW_ARRAY(uint8_t, e->code, old, e->capacity);
+    }
+
+    e->code[e->count++] = byte;
+}
+
+static inline void emit_u32(Emitter *e, uint32_t value)
+{
+    for (int i = 0; i < 4; i++) {
+        emit_byte(e, (uint8_t)(value >> (i * 8)));
+    }
+}
+
+static inline void emit_u64(Emitter *e, uint64_t value)
+{
+    for (int i = 0; i < 8; i++) {
+        emit_byte(e, (uint8_t)(value >> (i * 8)));
+    }
+}
+
+static inline void patch_u32(Emitter *e, int at, uint32_t value)
+{
+    for (int i = 0; i < 4; i++) {
+        e->code[at + i] = (uint8_t)(value >> (i * 8));
+    }
+}
+
+// Points the rel32 at `at` to the current position.
+static inline void patch_here(Emitter *e, int at)
+{
+    patch_u32(e, at, (uint32_t)(e->count - (at + 4)));
+}
+
+static inline void emit_rex(Emitter *e, bool wide, int reg, int rm)
+{
+    uint8_t rex = 0x40 | (wide ? 0x08 : 0) | ((reg & 8) ? 0x04 : 0) | ((rm & 8) ? 0x01 : 0);
+    if (rex != 0x40) emit_byte(e, rex);
+}
+
+static inline void emit_modrm_reg(Emitter *e, int reg, int rm)
+{
+    emit_byte(e, 0xc0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+// [base + disp32]. rsp and r12 as a base need a SIB byte.
+static inline void emit_modrm_mem(Emitter *e, int reg, int base, int32_t disp)
+{
+    emit_byte(e, 0x80 | ((reg & 7) << 3) | (base & 7));
+    if ((base & 7) == RSP) emit_byte(e, 0x24);
+    emit_u32(e, (uint32_t)disp);
+}
+
+// mov reg, imm64
+static inline void mov_imm(Emitter *e, Register reg, uint64_t value)
+{
+    emit_rex(e, true, 0, reg);
+    emit_byte(e, 0xb8 + (reg & 7));
+    emit_u64(e, value);
+}
+
+// mov eax, imm32
+static inline void mov_eax_imm(Emitter *e, uint32_t value)
+{
+    emit_byte(e, 0xb8);
+    emit_u32(e, value);
+}
+
+// mov reg, [base + disp]
+static inline void load(Emitter *e, Register reg, Register base, int32_t disp)
+{
+    emit_rex(e, true, reg, base);
+    emit_byte(e, 0x8b);
+    emit_modrm_mem(e, reg, base, disp);
+}
+
+// mov [base + disp], reg
+static inline void store(Emitter *e, Register base, int32_t disp, Register reg)
+{
+    emit_rex(e, true, reg, base);
+    emit_byte(e, 0x89);
+    emit_modrm_mem(e, reg, base, disp);
+}
+
+// movsxd reg, dword [base + disp]
+static inline void load_int(Emitter *e, Register reg, Register base, int32_t disp)
+{
+    emit_rex(e, true, reg, base);
+    emit_byte(e, 0x63);
+    emit_modrm_mem(e, reg, base, disp);
+}
+
+// mov dst, src
+static inline void mov_reg(Emitter *e, Register dst, Register src)
+{
+    emit_rex(e, true, src, dst);
+    emit_byte(e, 0x89);
+    emit_modrm_reg(e, src, dst);
+}
+
+// add/or/and/sub/xor/cmp dst, src, picked by the r/m64, r64 opcode.
+static inline void alu_reg(Emitter *e, uint8_t opcode, Register dst, Register src)
+{
+    emit_rex(e, true, src, dst);
+    emit_byte(e, opcode);
+    emit_modrm_reg(e, src, dst);
+}
+
+#define ADD_RR  0x01
+#define AND_RR  0x21
+#define XOR_RR  0x31
+#define CMP_RR  0x39
+#define TEST_RR 0x85
+
+// add/sub reg, imm32, picked by the /digit of opcode 0x81.
+static inline void alu_imm(Emitter *e, int digit, Register reg, int32_t value)
+{
+    emit_rex(e, true, 0, reg);
+    emit_byte(e, 0x81);
+    emit_modrm_reg(e, digit, reg);
+    emit_u32(e, (uint32_t)value);
+}
+
+static inline void add_imm(Emitter *e, Register reg, int32_t value)
+{
+    alu_imm(e, 0, reg, value);
+}
+
+static inline void sub_imm(Emitter *e, Register reg, int32_t value)
+{
+    alu_imm(e, 5, reg, value);
+}
+
+// cmp dword [base + disp], imm32
+static inline void cmp_int_imm(Emitter *e, Register base, int32_t disp, int32_t value)
+{
+    emit_rex(e, false, 0, base);
+    emit_byte(e, 0x81);
+    emit_modrm_mem(e, 7, base, disp);
+    emit_u32(e, (uint32_t)value);
+}
+
+// sub dword [base + disp], imm8
+static inline void sub_int_imm(Emitter *e, Register base, int32_t disp, int8_t value)
+{
+    emit_rex(e, false, 0, base);
+    emit_byte(e, 0x83);
+    emit_modrm_mem(e, 5, base, disp);
+    emit_byte(e, (uint8_t)value);
+}
+
+// shl reg, imm8
+static inline void shl_imm(Emitter *e, Register reg, uint8_t count)
+{
+    emit_rex(e, true, 0, reg);
+    emit_byte(e, 0xc1);
+    emit_modrm_reg(e, 4, reg);
+    emit_byte(e, count);
+}
+
+// setcc al; movzx eax, al
+static inline void set_condition(Emitter *e, Condition cc)
+{
+    emit_byte(e, 0x0f);
+    emit_byte(e, 0x90 | cc);
+    emit_byte(e, 0xc0);
+    emit_byte(e, 0x0f);
+    emit_byte(e, 0xb6);
+    emit_byte(e, 0xc0);
+}
+
+// Returns where the rel32 operand went so the caller can patch it.
+static inline int jump(Emitter *e)
+{
+    emit_byte(e, 0xe9);
+    emit_u32(e, 0);
+    return e->count - 4;
+}
+
+static inline int jump_if(Emitter *e, Condition cc)
+{
+    emit_byte(e, 0x0f);
+    emit_byte(e, 0x80 | cc);
+    emit_u32(e, 0);
+    return e->count - 4;
+}
+
+static inline void jump_to(Emitter *e, int at, int target)
+{
+    patch_u32(e, at, (uint32_t)(target - (at + 4)));
+}
+
+// Jumps to the machine code for a bytecode offset, which may not exist yet.
+static inline void add_fixup(Emitter *e, int at, int target)
+{
+    if (e->fixup_capacity < e->fixup_count + 1) {
+        int old = e->fixup_capacity;
+        e->fixup_capacity = GROW_CAPACITY(old);
+        e->fixups = GROW_ARRAY(Fixup, e->fixups, old, e->fixup_capacity);
+    }
+
+    e->fixups[e->fixup_count].at = at;
+    e->fixups[e->fixup_count].target = target;
+    e->fixup_count++;
+}
+
+static inline void push_reg(Emitter *e, Register reg)
+{
+    emit_rex(e, false, 0, reg);
+    emit_byte(e, 0x50 + (reg & 7));
+}
+
+static inline void pop_reg(Emitter *e, Register reg)
+{
+    emit_rex(e, false, 0, reg);
+    emit_byte(e, 0x58 + (reg & 7));
+}
+
+// Copies a Value a word at a time through rcx, whatever its representation.
+static inline void copy_value(Emitter *e, Register dst, int32_t dst_disp, Register src, int32_t src_disp)
+{
+    for (int i = 0; i < VALUE_SIZE; i += 8) {
+        load(e, RCX, src, src_disp + i);
+        store(e, dst, dst_disp + i, RCX);
+    }
+}
+
+static inline void push_constant(Emitter *e, Value value)
+{
+    uint64_t words[sizeof(Value) / 8];
+    memcpy(words, &value, sizeof(Value));
+
+    for (int i = 0; i < VALUE_SIZE / 8; i++) {
+        mov_imm(e, RAX, words[i]);
+        store(e, TOP, i * 8, RAX);
+    }
+
+    add_imm(e, TOP, VALUE_SIZE);
+}
+
+// Records where the next instruction will resume, for error line numbers and
+// for returning into this frame after a call.
+static inline void sync_ip(Emitter *e, uint8_t *ip)
+{
+    mov_imm(e, RAX, (uint64_t)(uintptr_t)ip);
+    store(e, FRAME, offsetof(CallFrame, ip), RAX);
+}
+
+#define HELPER(fn)  ((uint64_t)(uintptr_t)(fn))
+
+// Calls a runtime helper. Helpers push and pop through vm.stack_top, so the
+// cached stack top is written back before the call and reloaded after it.
+static inline void call_helper(Emitter *e, uint64_t helper)
+{
+    store(e, TOP_PTR, 0, TOP);
+    mov_imm(e, RAX, helper);
+    emit_byte(e, 0xff);
+    emit_byte(e, 0xd0); // call rax
+    load(e, TOP, TOP_PTR, 0);
+}
+
+// Leaves the native code unless the helper returned JIT_NEXT.
+static inline void check_status(Emitter *e)
+{
+    emit_byte(e, 0x83);
+    emit_byte(e, 0xf8);
+    emit_byte(e, JIT_NEXT); // cmp eax, JIT_NEXT
+    jump_to(e, jump_if(e, CC_NE), e->epilogue);
+}
+
+// Each function starts with its own copy of the exit sequence, which undoes
+// entry_stub(). Returns with the status already in eax.
+static inline void epilogue(Emitter *e)
+{
+    e->epilogue = e->count;
+    store(e, TOP_PTR, 0, TOP);
+    pop_reg(e, R15);
+    pop_reg(e, R14);
+    pop_reg(e, R13);
+    pop_reg(e, R12);
+    pop_reg(e, RBX);
+    emit_byte(e, 0xc3); // ret
+}
+
+static inline void operator_helper(Emitter *e, OpCode op)
+{
+    mov_imm(e, RDI, op);
+    call_helper(e, HELPER(jit_operator));
+    check_status(e);
+}
+
+// Leaves the address of vm.globals.values[slot] in rax. The array can move
+// when a later compile adds globals, so it is loaded fresh each time.
+static inline void global_address(Emitter *e, int slot)
+{
+    mov_imm(e, RAX, (uint64_t)(uintptr_t)&vm.globals.values);
+    load(e, RAX, RAX, 0);
+    add_imm(e, RAX, slot * VALUE_SIZE);
+}
+
+#ifdef NAN_BOXING
+// Jumps to the returned rel32 unless reg holds a number. Clobbers rdx.
+static inline int jump_if_not_number(Emitter *e, Register reg)
+{
+    mov_reg(e, RDX, reg);
+    alu_reg(e, AND_RR, RDX, NAN_REG);
+    alu_reg(e, CMP_RR, RDX, NAN_REG);
+    return jump_if(e, CC_E);
+}
+
+// Jumps to the returned rel32 unless both registers hold objects. Clobbers
+// rax and rsi.
+static inline int jump_unless_objects(Emitter *e, Register a, Register b)
+{
+    mov_reg(e, RAX, a);
+    alu_reg(e, AND_RR, RAX, b);
+    mov_imm(e, RSI, SIGN_BIT | QNAN);
+    alu_reg(e, AND_RR, RAX, RSI);
+    alu_reg(e, CMP_RR, RAX, RSI);
+    return jump_if(e, CC_NE);
+}
+
+// Jumps to the returned rel32s if rax is nil or false.
+static inline void jump_if_falsey(Emitter *e, int *if_nil, int *if_false)
+{
+    mov_imm(e, RCX, NIL_VAL);
+    alu_reg(e, CMP_RR, RAX, RCX);
+    *if_nil = jump_if(e, CC_E);
+    mov_imm(e, RCX, FALSE_VAL);
+    alu_reg(e, CMP_RR, RAX, RCX);
+    *if_false = jump_if(e, CC_E);
+}
+
+/*
+ * Applies a binary operator to the numbers in rax and rcx with SSE2 and
+ * leaves the resulting Value in rax. Comparisons produce a Lox boolean.
+*/
+static inline void number_op(Emitter *e, OpCode op)
+{
+    static const uint8_t movq_xmm0_rax[] = { 0x66, 0x48, 0x0f, 0x6e, 0xc0 };
+    static const uint8_t movq_xmm1_rcx[] = { 0x66, 0x48, 0x0f, 0x6e, 0xc9 };
+    for (int i = 0; i < 5; i++) emit_byte(e, movq_xmm0_rax[i]);
+    for (int i = 0; i < 5; i++) emit_byte(e, movq_xmm1_rcx[i]);
+
+    switch (op) {
+        case OP_GREATER:
+        case OP_LESS:
+        case OP_GREATER_EQUAL:
+        case OP_LESS_EQUAL:
+            // ucomisd sets CF and ZF on unordered operands, so "above" and
+            // "above or equal" are false whenever either side is NaN, just
+            // like the C comparisons.
+            emit_byte(e, 0x66);
+            emit_byte(e, 0x0f);
+            emit_byte(e, 0x2e);
+            emit_byte(e, op == OP_GREATER || op == OP_GREATER_EQUAL
+                ? 0xc1 : 0xc8); // ucomisd a, b or b, a
+            set_condition(e, op == OP_GREATER || op == OP_LESS ? CC_A : CC_AE);
+            mov_imm(e, RCX, FALSE_VAL);
+            alu_reg(e, ADD_RR, RAX, RCX); // TRUE_VAL is FALSE_VAL + 1
+            break;
+        case OP_EQUAL:
+            // ucomisd sets ZF on unordered operands too, so NaN is only kept
+            // from equalling itself by also checking that PF is clear.
+            emit_byte(e, 0x66);
+            emit_byte(e, 0x0f);
+            emit_byte(e, 0x2e);
+            emit_byte(e, 0xc1); // ucomisd xmm0, xmm1
+            emit_byte(e, 0x0f);
+            emit_byte(e, 0x94);
+            emit_byte(e, 0xc0); // sete al
+            emit_byte(e, 0x0f);
+            emit_byte(e, 0x9b);
+            emit_byte(e, 0xc1); // setnp cl
+            emit_byte(e, 0x20);
+            emit_byte(e, 0xc8); // and al, cl
+            emit_byte(e, 0x0f);
+            emit_byte(e, 0xb6);
+            emit_byte(e, 0xc0); // movzx eax, al
+            mov_imm(e, RCX, FALSE_VAL);
+            alu_reg(e, ADD_RR, RAX, RCX);
+            break;
+        default: {
+            uint8_t sse = op == OP_ADD ? 0x58 : op == OP_SUBTRACT ? 0x5c
+                        : op == OP_MULTIPLY ? 0x59 : 0x5e;
+            emit_byte(e, 0xf2);
+            emit_byte(e, 0x0f);
+            emit_byte(e, sse);
+            emit_byte(e, 0xc1); // op xmm0, xmm1
+
+            emit_byte(e, 0x66);
+            emit_byte(e, 0x48);
+            emit_byte(e, 0x0f);
+            emit_byte(e, 0x7e);
+            emit_byte(e, 0xc0); // movq rax, xmm0
+        } break;
+    }
+}
+
+#endif // NAN_BOXING
+
+void init_emitter(Emitter *e);
+uint8_t *install_code(Emitter *e);
+JitStatus enter_code(CallFrame *frame, uint8_t *code);
+void free_code(uint8_t *code, size_t size);
+
+#endif // JIT || TRACE_JIT
+
+#endif // CLOX_X64_H
@@ -14,8 +14,8 @@
  * Defaults to enabled.
 */
 #ifndef NAN_TAGGING
-    #define NAN_TAGGING 0
-#endif // WREN_NAN_TAGGING
+    #define NAN_TAGGING 1
+#endif // NAN_TAGGING
 
 /*
  * Below are various debugging flags that are useful when hacking on the VM.
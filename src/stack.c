@@ -0,0 +1,147 @@
+// MAP_ANONYMOUS is hidden behind feature macros in strict C99.
+#define _DEFAULT_SOURCE
+
+#include <stdlib.h>
+
+#include "stack.h"
+
+#ifdef _WIN32
+    #include <windows.h>
+#else
+    #include <sys/mman.h>
+    #include <unistd.h>
+
+    #ifndef MAP_NORESERVE
+        #define MAP_NORESERVE 0
+    #endif // MAP_NORESERVE
+#endif // _WIN32
+
+//------------------------------------------------------------------------------
+
+static size_t pageSize()
+{
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwPageSize;
+#else
+    return (size_t)sysconf(_SC_PAGESIZE);
+#endif // _WIN32
+}
+
+static size_t stackSize(size_t count)
+{
+    size_t page = pageSize();
+    return (sizeof(Value) * count + page - 1) / page * page;
+}
+
+#ifdef _WIN32
+
+/*
+ * Windows has no MAP_NORESERVE, and committing a page charges it against the
+ * commit limit whether it is touched or not. So stacks are only reserved, and
+ * onFault() commits a page the first time anything touches it. Each VM has its
+ * own stack, so the handler looks the address up among all of them.
+*/
+typedef struct StackRange
+{
+    uint8_t *start;
+    uint8_t *end;   // Just past the last page that may be committed
+    struct StackRange *next;
+} StackRange;
+
+static StackRange *ranges = NULL;
+static PVOID faultHandler = NULL;
+
+static LONG CALLBACK onFault(EXCEPTION_POINTERS *exception)
+{
+    EXCEPTION_RECORD *record = exception->ExceptionRecord;
+    if (record->ExceptionCode != EXCEPTION_ACCESS_VIOLATION ||
+        record->NumberParameters < 2)
+    {
+        return EXCEPTION_CONTINUE_SEARCH;
+    }
+
+    uint8_t *address = (uint8_t *)record->ExceptionInformation[1];
+    for (StackRange *range = ranges; range != NULL; range = range->next)
+    {
+        if (address < range->start || address >= range->end) continue;
+
+        size_t page = pageSize();
+        uint8_t *start = range->start +
+            (size_t)(address - range->start) / page * page;
+        if (VirtualAlloc(start, page, MEM_COMMIT, PAGE_READWRITE) == NULL)
+        {
+            return EXCEPTION_CONTINUE_SEARCH;
+        }
+
+        return EXCEPTION_CONTINUE_EXECUTION;
+    }
+
+    // The guard page and everything else are left to the next handler.
+    return EXCEPTION_CONTINUE_SEARCH;
+}
+
+#endif // _WIN32
+
+Value *reserveStack(size_t count)
+{
+    size_t size = stackSize(count);
+    size_t guard = pageSize();
+
+#ifdef _WIN32
+    StackRange *range = (StackRange *)malloc(sizeof(StackRange));
+    if (range == NULL) return NULL;
+
+    uint8_t *stack = (uint8_t *)VirtualAlloc(NULL, size + guard, MEM_RESERVE,
+        PAGE_NOACCESS);
+    if (stack == NULL)
+    {
+        free(range);
+        return NULL;
+    }
+
+    if (faultHandler == NULL)
+    {
+        faultHandler = AddVectoredExceptionHandler(1, onFault);
+    }
+
+    range->start = stack;
+    range->end = stack + size;
+    range->next = ranges;
+    ranges = range;
+#else
+    uint8_t *stack = (uint8_t *)mmap(NULL, size + guard,
+        PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+        -1, 0);
+    if (stack == MAP_FAILED) return NULL;
+
+    if (mprotect(stack + size, guard, PROT_NONE) != 0)
+    {
+        munmap(stack, size + guard);
+        return NULL;
+    }
+#endif // _WIN32
+
+    return (Value *)stack;
+}
+
+void releaseStack(Value *stack, size_t count)
+{
+#ifdef _WIN32
+    (void)count;
+    for (StackRange **range = &ranges; *range != NULL; range = &(*range)->next)
+    {
+        if ((*range)->start != (uint8_t *)stack) continue;
+
+        StackRange *released = *range;
+        *range = released->next;
+        free(released);
+        break;
+    }
+
+    VirtualFree(stack, 0, MEM_RELEASE);
+#else
+    munmap(stack, stackSize(count) + pageSize());
+#endif // _WIN32
+}
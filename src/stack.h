@@ -0,0 +1,22 @@
+#ifndef LOX_STACK_H
+#define LOX_STACK_H
+
+#include "value.h"
+
+//------------------------------------------------------------------------------
+
+/*
+ * A VM's value stack is a block of address space reserved for STACK_MAX
+ * Values, with a guard page after it. Only the pages the stack actually
+ * reaches are backed by memory, so a VM that never runs deep costs a few
+ * pages rather than the whole stack. The block never moves, so pointers into
+ * it stay valid for as long as the VM lives.
+ *
+ * Pushes are not bounds checked. Running off the end faults on the guard page
+ * instead of writing over whatever follows the stack.
+*/
+
+Value *reserveStack(size_t count);
+void releaseStack(Value *stack, size_t count);
+
+#endif // LOX_STACK_H
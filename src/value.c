@@ -11,11 +11,50 @@ DEFINE_ARRAY(Value, Value);
 
 void printValue(Value value)
 {
-    printf("%.16g", value);
+    if (IS_NUM(value))
+    {
+        printf("%.16g", AS_NUM(value));
+    }
+    else if (IS_BOOL(value))
+    {
+        printf(AS_BOOL(value) ? "true" : "false");
+    }
+    else if (IS_NIL(value))
+    {
+        printf("nil");
+    }
+    else
+    {
+        switch (AS_OBJ(value)->type)
+        {
+            case OBJ_FUN:
+                printf("<fun>");
+                break;
+        }
+    }
+}
+
+bool valuesEqual(Value a, Value b)
+{
+#if NAN_TAGGING
+    // NaN is not equal to itself, so numbers have to be compared as doubles.
+    if (IS_NUM(a) && IS_NUM(b)) return AS_NUM(a) == AS_NUM(b);
+    return a == b;
+#else
+    if (a.type != b.type) return false;
+
+    switch (a.type)
+    {
+        case VAL_NUM: return AS_NUM(a) == AS_NUM(b);
+        case VAL_OBJ: return AS_OBJ(a) == AS_OBJ(b);
+        default:      return true;
+    }
+#endif // NAN_TAGGING
 }
 
 void initFun(ObjFun *fun)
 {
+    fun->obj.type = OBJ_FUN;
     initByteArray(&fun->code);
     initLineArray(&fun->lines);
     initValueArray(&fun->constants);
@@ -2,15 +2,122 @@
 #define LOX_VALUE_H
 
 #include "array.h"
+#include "common.h"
 #include "lox.h"
 
 //------------------------------------------------------------------------------
 
 // Forward Declared Types
+typedef struct Obj Obj;
 typedef struct ObjFun ObjFun;
 typedef struct Line Line;
 
-typedef double Value;
+typedef enum
+{
+    OBJ_FUN,
+} ObjType;
+
+/*
+ * The header at the start of every object. A Value holding an object points
+ * at this, so the object's type can be checked before it is cast.
+*/
+struct Obj
+{
+    ObjType type;
+};
+
+#if NAN_TAGGING
+
+/*
+ * A NaN-tagged double.
+ *
+ * A double is a NaN when all of its exponent bits are set. Only one bit of
+ * the mantissa is needed to make it a quiet NaN, which leaves the rest of the
+ * mantissa unused by any real number:
+ *
+ *     [-] [11111111111] [1] [1] [00 ... 00]
+ *      |        |        |   |       '- 50 bits of payload
+ *      |        |        |   '- Intel's "QNaN Floating-Point Indefinite"
+ *      |        |        '- Quiet NaN bit
+ *      |        '- Exponent
+ *      '- Sign bit
+ *
+ * Any value that isn't a quiet NaN with these bits is a number. Objects set
+ * the sign bit and store their pointer, which only ever uses the low 48 bits,
+ * in the payload. The singletons (nil, true and false) leave the sign bit
+ * clear and store a small tag in the low bits instead.
+*/
+typedef uint64_t Value;
+
+#define SIGN_BIT            ((uint64_t)1 << 63)
+#define QNAN                ((uint64_t)0x7ffc000000000000)
+
+#define TAG_NIL             1
+#define TAG_FALSE           2
+#define TAG_TRUE            3
+
+#define IS_BOOL(value)      (((value) | 1) == TRUE_VAL)
+#define IS_NIL(value)       ((value) == NIL_VAL)
+#define IS_NUM(value)       (((value) & QNAN) != QNAN)
+#define IS_OBJ(value)       (((value) & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT))
+
+#define AS_BOOL(value)      ((value) == TRUE_VAL)
+#define AS_NUM(value)       valueToNum(value)
+#define AS_OBJ(value)       ((Obj *)(uintptr_t)((value) & ~(SIGN_BIT | QNAN)))
+
+#define FALSE_VAL           ((Value)(uint64_t)(QNAN | TAG_FALSE))
+#define NIL_VAL             ((Value)(uint64_t)(QNAN | TAG_NIL))
+#define TRUE_VAL            ((Value)(uint64_t)(QNAN | TAG_TRUE))
+#define NUM_VAL(num)        numToValue(num)
+#define OBJ_VAL(obj)        ((Value)(SIGN_BIT | QNAN | (uint64_t)(uintptr_t)(obj)))
+
+#else
+
+typedef enum
+{
+    VAL_FALSE,
+    VAL_NIL,
+    VAL_NUM,
+    VAL_TRUE,
+    VAL_OBJ
+} ValueType;
+
+/*
+ * A tagged union. It is twice the size of a NaN-tagged Value, but every part
+ * of it can be read in a debugger as is.
+*/
+typedef struct
+{
+    ValueType type;
+    union
+    {
+        double num;
+        Obj *obj;
+    } as;
+} Value;
+
+#define IS_BOOL(value)      ((value).type == VAL_FALSE || (value).type == VAL_TRUE)
+#define IS_NIL(value)       ((value).type == VAL_NIL)
+#define IS_NUM(value)       ((value).type == VAL_NUM)
+#define IS_OBJ(value)       ((value).type == VAL_OBJ)
+
+#define AS_BOOL(value)      ((value).type == VAL_TRUE)
+#define AS_NUM(value)       ((value).as.num)
+#define AS_OBJ(value)       ((value).as.obj)
+
+#define FALSE_VAL           ((Value) { VAL_FALSE, { .num = 0 } })
+#define NIL_VAL             ((Value) { VAL_NIL, { .num = 0 } })
+#define TRUE_VAL            ((Value) { VAL_TRUE, { .num = 0 } })
+#define NUM_VAL(value)      ((Value) { VAL_NUM, { .num = (value) } })
+#define OBJ_VAL(value)      ((Value) { VAL_OBJ, { .obj = (Obj *)(value) } })
+
+#endif // NAN_TAGGING
+
+#define BOOL_VAL(boolean)   ((boolean) ? TRUE_VAL : FALSE_VAL)
+
+#define IS_OBJ_TYPE(value, objType) (IS_OBJ(value) && AS_OBJ(value)->type == (objType))
+#define IS_FUN(value)       IS_OBJ_TYPE(value, OBJ_FUN)
+#define AS_FUN(value)       ((ObjFun *)AS_OBJ(value))
 
 DECLARE_ARRAY(uint8_t, Byte);
 DECLARE_ARRAY(Line, Line);
@@ -18,6 +125,7 @@ DECLARE_ARRAY(Value, Value);
 
 struct ObjFun
 {
+    Obj obj;
     ByteArray code;
     LineArray lines;
     ValueArray constants;
@@ -31,8 +139,35 @@ struct Line
 
 //------------------------------------------------------------------------------
 
+#if NAN_TAGGING
+
+// Reinterprets the bits of a Value as a double, and back. A union is the one
+// way to do this that every compiler we support gets right without a copy.
+typedef union
+{
+    uint64_t bits;
+    double num;
+} DoubleBits;
+
+static inline double valueToNum(Value value)
+{
+    DoubleBits data;
+    data.bits = value;
+    return data.num;
+}
+
+static inline Value numToValue(double num)
+{
+    DoubleBits data;
+    data.num = num;
+    return data.bits;
+}
+
+#endif // NAN_TAGGING
+
 // Value functions
 void printValue(Value value);
+bool valuesEqual(Value a, Value b);
 
 // Object functions
 void initFun(ObjFun *fun);
@@ -1,5 +1,6 @@
 #include "memory.h"
 #include "opcode.h"
+#include "stack.h"
 #include "vm.h"
 
 #ifdef DEBUG
@@ -27,6 +28,14 @@ static void resetStack(LoxVM *vm)
 LoxVM *newVM()
 {
     LoxVM *vm = (LoxVM *)__reallocate(NULL, sizeof(LoxVM));
+    if (vm == NULL) return NULL;
+
+    vm->stack = reserveStack(STACK_MAX);
+    if (vm->stack == NULL)
+    {
+        __reallocate(vm, 0);
+        return NULL;
+    }
 
     vm->fun = NULL;
     vm->ip = NULL;
@@ -39,6 +48,7 @@ LoxVM *newVM()
 
 void freeVM(LoxVM *vm)
 {
+    releaseStack(vm->stack, STACK_MAX);
     FREE(LoxVM, vm, vm);
 }
 
@@ -47,7 +57,7 @@ InterpretResult interpret(LoxVM *vm, const char *source)
     ObjFun fun;
     initFun(&fun);
 
-    uint32_t constant = addConstantFun(vm, &fun, 69);
+    uint32_t constant = addConstantFun(vm, &fun, NUM_VAL(69));
     writeFun(vm, &fun, CODE_CONSTANT, 1);
     writeFun(vm, &fun, (constant >> 8) & 0xff, 1);
     writeFun(vm, &fun, constant & 0xff, 1);
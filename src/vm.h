@@ -15,7 +15,7 @@ struct LoxVM
 {
     ObjFun *fun;
     uint8_t *ip;
-    Value stack[STACK_MAX];
+    Value *stack; // STACK_MAX Values, reserved by reserveStack()
     Value *stackTop;
     size_t bytes_allocated;
     ReallocateFn reallocate;